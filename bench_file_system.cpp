@@ -0,0 +1,99 @@
+#include <benchmark/benchmark.h>
+#include "io_uring_file_system.h"
+#include "logger.h"
+#include "real_file_system.h"
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+// RealFileSystem against IoUringFileSystem: raw handle appends, rotation-heavy
+// logging (renames and unlinks), and backup copies. Arguments are the append
+// size and 0 for RealFileSystem, 1 for IoUringFileSystem.
+
+static const char* kBenchDir = "/tmp/logger_fs_bench";
+
+static std::shared_ptr<RealFileSystem> makeFileSystem(int backend) {
+    if (backend == 1) {
+        return std::make_shared<IoUringFileSystem>();
+    }
+    return std::make_shared<RealFileSystem>();
+}
+
+static void resetDirectory() {
+    std::string command = std::string("rm -rf ") + kBenchDir;
+    if (std::system(command.c_str()) != 0) {
+        // The directory is recreated below either way.
+    }
+}
+
+static bool skipUnavailable(benchmark::State& state, RealFileSystem& fs) {
+    IoUringFileSystem* uring = dynamic_cast<IoUringFileSystem*>(&fs);
+    if (uring && !uring->available()) {
+        state.SkipWithError("io_uring is not available");
+        return true;
+    }
+    return false;
+}
+
+static void BM_HandleAppend(benchmark::State& state) {
+    resetDirectory();
+    std::shared_ptr<RealFileSystem> fs = makeFileSystem(static_cast<int>(state.range(1)));
+    if (skipUnavailable(state, *fs)) {
+        return;
+    }
+    fs->createDirectory(kBenchDir);
+    std::string payload(static_cast<size_t>(state.range(0)), 'x');
+    std::unique_ptr<FileHandle> handle = fs->openForAppend(std::string(kBenchDir) + "/append.log");
+    for (auto _ : state) {
+        handle->write(payload.data(), payload.size());
+    }
+    handle.reset();
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_HandleAppend)->ArgsProduct({{64, 4096, 65536}, {0, 1}});
+
+static void BM_LoggerRotation(benchmark::State& state) {
+    resetDirectory();
+    std::shared_ptr<RealFileSystem> fs = makeFileSystem(static_cast<int>(state.range(1)));
+    if (skipUnavailable(state, *fs)) {
+        return;
+    }
+    {
+        Logger logger(fs);
+        // The smallest fileSize (1 MB) so rotation (renames and an unlink)
+        // happens often.
+        logger.init("bench", kBenchDir, 1, 8, std::string(kBenchDir) + "/backup", 16);
+        logger.disableTerminal();
+        std::string message(static_cast<size_t>(state.range(0)), 'm');
+        for (auto _ : state) {
+            logger.logMsg(message);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * (state.range(0) + 1));
+}
+BENCHMARK(BM_LoggerRotation)->ArgsProduct({{100, 1000}, {0, 1}});
+
+static void BM_Backup(benchmark::State& state) {
+    resetDirectory();
+    std::shared_ptr<RealFileSystem> fs = makeFileSystem(static_cast<int>(state.range(1)));
+    if (skipUnavailable(state, *fs)) {
+        return;
+    }
+    Logger logger(fs);
+    // fileSize in MB; three full segments plus the active one get copied.
+    int size = static_cast<int>(state.range(0));
+    logger.init("bench", kBenchDir, size, 4, std::string(kBenchDir) + "/backup", size * 8);
+    logger.disableTerminal();
+    std::string message(999, 'b');
+    for (long written = 0; written < size * 3L * 1024 * 1024; written += 1000) {
+        logger.logMsg(message);
+    }
+    long copied = 0;
+    for (auto _ : state) {
+        copied += logger.backup().totalSize;
+    }
+    state.SetBytesProcessed(copied);
+}
+BENCHMARK(BM_Backup)->ArgsProduct({{1, 8}, {0, 1}})->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
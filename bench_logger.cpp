@@ -0,0 +1,221 @@
+#include <benchmark/benchmark.h>
+#include "logger.h"
+#include "log_scan.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// End-to-end Logger costs: logMsg() throughput by message size, per-call
+// latency percentiles, thread scaling, rotation-heavy runs, backup() by
+// data volume and LogGrep over the segments by scanning kernel. Besides the
+// console table, results go to logger_bench.json (Google Benchmark's JSON
+// format) unless --benchmark_out is given.
+
+static const char* kBenchDir = "/tmp/logger_bench";
+
+static void resetDirectory() {
+    std::string command = std::string("rm -rf ") + kBenchDir;
+    if (std::system(command.c_str()) != 0) {
+        // Logger::init() recreates it either way.
+    }
+}
+
+static std::unique_ptr<Logger> openLogger(int fileSize, int fileNum, bool async,
+                                          RotationScheme rotation = RotationScheme::Rename) {
+    resetDirectory();
+    LoggerOptions options;
+    options.async = async;
+    options.rotation = rotation;
+    std::unique_ptr<Logger> logger(new Logger());
+    logger->init("bench", kBenchDir, fileSize, fileNum, std::string(kBenchDir) + "/backup", 1024,
+                 options);
+    logger->disableTerminal();
+    return logger;
+}
+
+static std::string makeMessage(int64_t size) {
+    return std::string(static_cast<size_t>(size), 'm');
+}
+
+// Percentiles of the per-call samples, in nanoseconds. With several threads
+// each reports its own and the counters show the average.
+static void reportLatency(benchmark::State& state, std::vector<int64_t>& samples) {
+    if (samples.empty()) {
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) {
+        size_t index = static_cast<size_t>(p * static_cast<double>(samples.size() - 1));
+        return benchmark::Counter(static_cast<double>(samples[index]),
+                                  benchmark::Counter::kAvgThreads);
+    };
+    state.counters["p50_ns"] = percentile(0.50);
+    state.counters["p99_ns"] = percentile(0.99);
+    state.counters["p999_ns"] = percentile(0.999);
+}
+
+// Arguments: message size, async (0/1).
+static void BM_LogMsg(benchmark::State& state) {
+    std::unique_ptr<Logger> logger = openLogger(64, 4, state.range(1) != 0);
+    std::string message = makeMessage(state.range(0));
+    for (auto _ : state) {
+        logger->logMsg(message);
+    }
+    logger->flush();
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * (state.range(0) + 1));
+}
+BENCHMARK(BM_LogMsg)->ArgsProduct({{16, 128, 1024, 8192}, {0, 1}});
+
+// Arguments: message size, async (0/1).
+static void BM_LogMsgLatency(benchmark::State& state) {
+    std::unique_ptr<Logger> logger = openLogger(64, 4, state.range(1) != 0);
+    std::string message = makeMessage(state.range(0));
+    std::vector<int64_t> samples;
+    samples.reserve(1 << 20);
+    for (auto _ : state) {
+        auto start = std::chrono::steady_clock::now();
+        logger->logMsg(message);
+        auto end = std::chrono::steady_clock::now();
+        samples.push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+    logger->flush();
+    reportLatency(state, samples);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LogMsgLatency)->ArgsProduct({{128, 1024}, {0, 1}});
+
+// One logger shared by all benchmark threads; created and torn down outside
+// the timed region.
+static std::unique_ptr<Logger> sharedLogger;
+
+static void openSharedLogger(const benchmark::State& state) {
+    sharedLogger = openLogger(64, 4, state.range(0) != 0);
+}
+
+static void closeSharedLogger(const benchmark::State&) {
+    sharedLogger.reset();
+}
+
+// Argument: async (0/1). Items per second is the total over all threads.
+static void BM_LogMsgThreads(benchmark::State& state) {
+    std::string message = makeMessage(128);
+    std::vector<int64_t> samples;
+    samples.reserve(1 << 18);
+    for (auto _ : state) {
+        auto start = std::chrono::steady_clock::now();
+        sharedLogger->logMsg(message);
+        auto end = std::chrono::steady_clock::now();
+        samples.push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+    reportLatency(state, samples);
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * 129);
+}
+BENCHMARK(BM_LogMsgThreads)
+    ->Arg(0)
+    ->Arg(1)
+    ->ThreadRange(1, 16)
+    ->UseRealTime()
+    ->Setup(openSharedLogger)
+    ->Teardown(closeSharedLogger);
+
+// Arguments: fileNum, rotation scheme (0 Rename, 1 Sequence). fileSize is the
+// 1 MB minimum, so a 1 KB message rotates every ~1000 calls.
+static void BM_Rotation(benchmark::State& state) {
+    RotationScheme rotation =
+        state.range(1) != 0 ? RotationScheme::Sequence : RotationScheme::Rename;
+    std::unique_ptr<Logger> logger =
+        openLogger(1, static_cast<int>(state.range(0)), false, rotation);
+    std::string message = makeMessage(1023);
+    for (auto _ : state) {
+        logger->logMsg(message);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * 1024);
+}
+BENCHMARK(BM_Rotation)->ArgsProduct({{4, 32}, {0, 1}});
+
+// Argument: MB logged before backing up (in 1 MB segments).
+static void BM_Backup(benchmark::State& state) {
+    int megabytes = static_cast<int>(state.range(0));
+    std::unique_ptr<Logger> logger = openLogger(1, megabytes + 1, false);
+    std::string message = makeMessage(1023);
+    for (int i = 0; i < megabytes * 1024; ++i) {
+        logger->logMsg(message);
+    }
+    long copied = 0;
+    for (auto _ : state) {
+        BackupReport report = logger->backup();
+        copied += report.totalSize;
+        state.counters["bytes_moved"] = static_cast<double>(report.bytesMoved);
+    }
+    state.SetBytesProcessed(copied);
+}
+BENCHMARK(BM_Backup)->RangeMultiplier(4)->Range(1, 64)->Unit(benchmark::kMillisecond);
+
+// Arguments: kernel (0 scalar, 1 SSE4.2, 2 AVX2), search threads. Scans
+// 4 x 16 MB segments for a line that occurs once per segment.
+static void BM_Grep(benchmark::State& state) {
+    log_scan::Kernel kernel = static_cast<log_scan::Kernel>(state.range(0));
+    if (static_cast<int>(kernel) > static_cast<int>(log_scan::bestKernel())) {
+        state.SkipWithError("kernel not supported by this CPU");
+        return;
+    }
+    std::unique_ptr<Logger> logger = openLogger(16, 5, false);
+    // Ordinary English text, so the needle's first byte is common.
+    std::string message =
+        "connection accepted from client node seven, sending the negotiated settings "
+        "and entering the next session state";
+    for (int i = 0; i < 4 * 16 * 8192; ++i) {
+        logger->logMsg(i % (16 * 8192) == 100 ? "needle in the haystack" : message);
+    }
+    logger.reset();
+
+    GrepOptions options;
+    options.kernel = kernel;
+    options.threads = static_cast<int>(state.range(1));
+    LogGrep grep({kBenchDir}, "needle", options);
+    long scanned = 0;
+    for (auto _ : state) {
+        std::vector<GrepMatch> matches;
+        grep.search(&matches);
+        benchmark::DoNotOptimize(matches.data());
+        scanned += grep.bytesScanned();
+    }
+    state.SetBytesProcessed(scanned);
+    state.SetLabel(log_scan::kernelName(kernel));
+}
+BENCHMARK(BM_Grep)
+    ->ArgsProduct({{0, 1, 2}, {1, 4}})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv) {
+    std::vector<char*> args(argv, argv + argc);
+    bool hasOut = false;
+    for (int i = 1; i < argc; ++i) {
+        hasOut = hasOut || std::strncmp(argv[i], "--benchmark_out=", 16) == 0;
+    }
+    std::string out = "--benchmark_out=logger_bench.json";
+    std::string format = "--benchmark_out_format=json";
+    if (!hasOut) {
+        args.push_back(&out[0]);
+        args.push_back(&format[0]);
+    }
+    int count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data())) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    resetDirectory();
+    return 0;
+}
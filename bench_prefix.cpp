@@ -0,0 +1,52 @@
+#include <benchmark/benchmark.h>
+#include "line_prefix.h"
+#include <chrono>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+// Per-line timestamp cost: the stringstream/put_time/localtime approach used
+// by Logger::getCurrentTimestamp() against the cached LinePrefixFormatter.
+
+static std::string streamTimestamp() {
+    auto now = std::chrono::system_clock::now();
+    auto time_t = std::chrono::system_clock::to_time_t(now);
+
+    std::stringstream ss;
+    ss << std::put_time(std::localtime(&time_t), "%Y%m%d%H%M%S");
+    return ss.str();
+}
+
+static void BM_StreamTimestamp(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(streamTimestamp());
+    }
+}
+BENCHMARK(BM_StreamTimestamp);
+
+static void BM_PrefixTimestamp(benchmark::State& state) {
+    LinePrefixFormatter formatter;
+    char out[LinePrefixFormatter::kMaxSize];
+    for (auto _ : state) {
+        size_t n = formatter.format(LinePrefixFormatter::stamp(), LogLevel::Info,
+                                    line_prefix::kTimestamp, out);
+        benchmark::DoNotOptimize(n);
+        benchmark::DoNotOptimize(out);
+    }
+}
+BENCHMARK(BM_PrefixTimestamp);
+
+static void BM_PrefixAllFields(benchmark::State& state) {
+    LinePrefixFormatter formatter;
+    char out[LinePrefixFormatter::kMaxSize];
+    for (auto _ : state) {
+        size_t n = formatter.format(LinePrefixFormatter::stamp(), LogLevel::Warn,
+                                    line_prefix::kAll, out);
+        benchmark::DoNotOptimize(n);
+        benchmark::DoNotOptimize(out);
+    }
+}
+BENCHMARK(BM_PrefixAllFields)->ThreadRange(1, 8);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,324 @@
+#include "binary_log.h"
+#include <cstdarg>
+#include <cstdio>
+#include <deque>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+#include "structured_log.h"
+
+namespace binary_log {
+
+namespace {
+
+struct Format {
+    std::string format;
+    std::string signature;
+};
+
+std::mutex& registryMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::deque<Format>& registry() {
+    static std::deque<Format> formats;
+    return formats;
+}
+
+template <typename T>
+bool readValue(const char*& data, const char* end, T* value) {
+    if (static_cast<size_t>(end - data) < sizeof(T)) {
+        return false;
+    }
+    std::memcpy(value, data, sizeof(T));
+    data += sizeof(T);
+    return true;
+}
+
+void appendFormatted(std::string& out, const char* spec, ...) {
+    char stack[256];
+    va_list args;
+    va_start(args, spec);
+    int n = std::vsnprintf(stack, sizeof(stack), spec, args);
+    va_end(args);
+    if (n < 0) {
+        return;
+    }
+    if (static_cast<size_t>(n) < sizeof(stack)) {
+        out.append(stack, static_cast<size_t>(n));
+        return;
+    }
+    std::vector<char> heap(static_cast<size_t>(n) + 1);
+    va_start(args, spec);
+    std::vsnprintf(heap.data(), heap.size(), spec, args);
+    va_end(args);
+    out.append(heap.data(), static_cast<size_t>(n));
+}
+
+bool isLengthModifier(char c) {
+    return c == 'h' || c == 'l' || c == 'L' || c == 'q' || c == 'j' || c == 'z' || c == 't';
+}
+
+}  // namespace
+
+uint32_t registerFormat(const char* format, const char* signature) {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    registry().push_back(Format{format, signature});
+    return static_cast<uint32_t>(registry().size() - 1);
+}
+
+size_t formatCount() {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    return registry().size();
+}
+
+bool lookupFormat(uint32_t id, std::string* format, std::string* signature) {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    if (id >= registry().size()) {
+        return false;
+    }
+    const Format& entry = registry()[id];
+    if (format) {
+        *format = entry.format;
+    }
+    if (signature) {
+        *signature = entry.signature;
+    }
+    return true;
+}
+
+void appendEntry(std::string& out, char kind, const char* payload, size_t length) {
+    uint32_t length32 = static_cast<uint32_t>(length);
+    out += kind;
+    out.append(reinterpret_cast<const char*>(&length32), sizeof(length32));
+    out.append(payload, length);
+}
+
+size_t definitionEntrySize(uint32_t id) {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    if (id >= registry().size()) {
+        return 0;
+    }
+    const Format& entry = registry()[id];
+    return 1 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint16_t) + entry.signature.size() +
+           entry.format.size();
+}
+
+void appendDefinition(std::string& out, uint32_t id) {
+    std::string format;
+    std::string signature;
+    if (!lookupFormat(id, &format, &signature)) {
+        return;
+    }
+    std::string payload;
+    uint16_t signatureLength = static_cast<uint16_t>(signature.size());
+    payload.append(reinterpret_cast<const char*>(&id), sizeof(id));
+    payload.append(reinterpret_cast<const char*>(&signatureLength), sizeof(signatureLength));
+    payload += signature;
+    payload += format;
+    appendEntry(out, kDefinition, payload.data(), payload.size());
+}
+
+void appendStamp(std::string& out, const LogStamp& stamp, LogLevel level, unsigned fields) {
+    char payload[sizeof(int64_t) + sizeof(uint32_t) + 2];
+    std::memcpy(payload, &stamp.micros, sizeof(stamp.micros));
+    std::memcpy(payload + sizeof(int64_t), &stamp.threadId, sizeof(stamp.threadId));
+    payload[sizeof(int64_t) + sizeof(uint32_t)] = static_cast<char>(level);
+    payload[sizeof(int64_t) + sizeof(uint32_t) + 1] = static_cast<char>(fields);
+    appendEntry(out, kStamp, payload, sizeof(payload));
+}
+
+bool render(const std::string& format, const std::string& signature, const char* args,
+            size_t length, std::string& out) {
+    const char* end = args + length;
+    size_t argIndex = 0;
+    size_t i = 0;
+    while (i < format.size()) {
+        char c = format[i];
+        if (c != '%') {
+            out += c;
+            ++i;
+            continue;
+        }
+        if (i + 1 < format.size() && format[i + 1] == '%') {
+            out += '%';
+            i += 2;
+            continue;
+        }
+
+        size_t start = i++;
+        std::string spec = "%";
+        while (i < format.size() && std::strchr("-+ #0123456789.", format[i])) {
+            spec += format[i++];
+        }
+        while (i < format.size() && isLengthModifier(format[i])) {
+            ++i;
+        }
+        if (i >= format.size() || argIndex >= signature.size()) {
+            out.append(format, start, i - start + (i < format.size() ? 1 : 0));
+            ++i;
+            continue;
+        }
+        char conversion = format[i++];
+
+        switch (signature[argIndex++]) {
+        case 'i': {
+            int64_t value;
+            if (!readValue(args, end, &value)) {
+                return false;
+            }
+            if (conversion == 'c') {
+                appendFormatted(out, (spec + "c").c_str(), static_cast<int>(value));
+            } else {
+                bool integral = std::strchr("diouxX", conversion) != nullptr;
+                appendFormatted(out, (spec + "ll" + (integral ? conversion : 'd')).c_str(),
+                                static_cast<long long>(value));
+            }
+            break;
+        }
+        case 'u': {
+            uint64_t value;
+            if (!readValue(args, end, &value)) {
+                return false;
+            }
+            if (conversion == 'c') {
+                appendFormatted(out, (spec + "c").c_str(), static_cast<int>(value));
+            } else {
+                bool integral = std::strchr("diouxX", conversion) != nullptr;
+                appendFormatted(out, (spec + "ll" + (integral ? conversion : 'u')).c_str(),
+                                static_cast<unsigned long long>(value));
+            }
+            break;
+        }
+        case 'd': {
+            double value;
+            if (!readValue(args, end, &value)) {
+                return false;
+            }
+            bool floating = std::strchr("eEfFgGaA", conversion) != nullptr;
+            appendFormatted(out, (spec + (floating ? conversion : 'g')).c_str(), value);
+            break;
+        }
+        case 's': {
+            uint32_t size;
+            if (!readValue(args, end, &size) || static_cast<size_t>(end - args) < size) {
+                return false;
+            }
+            std::string value(args, size);
+            args += size;
+            appendFormatted(out, (spec + "s").c_str(), value.c_str());
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+bool renderRecord(const char* payload, size_t length, std::string& out) {
+    uint32_t id;
+    const char* end = payload + length;
+    if (!readValue(payload, end, &id)) {
+        return false;
+    }
+    std::string format;
+    std::string signature;
+    if (!lookupFormat(id, &format, &signature)) {
+        return false;
+    }
+    return render(format, signature, payload, static_cast<size_t>(end - payload), out);
+}
+
+bool decode(std::istream& in, std::ostream& out) {
+    char magic[kMagicSize];
+    if (!in.read(magic, kMagicSize) || std::memcmp(magic, kMagic, kMagicSize) != 0) {
+        return false;
+    }
+
+    std::unordered_map<uint32_t, Format> formats;
+    std::string payload;
+    std::string line;
+    LinePrefixFormatter prefixFormatter;
+    char prefix[LinePrefixFormatter::kMaxSize];
+    size_t prefixLength = 0;
+    // The last stamp again, for key-value entries, which carry their prefix
+    // fields inside the JSON object instead.
+    LogStamp stamp;
+    LogLevel stampLevel = LogLevel::Info;
+    uint8_t stampFields = 0;
+    bool stamped = false;
+    for (;;) {
+        char kind;
+        uint32_t length;
+        if (!in.get(kind) || !in.read(reinterpret_cast<char*>(&length), sizeof(length))) {
+            break;
+        }
+        payload.resize(length);
+        if (length > 0 && !in.read(&payload[0], length)) {
+            break;
+        }
+
+        const char* data = payload.data();
+        const char* end = data + payload.size();
+        line.clear();
+        if (kind == kDefinition) {
+            uint32_t id;
+            uint16_t signatureLength;
+            if (!readValue(data, end, &id) || !readValue(data, end, &signatureLength) ||
+                static_cast<size_t>(end - data) < signatureLength) {
+                continue;
+            }
+            Format& format = formats[id];
+            format.signature.assign(data, signatureLength);
+            format.format.assign(data + signatureLength, end);
+            continue;
+        }
+        if (kind == kStamp) {
+            uint8_t level = 0;
+            uint8_t fields = 0;
+            if (readValue(data, end, &stamp.micros) && readValue(data, end, &stamp.threadId) &&
+                readValue(data, end, &level) && readValue(data, end, &fields)) {
+                stampLevel = static_cast<LogLevel>(level);
+                stampFields = fields;
+                stamped = true;
+                prefixLength = prefixFormatter.format(stamp, stampLevel, fields, prefix);
+            }
+            continue;
+        }
+        if (kind == kKeyValue) {
+            if (!structured_log::renderJson(data, static_cast<size_t>(end - data),
+                                            stamped ? &stamp : nullptr, stampLevel, stampFields,
+                                            line)) {
+                line = "<undecodable record>";
+            }
+            prefixLength = 0;
+            stamped = false;
+            out << line << '\n';
+            continue;
+        }
+        line.assign(prefix, prefixLength);
+        prefixLength = 0;
+        stamped = false;
+        if (kind == kText) {
+            line.append(data, end);
+        } else if (kind == kRecord) {
+            uint32_t id;
+            auto it = readValue(data, end, &id) ? formats.find(id) : formats.end();
+            if (it == formats.end() ||
+                !render(it->second.format, it->second.signature, data,
+                        static_cast<size_t>(end - data), line)) {
+                line += "<undecodable record>";
+            }
+        } else {
+            break;
+        }
+        out << line << '\n';
+    }
+    return true;
+}
+
+}  // namespace binary_log
@@ -0,0 +1,158 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <iosfwd>
+#include <string>
+#include <type_traits>
+#include "line_prefix.h"
+#include "log_level.h"
+
+// Binary log segments start with kMagic followed by entries of the
+// form [kind:u8][length:u32][payload]. A format definition is written into a
+// segment before the first record that uses it, so every segment (and every
+// backup copy of one) can be decoded on its own.
+namespace binary_log {
+
+const char kMagic[] = "LLBIN001";
+const size_t kMagicSize = sizeof(kMagic) - 1;
+
+const char kDefinition = 'D';
+const char kRecord = 'R';
+const char kText = 'T';
+// A structured_log payload, decoded as one JSON line.
+const char kKeyValue = 'K';
+// Prefix fields for the entry that follows: [micros:i64][tid:u32][level:u8][fields:u8].
+const char kStamp = 'S';
+const size_t kStampEntrySize = 1 + sizeof(uint32_t) + sizeof(int64_t) + sizeof(uint32_t) + 2;
+
+// Whether kind is one of the entry kinds above; any other byte (a zeroed
+// page, a torn write) ends the readable part of a segment.
+inline bool isEntryKind(char kind) {
+    return kind == kDefinition || kind == kRecord || kind == kText || kind == kKeyValue ||
+           kind == kStamp;
+}
+
+template <typename T, typename Enable = void>
+struct ArgTraits;
+
+template <typename T>
+struct ArgTraits<T, typename std::enable_if<std::is_integral<T>::value &&
+                                            std::is_signed<T>::value>::type> {
+    static const char tag = 'i';
+    static size_t size(T) { return sizeof(int64_t); }
+    static void encode(char* out, T value) {
+        int64_t wide = value;
+        std::memcpy(out, &wide, sizeof(wide));
+    }
+};
+
+template <typename T>
+struct ArgTraits<T, typename std::enable_if<std::is_integral<T>::value &&
+                                            !std::is_signed<T>::value>::type> {
+    static const char tag = 'u';
+    static size_t size(T) { return sizeof(uint64_t); }
+    static void encode(char* out, T value) {
+        uint64_t wide = value;
+        std::memcpy(out, &wide, sizeof(wide));
+    }
+};
+
+template <typename T>
+struct ArgTraits<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    static const char tag = 'd';
+    static size_t size(T) { return sizeof(double); }
+    static void encode(char* out, T value) {
+        double wide = value;
+        std::memcpy(out, &wide, sizeof(wide));
+    }
+};
+
+struct StringArgTraits {
+    static const char tag = 's';
+    static size_t encodedSize(size_t length) { return sizeof(uint32_t) + length; }
+    static void encode(char* out, const char* data, size_t length) {
+        uint32_t length32 = static_cast<uint32_t>(length);
+        std::memcpy(out, &length32, sizeof(length32));
+        std::memcpy(out + sizeof(length32), data, length);
+    }
+};
+
+template <>
+struct ArgTraits<const char*> : StringArgTraits {
+    static size_t size(const char* value) { return encodedSize(value ? std::strlen(value) : 0); }
+    static void encode(char* out, const char* value) {
+        StringArgTraits::encode(out, value ? value : "", value ? std::strlen(value) : 0);
+    }
+};
+
+template <>
+struct ArgTraits<char*> : ArgTraits<const char*> {};
+
+template <>
+struct ArgTraits<std::string> : StringArgTraits {
+    static size_t size(const std::string& value) { return encodedSize(value.size()); }
+    static void encode(char* out, const std::string& value) {
+        StringArgTraits::encode(out, value.data(), value.size());
+    }
+};
+
+template <typename T>
+using ArgOf = ArgTraits<typename std::decay<T>::type>;
+
+template <typename... Args>
+struct Signature {
+    static const char* get() {
+        static const char signature[] = {ArgOf<Args>::tag..., '\0'};
+        return signature;
+    }
+};
+
+// Only used in unevaluated context to name the signature of an argument list.
+template <typename... Args>
+Signature<Args...> signatureOf(const Args&...);
+
+inline size_t encodedArgsSize() { return 0; }
+
+template <typename T, typename... Rest>
+size_t encodedArgsSize(const T& value, const Rest&... rest) {
+    return ArgOf<T>::size(value) + encodedArgsSize(rest...);
+}
+
+inline void encodeArgs(char*) {}
+
+template <typename T, typename... Rest>
+void encodeArgs(char* out, const T& value, const Rest&... rest) {
+    ArgOf<T>::encode(out, value);
+    encodeArgs(out + ArgOf<T>::size(value), rest...);
+}
+
+// Record payload as it travels through the logger: [formatId:u32][args].
+template <typename... Args>
+void encodeRecord(std::string& out, uint32_t formatId, const Args&... args) {
+    size_t size = sizeof(formatId) + encodedArgsSize(args...);
+    out.resize(size);
+    char* data = &out[0];
+    std::memcpy(data, &formatId, sizeof(formatId));
+    encodeArgs(data + sizeof(formatId), args...);
+}
+
+// Process-wide table of formats registered by LITTLE_LOG_BINARY call sites
+// (see logger.h).
+uint32_t registerFormat(const char* format, const char* signature);
+size_t formatCount();
+bool lookupFormat(uint32_t id, std::string* format, std::string* signature);
+
+void appendEntry(std::string& out, char kind, const char* payload, size_t length);
+size_t definitionEntrySize(uint32_t id);
+void appendDefinition(std::string& out, uint32_t id);
+void appendStamp(std::string& out, const LogStamp& stamp, LogLevel level, unsigned fields);
+
+// Expands a record payload using printf-style conversions in format.
+bool render(const std::string& format, const std::string& signature, const char* args,
+            size_t length, std::string& out);
+bool renderRecord(const char* payload, size_t length, std::string& out);
+
+// Writes one text line per entry. Returns false if in is not a binary log.
+bool decode(std::istream& in, std::ostream& out);
+
+}  // namespace binary_log
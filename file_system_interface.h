@@ -1,5 +1,79 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <vector>
+
+class FileHandle {
+public:
+    virtual ~FileHandle() = default;
+    virtual bool write(const char* data, size_t length) = 0;
+    virtual bool sync() { return true; }
+};
+
+enum class CopyStrategy {
+    None,
+    Reflink,
+    Hardlink,
+    CopyFileRange,
+    Sendfile,
+    Stream,
+    IoUring,
+};
+
+struct CopyResult {
+    CopyStrategy strategy = CopyStrategy::None;
+    // Bytes that actually went through a copy; 0 for reflinks and hardlinks.
+    long bytesMoved = 0;
+};
+
+inline const char* copyStrategyName(CopyStrategy strategy) {
+    switch (strategy) {
+    case CopyStrategy::Reflink:
+        return "reflink";
+    case CopyStrategy::Hardlink:
+        return "hardlink";
+    case CopyStrategy::CopyFileRange:
+        return "copy_file_range";
+    case CopyStrategy::Sendfile:
+        return "sendfile";
+    case CopyStrategy::Stream:
+        return "stream";
+    case CopyStrategy::IoUring:
+        return "io_uring";
+    default:
+        return "none";
+    }
+}
+
+// "<64-bit hash in hex>-<size>", the form FileSystemInterface::contentId()
+// reports. Not cryptographic; with the size folded in, two different log
+// segments sharing an id is not a practical concern.
+inline std::string contentIdOf(const char* data, size_t size) {
+    const uint64_t kMultiplier = 0x9E3779B97F4A7C15ull;
+    uint64_t hash = kMultiplier ^ size;
+    auto mix = [&](uint64_t word) {
+        word *= 0xFF51AFD7ED558CCDull;
+        word ^= word >> 32;
+        hash = (hash ^ word) * kMultiplier;
+        hash ^= hash >> 29;
+    };
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        mix(word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, size - i);
+    mix(tail ^ (static_cast<uint64_t>(size - i) << 56));
+    char id[48];
+    std::snprintf(id, sizeof(id), "%016llx-%zu", static_cast<unsigned long long>(hash), size);
+    return id;
+}
 
 class FileSystemInterface {
 public:
@@ -11,4 +85,99 @@ public:
     virtual bool renameFile(const std::string& from, const std::string& to) = 0;
     virtual bool copyFile(const std::string& from, const std::string& to) = 0;
     virtual bool writeToFile(const std::string& path, const std::string& content, bool append = true) = 0;
+
+    // Only needed for small metadata files such as the segment manifest.
+    virtual bool readFile(const std::string& path, std::string* content) {
+        (void)path;
+        (void)content;
+        return false;
+    }
+
+    // Copies the first length bytes of from (all of it when length < 0) as
+    // cheaply as the implementation can. immutable promises that from will
+    // never be written again, which allows sharing it with a hardlink.
+    virtual bool transferFile(const std::string& from, const std::string& to, bool immutable,
+                              long length, CopyResult* result) {
+        (void)immutable;
+        (void)length;
+        long size = getFileSize(from);
+        if (!copyFile(from, to)) {
+            return false;
+        }
+        if (result) {
+            result->strategy = CopyStrategy::Stream;
+            result->bytesMoved = size;
+        }
+        return true;
+    }
+
+    // Gives the file at from a second name, to, which keeps its contents
+    // reachable after from is renamed or removed. Logger uses it for cheap
+    // snapshots of the segment chain; the default reports it as unavailable,
+    // and the logger then works on the chain itself.
+    virtual bool linkFile(const std::string& from, const std::string& to) {
+        (void)from;
+        (void)to;
+        return false;
+    }
+
+    // Writes a gzip-compressed copy of from to to. The default reports that
+    // compression is unavailable, which leaves rotated segments as they are.
+    virtual bool compressFile(const std::string& from, const std::string& to, int level) {
+        (void)from;
+        (void)to;
+        (void)level;
+        return false;
+    }
+
+    // Cuts a file left behind by a crash back to its last complete line (or
+    // binary entry). Logger::init() calls it for the active segment.
+    virtual bool recoverFile(const std::string& path) {
+        (void)path;
+        return true;
+    }
+
+    // Names in a directory, without "." and "..". Backup retention uses it
+    // to walk the backup tree; the default reports it as unavailable.
+    virtual bool listDirectory(const std::string& path, std::vector<std::string>* names) {
+        (void)path;
+        (void)names;
+        return false;
+    }
+
+    // Identity of the bytes of a file that is no longer written to: equal
+    // ids mean equal content (see contentIdOf()). Incremental backups use it
+    // to recognise segments an earlier backup already holds. The default
+    // hashes what readFile() returns.
+    virtual bool contentId(const std::string& path, std::string* id) {
+        std::string content;
+        if (!readFile(path, &content)) {
+            return false;
+        }
+        *id = contentIdOf(content.data(), content.size());
+        return true;
+    }
+
+    // Keeps the file open for appending until the handle is destroyed. The
+    // default adapter forwards each newline-terminated chunk to writeToFile()
+    // so implementations that only provide the primitives keep working.
+    virtual std::unique_ptr<FileHandle> openForAppend(const std::string& path) {
+        return std::unique_ptr<FileHandle>(new PathFileHandle(this, path));
+    }
+
+private:
+    class PathFileHandle : public FileHandle {
+    public:
+        PathFileHandle(FileSystemInterface* fs, const std::string& path) : fs_(fs), path_(path) {}
+        bool write(const char* data, size_t length) override {
+            if (length > 0 && data[length - 1] == '\n') {
+                --length;
+            }
+            return fs_->writeToFile(path_, std::string(data, length), true);
+        }
+
+    private:
+        FileSystemInterface* fs_;
+        std::string path_;
+    };
 };
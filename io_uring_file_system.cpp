@@ -0,0 +1,524 @@
+#include "io_uring_file_system.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <vector>
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+struct IoUringFileSystem::Operation {
+    int result = 0;
+    bool done = false;
+};
+
+#if defined(__linux__)
+
+namespace {
+
+const size_t kCopyChunk = 256 * 1024;
+const unsigned kCopyDepth = 4;
+
+int ringSetup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int ringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return static_cast<int>(
+        syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+int ringRegister(int fd, unsigned opcode, void* arg, unsigned count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+template <typename T>
+T* at(void* base, unsigned offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+}  // namespace
+
+// Appends at explicit offsets so several writes can be in flight at once
+// without reordering the file. Buffers stay owned here until their
+// completion has been reaped.
+class IoUringFileSystem::UringHandle : public FileHandle {
+public:
+    UringHandle(IoUringFileSystem* owner, const std::string& path, int fd, unsigned long long offset)
+        : owner_(owner), path_(path), fd_(fd), offset_(offset) {}
+
+    ~UringHandle() override {
+        {
+            std::lock_guard<std::mutex> lock(owner_->handlesMutex_);
+            auto it = owner_->handles_.find(path_);
+            if (it != owner_->handles_.end() && it->second == this) {
+                owner_->handles_.erase(it);
+            }
+        }
+        drain();
+        close(fd_);
+    }
+
+    bool write(const char* data, size_t length) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        release();
+        if (failed_) {
+            return false;
+        }
+        pending_.emplace_back();
+        Pending& write = pending_.back();
+        write.data.assign(data, length);
+        write.offset = offset_;
+        offset_ += length;
+        Operation* op = &write.op;
+        return owner_->submit(&op, 1, [&](unsigned, io_uring_sqe* sqe) {
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = fd_;
+            sqe->addr = reinterpret_cast<unsigned long long>(write.data.data());
+            sqe->len = static_cast<unsigned>(write.data.size());
+            sqe->off = write.offset;
+        });
+    }
+
+    bool sync() override {
+        drain();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (failed_) {
+            return false;
+        }
+        Operation op;
+        Operation* ops = &op;
+        if (!owner_->submit(&ops, 1, [&](unsigned, io_uring_sqe* sqe) {
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fd = fd_;
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            })) {
+            return fdatasync(fd_) == 0;
+        }
+        owner_->wait(&ops, 1);
+        return op.result == 0;
+    }
+
+    // Waits until every submitted write has completed.
+    void drain() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<Operation*> ops;
+        for (Pending& write : pending_) {
+            ops.push_back(&write.op);
+        }
+        owner_->wait(ops.data(), static_cast<unsigned>(ops.size()));
+        release();
+    }
+
+private:
+    struct Pending {
+        Operation op;
+        std::string data;
+        unsigned long long offset = 0;
+    };
+
+    // Frees completed writes from the front; results are checked here.
+    void release() {
+        std::lock_guard<std::mutex> ring(owner_->mutex_);
+        while (!pending_.empty() && pending_.front().op.done) {
+            const Pending& write = pending_.front();
+            if (write.op.result != static_cast<int>(write.data.size())) {
+                failed_ = true;
+            }
+            pending_.pop_front();
+        }
+    }
+
+    IoUringFileSystem* owner_;
+    std::string path_;
+    int fd_;
+    std::mutex mutex_;
+    unsigned long long offset_;
+    std::deque<Pending> pending_;
+    bool failed_ = false;
+};
+
+IoUringFileSystem::IoUringFileSystem(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = ringSetup(entries, &params);
+    if (fd < 0) {
+        return;
+    }
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                   IORING_OFF_SQ_RING);
+    cqRing_ = single ? sqRing_
+                     : mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                 IORING_OFF_SQES);
+    if (sqRing_ == MAP_FAILED || cqRing_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+        if (sqRing_ != MAP_FAILED) {
+            munmap(sqRing_, sqRingSize_);
+        }
+        if (!single && cqRing_ != MAP_FAILED) {
+            munmap(cqRing_, cqRingSize_);
+        }
+        if (sqes_ != MAP_FAILED) {
+            munmap(sqes_, sqesSize_);
+        }
+        sqRing_ = cqRing_ = sqes_ = nullptr;
+        close(fd);
+        return;
+    }
+
+    sqTail_ = at<unsigned>(sqRing_, params.sq_off.tail);
+    sqMask_ = at<unsigned>(sqRing_, params.sq_off.ring_mask);
+    sqArray_ = at<unsigned>(sqRing_, params.sq_off.array);
+    cqHead_ = at<unsigned>(cqRing_, params.cq_off.head);
+    cqTail_ = at<unsigned>(cqRing_, params.cq_off.tail);
+    cqMask_ = at<unsigned>(cqRing_, params.cq_off.ring_mask);
+    cqes_ = at<void>(cqRing_, params.cq_off.cqes);
+    entries_ = params.sq_entries;
+    ringFd_ = fd;
+
+    std::vector<char> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+    if (ringRegister(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        for (unsigned op = 0; op < probe->ops_len && op < 256; ++op) {
+            supported_[op] = (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+        }
+    }
+}
+
+IoUringFileSystem::~IoUringFileSystem() {
+    if (ringFd_ < 0) {
+        return;
+    }
+    munmap(sqes_, sqesSize_);
+    if (cqRing_ != sqRing_) {
+        munmap(cqRing_, cqRingSize_);
+    }
+    munmap(sqRing_, sqRingSize_);
+    close(ringFd_);
+}
+
+bool IoUringFileSystem::supports(unsigned opcode) const {
+    return ringFd_ >= 0 && opcode < 256 && supported_[opcode];
+}
+
+template <typename Prepare>
+bool IoUringFileSystem::submit(Operation* const* ops, unsigned count, Prepare prepare) {
+    if (ringFd_ < 0 || count == 0 || count > entries_) {
+        for (unsigned i = 0; i < count; ++i) {
+            ops[i]->result = -ENOSYS;
+            ops[i]->done = true;
+        }
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Keep the completion queue (twice the size of the submission queue)
+    // from overflowing.
+    while (inFlight_ + count > entries_) {
+        if (waiting_) {
+            reaped_.wait(lock);
+            continue;
+        }
+        waiting_ = true;
+        lock.unlock();
+        ringEnter(ringFd_, 0, 1, IORING_ENTER_GETEVENTS);
+        lock.lock();
+        waiting_ = false;
+        reapLocked();
+        reaped_.notify_all();
+    }
+    reapLocked();
+
+    unsigned tail = *sqTail_;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(sqes_);
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned index = (tail + i) & *sqMask_;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        prepare(i, sqe);
+        sqe->user_data = reinterpret_cast<unsigned long long>(ops[i]);
+        sqArray_[index] = index;
+    }
+    __atomic_store_n(sqTail_, tail + count, __ATOMIC_RELEASE);
+    unsigned submitted = 0;
+    while (submitted < count) {
+        int n = ringEnter(ringFd_, count - submitted, 0, 0);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+            reapLocked();
+            continue;
+        }
+        if (n <= 0) {
+            // The ring is unusable; fail what did not go out so nobody waits
+            // for it.
+            for (unsigned i = submitted; i < count; ++i) {
+                ops[i]->result = -EIO;
+                ops[i]->done = true;
+            }
+            inFlight_ += submitted;
+            return false;
+        }
+        submitted += static_cast<unsigned>(n);
+    }
+    inFlight_ += count;
+    return true;
+}
+
+void IoUringFileSystem::reapLocked() {
+    unsigned head = *cqHead_;
+    unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    io_uring_cqe* cqes = static_cast<io_uring_cqe*>(cqes_);
+    while (head != tail) {
+        const io_uring_cqe& cqe = cqes[head & *cqMask_];
+        Operation* op = reinterpret_cast<Operation*>(cqe.user_data);
+        op->result = cqe.res;
+        op->done = true;
+        --inFlight_;
+        ++head;
+    }
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+}
+
+void IoUringFileSystem::wait(Operation* const* ops, unsigned count) {
+    if (count == 0) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        reapLocked();
+        bool done = true;
+        for (unsigned i = 0; i < count && done; ++i) {
+            done = ops[i]->done;
+        }
+        if (done) {
+            return;
+        }
+        if (waiting_) {
+            reaped_.wait(lock);
+            continue;
+        }
+        waiting_ = true;
+        lock.unlock();
+        ringEnter(ringFd_, 0, 1, IORING_ENTER_GETEVENTS);
+        lock.lock();
+        waiting_ = false;
+        reapLocked();
+        reaped_.notify_all();
+    }
+}
+
+int IoUringFileSystem::runOne(unsigned opcode, int fd, const void* addr, unsigned len,
+                              unsigned long long off, const void* addr2, int fd2,
+                              unsigned flags) {
+    Operation op;
+    Operation* ops = &op;
+    if (!submit(&ops, 1, [&](unsigned, io_uring_sqe* sqe) {
+            sqe->opcode = static_cast<unsigned char>(opcode);
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<unsigned long long>(addr);
+            sqe->len = len;
+            sqe->off = off;
+            sqe->addr2 = reinterpret_cast<unsigned long long>(addr2);
+            if (fd2 != 0) {
+                sqe->len = static_cast<unsigned>(fd2);
+            }
+            sqe->rw_flags = static_cast<int>(flags);
+        })) {
+        return -ENOSYS;
+    }
+    wait(&ops, 1);
+    return op.result;
+}
+
+bool IoUringFileSystem::createDirectory(const std::string& path) {
+    if (!supports(IORING_OP_MKDIRAT)) {
+        return RealFileSystem::createDirectory(path);
+    }
+    int result = runOne(IORING_OP_MKDIRAT, AT_FDCWD, path.c_str(), 0755, 0, nullptr, 0, 0);
+    return result == 0 || result == -EEXIST;
+}
+
+long IoUringFileSystem::getFileSize(const std::string& path) {
+    drainHandle(path);
+    return RealFileSystem::getFileSize(path);
+}
+
+bool IoUringFileSystem::removeFile(const std::string& path) {
+    if (!supports(IORING_OP_UNLINKAT)) {
+        return RealFileSystem::removeFile(path);
+    }
+    return runOne(IORING_OP_UNLINKAT, AT_FDCWD, path.c_str(), 0, 0, nullptr, 0, 0) == 0;
+}
+
+bool IoUringFileSystem::renameFile(const std::string& from, const std::string& to) {
+    if (!supports(IORING_OP_RENAMEAT)) {
+        return RealFileSystem::renameFile(from, to);
+    }
+    return runOne(IORING_OP_RENAMEAT, AT_FDCWD, from.c_str(), 0, 0, to.c_str(), AT_FDCWD, 0) ==
+           0;
+}
+
+bool IoUringFileSystem::copyFile(const std::string& from, const std::string& to) {
+    return transferFile(from, to, false, -1, nullptr);
+}
+
+bool IoUringFileSystem::transferFile(const std::string& from, const std::string& to,
+                                     bool immutable, long length, CopyResult* result) {
+    drainHandle(from);
+    if (!supports(IORING_OP_READ) || !supports(IORING_OP_WRITE)) {
+        return RealFileSystem::transferFile(from, to, immutable, length, result);
+    }
+
+    int src = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(src, &st) != 0) {
+        close(src);
+        return false;
+    }
+    if (length < 0 || length > st.st_size) {
+        length = st.st_size;
+    }
+    // Not through a hardlink to from that an earlier transfer left.
+    unlink(to.c_str());
+    int dst = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dst < 0) {
+        close(src);
+        return false;
+    }
+
+    // Each chunk is a read linked to the write of the same buffer, and up to
+    // kCopyDepth chunks go to the kernel in one submission.
+    std::vector<std::vector<char>> buffers(kCopyDepth, std::vector<char>(kCopyChunk));
+    bool ok = true;
+    long offset = 0;
+    while (ok && offset < length) {
+        Operation ops[2 * kCopyDepth];
+        Operation* pointers[2 * kCopyDepth];
+        unsigned sizes[kCopyDepth];
+        unsigned chunks = 0;
+        for (; chunks < kCopyDepth && offset + static_cast<long>(chunks * kCopyChunk) < length;
+             ++chunks) {
+            long left = length - offset - static_cast<long>(chunks * kCopyChunk);
+            sizes[chunks] = static_cast<unsigned>(std::min<long>(left, kCopyChunk));
+        }
+        for (unsigned i = 0; i < 2 * chunks; ++i) {
+            pointers[i] = &ops[i];
+        }
+        ok = submit(pointers, 2 * chunks, [&](unsigned i, io_uring_sqe* sqe) {
+            unsigned chunk = i / 2;
+            bool read = i % 2 == 0;
+            sqe->opcode = read ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->fd = read ? src : dst;
+            sqe->addr = reinterpret_cast<unsigned long long>(buffers[chunk].data());
+            sqe->len = sizes[chunk];
+            sqe->off = static_cast<unsigned long long>(offset) + chunk * kCopyChunk;
+            if (read) {
+                sqe->flags = IOSQE_IO_LINK;
+            }
+        });
+        wait(pointers, 2 * chunks);
+        for (unsigned i = 0; ok && i < 2 * chunks; ++i) {
+            ok = ops[i].result == static_cast<int>(sizes[i / 2]);
+        }
+        for (unsigned i = 0; i < chunks; ++i) {
+            offset += sizes[i];
+        }
+    }
+    close(src);
+    close(dst);
+
+    if (!ok) {
+        // A short read breaks the link; let the plain copy deal with it.
+        return RealFileSystem::transferFile(from, to, immutable, length, result);
+    }
+    if (result) {
+        result->strategy = CopyStrategy::IoUring;
+        result->bytesMoved = length;
+    }
+    return true;
+}
+
+std::unique_ptr<FileHandle> IoUringFileSystem::openForAppend(const std::string& path) {
+    if (!supports(IORING_OP_WRITE)) {
+        return RealFileSystem::openForAppend(path);
+    }
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    std::unique_ptr<UringHandle> handle(
+        new UringHandle(this, path, fd, static_cast<unsigned long long>(st.st_size)));
+    {
+        std::lock_guard<std::mutex> lock(handlesMutex_);
+        handles_[path] = handle.get();
+    }
+    return handle;
+}
+
+void IoUringFileSystem::drainHandle(const std::string& path) {
+    std::lock_guard<std::mutex> lock(handlesMutex_);
+    auto it = handles_.find(path);
+    if (it != handles_.end()) {
+        it->second->drain();
+    }
+}
+
+#else
+
+class IoUringFileSystem::UringHandle {};
+
+IoUringFileSystem::IoUringFileSystem(unsigned) {}
+
+IoUringFileSystem::~IoUringFileSystem() {}
+
+bool IoUringFileSystem::createDirectory(const std::string& path) {
+    return RealFileSystem::createDirectory(path);
+}
+
+long IoUringFileSystem::getFileSize(const std::string& path) {
+    return RealFileSystem::getFileSize(path);
+}
+
+bool IoUringFileSystem::removeFile(const std::string& path) {
+    return RealFileSystem::removeFile(path);
+}
+
+bool IoUringFileSystem::renameFile(const std::string& from, const std::string& to) {
+    return RealFileSystem::renameFile(from, to);
+}
+
+bool IoUringFileSystem::copyFile(const std::string& from, const std::string& to) {
+    return RealFileSystem::copyFile(from, to);
+}
+
+bool IoUringFileSystem::transferFile(const std::string& from, const std::string& to,
+                                     bool immutable, long length, CopyResult* result) {
+    return RealFileSystem::transferFile(from, to, immutable, length, result);
+}
+
+std::unique_ptr<FileHandle> IoUringFileSystem::openForAppend(const std::string& path) {
+    return RealFileSystem::openForAppend(path);
+}
+
+#endif
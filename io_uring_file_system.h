@@ -0,0 +1,73 @@
+#pragma once
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include "real_file_system.h"
+
+// Sends file system work through an io_uring instance (raw syscalls, no
+// liburing). Appends are copied into a buffer and submitted with an explicit
+// offset, so write() returns without waiting for the I/O; completions are
+// reaped in batches by whichever thread next touches the ring. Directory
+// operations and backup copies wait for their own completions. Everything
+// falls back to RealFileSystem when the kernel (or a seccomp policy) does
+// not offer io_uring or a particular opcode.
+class IoUringFileSystem : public RealFileSystem {
+public:
+    explicit IoUringFileSystem(unsigned entries = 256);
+    ~IoUringFileSystem() override;
+
+    // False when every call goes straight to RealFileSystem.
+    bool available() const { return ringFd_ >= 0; }
+
+    bool createDirectory(const std::string& path) override;
+    long getFileSize(const std::string& path) override;
+    bool removeFile(const std::string& path) override;
+    bool renameFile(const std::string& from, const std::string& to) override;
+    bool copyFile(const std::string& from, const std::string& to) override;
+    bool transferFile(const std::string& from, const std::string& to, bool immutable, long length,
+                      CopyResult* result) override;
+    std::unique_ptr<FileHandle> openForAppend(const std::string& path) override;
+
+private:
+    struct Operation;
+    class UringHandle;
+
+    bool supports(unsigned opcode) const;
+    // Fills count submission entries via prepare(index, sqe) and submits
+    // them with one io_uring_enter; ops[i] receives the i-th completion.
+    template <typename Prepare>
+    bool submit(Operation* const* ops, unsigned count, Prepare prepare);
+    void wait(Operation* const* ops, unsigned count);
+    void reapLocked();
+    int runOne(unsigned opcode, int fd, const void* addr, unsigned len, unsigned long long off,
+               const void* addr2, int fd2, unsigned flags);
+    void drainHandle(const std::string& path);
+
+    int ringFd_ = -1;
+    unsigned entries_ = 0;
+    void* sqRing_ = nullptr;
+    void* cqRing_ = nullptr;
+    size_t sqRingSize_ = 0;
+    size_t cqRingSize_ = 0;
+    void* sqes_ = nullptr;
+    size_t sqesSize_ = 0;
+    unsigned* sqTail_ = nullptr;
+    unsigned* sqMask_ = nullptr;
+    unsigned* sqArray_ = nullptr;
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    unsigned* cqMask_ = nullptr;
+    void* cqes_ = nullptr;
+    unsigned char supported_[256] = {};
+
+    // Guards both rings, inFlight_ and every Operation's result. One thread
+    // at a time blocks in the kernel for completions; the rest wait on
+    // reaped_.
+    std::mutex mutex_;
+    std::condition_variable reaped_;
+    bool waiting_ = false;
+    unsigned inFlight_ = 0;
+
+    std::mutex handlesMutex_;
+    std::map<std::string, UringHandle*> handles_;
+};
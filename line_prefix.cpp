@@ -0,0 +1,115 @@
+#include "line_prefix.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#endif
+
+namespace {
+
+char* writeDigits(char* out, uint64_t value, int width) {
+    for (int i = width - 1; i >= 0; --i) {
+        out[i] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    }
+    return out + width;
+}
+
+char* writeNumber(char* out, uint64_t value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while (count > 0) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+}  // namespace
+
+int64_t LinePrefixFormatter::nowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+uint32_t LinePrefixFormatter::currentThreadId() {
+    thread_local uint32_t id = 0;
+    if (id == 0) {
+#if defined(__linux__)
+        id = static_cast<uint32_t>(syscall(SYS_gettid));
+#elif defined(__APPLE__)
+        uint64_t tid = 0;
+        pthread_threadid_np(nullptr, &tid);
+        id = static_cast<uint32_t>(tid);
+#else
+        static std::atomic<uint32_t> next{1};
+        id = next.fetch_add(1);
+#endif
+    }
+    return id;
+}
+
+LogStamp LinePrefixFormatter::stamp() {
+    LogStamp result;
+    result.micros = nowMicros();
+    result.threadId = currentThreadId();
+    return result;
+}
+
+size_t LinePrefixFormatter::format(const LogStamp& stamp, LogLevel level, unsigned fields,
+                                   char* out) {
+    char* cursor = out;
+    if (fields & line_prefix::kTimestamp) {
+        int64_t second = stamp.micros >= 0 ? stamp.micros / 1000000
+                                           : (stamp.micros - 999999) / 1000000;
+        if (second != cachedSecond_) {
+            std::time_t seconds = static_cast<std::time_t>(second);
+            std::tm local;
+            localtime_r(&seconds, &local);
+            char* text = cachedText_;
+            text = writeDigits(text, static_cast<uint64_t>(local.tm_year + 1900), 4);
+            *text++ = '-';
+            text = writeDigits(text, static_cast<uint64_t>(local.tm_mon + 1), 2);
+            *text++ = '-';
+            text = writeDigits(text, static_cast<uint64_t>(local.tm_mday), 2);
+            *text++ = ' ';
+            text = writeDigits(text, static_cast<uint64_t>(local.tm_hour), 2);
+            *text++ = ':';
+            text = writeDigits(text, static_cast<uint64_t>(local.tm_min), 2);
+            *text++ = ':';
+            writeDigits(text, static_cast<uint64_t>(local.tm_sec), 2);
+            cachedSecond_ = second;
+        }
+        std::memcpy(cursor, cachedText_, kSecondSize);
+        cursor += kSecondSize;
+        *cursor++ = '.';
+        cursor = writeDigits(cursor, static_cast<uint64_t>(stamp.micros - second * 1000000), 6);
+        *cursor++ = ' ';
+    }
+    if (fields & line_prefix::kLevel) {
+        const char* name = logLevelName(level);
+        size_t length = std::strlen(name);
+        std::memcpy(cursor, name, length);
+        cursor += length;
+        for (size_t i = length; i < 5; ++i) {
+            *cursor++ = ' ';
+        }
+        *cursor++ = ' ';
+    }
+    if (fields & line_prefix::kThreadId) {
+        *cursor++ = '[';
+        cursor = writeNumber(cursor, stamp.threadId);
+        *cursor++ = ']';
+        *cursor++ = ' ';
+    }
+    return static_cast<size_t>(cursor - out);
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "log_level.h"
+
+// Fields of the optional per-line prefix, combined into LoggerOptions::prefix.
+namespace line_prefix {
+const unsigned kTimestamp = 1;
+const unsigned kLevel = 2;
+const unsigned kThreadId = 4;
+const unsigned kAll = kTimestamp | kLevel | kThreadId;
+}  // namespace line_prefix
+
+// When and where a message was logged, captured on the calling thread.
+struct LogStamp {
+    int64_t micros = 0;
+    uint32_t threadId = 0;
+};
+
+// Formats "2026-10-17 14:02:03.123456 INFO  [4242] ". The date and time are
+// only re-rendered when the second changes; everything else is written digit
+// by digit into the caller's buffer, without allocating or touching a locale.
+// Not thread-safe: give each thread (or the appender) its own instance.
+class LinePrefixFormatter {
+public:
+    static const size_t kMaxSize = 64;
+
+    static int64_t nowMicros();
+    static uint32_t currentThreadId();
+    static LogStamp stamp();
+
+    size_t format(const LogStamp& stamp, LogLevel level, unsigned fields, char* out);
+
+private:
+    static const size_t kSecondSize = 19;  // "YYYY-MM-DD HH:MM:SS"
+
+    int64_t cachedSecond_ = INT64_MIN;
+    char cachedText_[kSecondSize];
+};
@@ -0,0 +1,136 @@
+#include "binary_log.h"
+#include <dirent.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// little-log-decode: turns binary .log/.logN segments back into text. Plain
+// text segments are passed through, directories (the live log directory or a
+// backup made by Logger::backup()) are decoded oldest segment first. Sequence
+// segments (name.<seq>.log) sort by their zero-padded number, and compressed
+// segments (.gz) are inflated on the fly.
+
+namespace {
+
+struct Segment {
+    std::string path;
+    std::string prefix;
+    long index;
+};
+
+bool endsWith(const std::string& value, const std::string& suffix) {
+    return value.size() >= suffix.size() &&
+           value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool parseSegmentName(std::string name, std::string* prefix, long* index) {
+    if (endsWith(name, ".gz")) {
+        name.resize(name.size() - 3);
+    }
+    size_t pos = name.rfind(".log");
+    if (pos == std::string::npos || pos == 0) {
+        return false;
+    }
+    std::string suffix = name.substr(pos + 4);
+    if (!suffix.empty() && suffix.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    *prefix = name.substr(0, pos);
+    *index = suffix.empty() ? 0 : std::strtol(suffix.c_str(), nullptr, 10);
+    return true;
+}
+
+void collect(const std::string& path, std::vector<Segment>& segments) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        std::cerr << "little-log-decode: cannot open " << path << std::endl;
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        segments.push_back(Segment{path, "", 0});
+        return;
+    }
+
+    std::vector<Segment> found;
+    if (DIR* dir = opendir(path.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            Segment segment;
+            if (parseSegmentName(entry->d_name, &segment.prefix, &segment.index)) {
+                segment.path = path + "/" + entry->d_name;
+                found.push_back(segment);
+            }
+        }
+        closedir(dir);
+    }
+    std::sort(found.begin(), found.end(), [](const Segment& a, const Segment& b) {
+        return a.prefix != b.prefix ? a.prefix < b.prefix : a.index > b.index;
+    });
+    segments.insert(segments.end(), found.begin(), found.end());
+}
+
+bool readGzip(const std::string& path, std::string* content) {
+    gzFile file = gzopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    char buffer[64 * 1024];
+    int n;
+    while ((n = gzread(file, buffer, sizeof(buffer))) > 0) {
+        content->append(buffer, static_cast<size_t>(n));
+    }
+    return gzclose(file) == Z_OK && n == 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: little-log-decode <segment-or-directory>..." << std::endl;
+        return 2;
+    }
+
+    std::vector<Segment> segments;
+    for (int i = 1; i < argc; ++i) {
+        collect(argv[i], segments);
+    }
+
+    int status = 0;
+    for (const Segment& segment : segments) {
+        std::ifstream file;
+        std::istringstream inflated;
+        std::istream* input = &file;
+        if (endsWith(segment.path, ".gz")) {
+            std::string content;
+            if (!readGzip(segment.path, &content)) {
+                std::cerr << "little-log-decode: cannot inflate " << segment.path << std::endl;
+                status = 1;
+                continue;
+            }
+            inflated.str(content);
+            input = &inflated;
+        } else {
+            file.open(segment.path, std::ios::binary);
+        }
+        std::istream& in = *input;
+        if (!in) {
+            std::cerr << "little-log-decode: cannot open " << segment.path << std::endl;
+            status = 1;
+            continue;
+        }
+        if (segments.size() > 1) {
+            std::cout << "==> " << segment.path << " <==" << '\n';
+        }
+        if (!binary_log::decode(in, std::cout)) {
+            in.clear();
+            in.seekg(0);
+            std::cout << in.rdbuf();
+        }
+    }
+    return status;
+}
@@ -0,0 +1,64 @@
+#include "log_scan.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// little-log-grep: prints the lines containing a pattern from segment files,
+// log directories and backup directories, in log order, as
+// segment:line:text. A leading '^' anchors the pattern to the line start.
+//
+//   little-log-grep [-i] [-j THREADS] [-c] [--stats] PATTERN PATH...
+
+int main(int argc, char** argv) {
+    GrepOptions options;
+    bool countOnly = false;
+    bool stats = false;
+    std::string pattern;
+    bool havePattern = false;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-i") == 0) {
+            options.ignoreCase = true;
+        } else if (std::strcmp(argv[i], "-c") == 0) {
+            countOnly = true;
+        } else if (std::strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+        } else if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (!havePattern) {
+            pattern = argv[i];
+            havePattern = true;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+    if (!havePattern || paths.empty()) {
+        std::cerr << "usage: little-log-grep [-i] [-j THREADS] [-c] [--stats] PATTERN "
+                     "<segment-or-directory>..."
+                  << std::endl;
+        return 2;
+    }
+
+    LogGrep grep(paths, pattern, options);
+    std::vector<GrepMatch> matches;
+    bool ok = grep.search(&matches);
+    if (countOnly) {
+        std::cout << matches.size() << '\n';
+    } else {
+        for (const GrepMatch& match : matches) {
+            std::cout << match.segment << ':' << match.lineNumber << ':' << match.line << '\n';
+        }
+    }
+    std::cout.flush();
+    if (stats) {
+        std::cerr << matches.size() << " matches, " << grep.bytesScanned() << " bytes in "
+                  << grep.segments().size() << " segments ("
+                  << log_scan::kernelName(options.kernel) << ")" << std::endl;
+    }
+    if (!ok) {
+        return 2;
+    }
+    return matches.empty() ? 1 : 0;
+}
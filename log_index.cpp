@@ -0,0 +1,104 @@
+#include "log_index.h"
+#include <algorithm>
+#include <sstream>
+
+namespace {
+const char kHeader[] = "little-log-index";
+const int kVersion = 1;
+}  // namespace
+
+std::string SegmentIndex::pathFor(const std::string& segment) {
+    std::string path = segment;
+    if (path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0) {
+        path.resize(path.size() - 3);
+    }
+    return path + ".idx";
+}
+
+void SegmentIndex::add(const Block& block) {
+    blocks_.push_back(block);
+    reachedMax_.clear();
+    remainingMin_.clear();
+}
+
+void SegmentIndex::clear() {
+    blocks_.clear();
+    coveredSize_ = 0;
+    reachedMax_.clear();
+    remainingMin_.clear();
+}
+
+void SegmentIndex::truncate(long size) {
+    while (!blocks_.empty() && blocks_.back().offset >= size) {
+        blocks_.pop_back();
+    }
+    coveredSize_ = std::min(coveredSize_, size);
+    reachedMax_.clear();
+    remainingMin_.clear();
+}
+
+std::string SegmentIndex::serialize() const {
+    std::ostringstream out;
+    out << kHeader << ' ' << kVersion << ' ' << coveredSize_;
+    for (const Block& block : blocks_) {
+        out << '\n' << block.offset << ' ' << block.firstMicros << ' ' << block.lastMicros;
+    }
+    return out.str();
+}
+
+bool SegmentIndex::parse(const std::string& text) {
+    clear();
+    std::istringstream in(text);
+    std::string header;
+    int version = 0;
+    long covered = 0;
+    if (!(in >> header >> version >> covered) || header != kHeader || version != kVersion) {
+        return false;
+    }
+    Block block;
+    while (in >> block.offset >> block.firstMicros >> block.lastMicros) {
+        if (block.offset >= covered ||
+            (!blocks_.empty() && block.offset <= blocks_.back().offset)) {
+            clear();
+            return false;
+        }
+        blocks_.push_back(block);
+    }
+    if (!in.eof()) {
+        clear();
+        return false;
+    }
+    coveredSize_ = covered;
+    return true;
+}
+
+bool SegmentIndex::find(int64_t fromMicros, int64_t toMicros, long* begin, long* end) const {
+    if (blocks_.empty() || fromMicros > toMicros) {
+        return false;
+    }
+    if (reachedMax_.size() != blocks_.size()) {
+        size_t count = blocks_.size();
+        reachedMax_.resize(count);
+        remainingMin_.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            reachedMax_[i] = i == 0 ? blocks_[i].lastMicros
+                                    : std::max(reachedMax_[i - 1], blocks_[i].lastMicros);
+            size_t j = count - 1 - i;
+            remainingMin_[j] = i == 0 ? blocks_[j].firstMicros
+                                      : std::min(remainingMin_[j + 1], blocks_[j].firstMicros);
+        }
+    }
+    // Blocks before first only hold lines older than fromMicros, blocks
+    // after last only lines newer than toMicros.
+    size_t first = static_cast<size_t>(
+        std::lower_bound(reachedMax_.begin(), reachedMax_.end(), fromMicros) - reachedMax_.begin());
+    size_t afterLast = static_cast<size_t>(
+        std::upper_bound(remainingMin_.begin(), remainingMin_.end(), toMicros) -
+        remainingMin_.begin());
+    if (first >= afterLast) {
+        return false;
+    }
+    *begin = blocks_[first].offset;
+    *end = afterLast < blocks_.size() ? blocks_[afterLast].offset : coveredSize_;
+    return true;
+}
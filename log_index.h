@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Sparse time index of one text segment, kept next to it as <segment>.idx
+// (name.log3.idx also describes name.log3.gz). The segment is cut into
+// blocks that start on a line boundary, each with the earliest and latest
+// timestamp of its lines; a block ends where the next one starts and the
+// last one at coveredSize. Anything past coveredSize was appended after the
+// index was written and is not described by it.
+class SegmentIndex {
+public:
+    struct Block {
+        long offset;
+        int64_t firstMicros;
+        int64_t lastMicros;
+    };
+
+    // <segment>.idx, with a trailing .gz dropped.
+    static std::string pathFor(const std::string& segment);
+
+    void add(const Block& block);
+    void clear();
+    const std::vector<Block>& blocks() const { return blocks_; }
+    long coveredSize() const { return coveredSize_; }
+    void setCoveredSize(long size) { coveredSize_ = size; }
+    // Forgets blocks starting at or past size and covers at most size bytes.
+    void truncate(long size);
+
+    std::string serialize() const;
+    bool parse(const std::string& text);
+
+    // Byte range [*begin, *end) within the covered part of the segment that
+    // holds every line logged in [fromMicros, toMicros]. Blocks need not be
+    // in time order (threads drain their staged lines in turn); the running
+    // maximum of lastMicros and the trailing minimum of firstMicros are, so
+    // both ends are found by binary search. False if no block can match.
+    bool find(int64_t fromMicros, int64_t toMicros, long* begin, long* end) const;
+
+private:
+    std::vector<Block> blocks_;
+    long coveredSize_ = 0;
+    // Built on first use by find().
+    mutable std::vector<int64_t> reachedMax_;
+    mutable std::vector<int64_t> remainingMin_;
+};
@@ -0,0 +1,23 @@
+#pragma once
+
+enum class LogLevel : int {
+    Trace = 0,
+    Debug = 1,
+    Info = 2,
+    Warn = 3,
+    Error = 4,
+    Fatal = 5,
+    Off = 6,
+};
+
+inline const char* logLevelName(LogLevel level) {
+    static const char* const names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL", "OFF"};
+    int index = static_cast<int>(level);
+    return index >= 0 && index <= static_cast<int>(LogLevel::Off) ? names[index] : "?";
+}
+
+// Call sites below this level are compiled out. Build with e.g.
+// -DLITTLE_LOG_MIN_LEVEL=2 to drop TRACE and DEBUG from release binaries.
+#ifndef LITTLE_LOG_MIN_LEVEL
+#define LITTLE_LOG_MIN_LEVEL 0
+#endif
@@ -0,0 +1,302 @@
+#include "log_reader.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include "binary_log.h"
+#include "log_index.h"
+
+namespace {
+
+// "YYYY-MM-DD HH:MM:SS.uuuuuu"
+const size_t kTimestampSize = 26;
+
+bool endsWith(const std::string& value, const std::string& suffix) {
+    return value.size() >= suffix.size() &&
+           value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+struct Segment {
+    std::string path;
+    std::string prefix;
+    long index;
+};
+
+// name.log, name.logN, name.<seq>.log, each optionally .gz.
+bool parseSegmentName(std::string name, std::string* prefix, long* index) {
+    if (endsWith(name, ".gz")) {
+        name.resize(name.size() - 3);
+    }
+    size_t pos = name.rfind(".log");
+    if (pos == std::string::npos || pos == 0) {
+        return false;
+    }
+    std::string suffix = name.substr(pos + 4);
+    if (!suffix.empty() && suffix.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    *prefix = name.substr(0, pos);
+    *index = suffix.empty() ? 0 : std::strtol(suffix.c_str(), nullptr, 10);
+    return true;
+}
+
+void collect(const std::string& path, std::vector<std::string>& segments) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        segments.push_back(path);
+        return;
+    }
+
+    std::vector<std::string> directories;
+    std::vector<Segment> found;
+    if (DIR* dir = opendir(path.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name == "." || name == "..") {
+                continue;
+            }
+            std::string child = path + "/" + name;
+            Segment segment;
+            if (stat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                directories.push_back(child);
+            } else if (parseSegmentName(name, &segment.prefix, &segment.index)) {
+                segment.path = child;
+                found.push_back(segment);
+            }
+        }
+        closedir(dir);
+    }
+    std::sort(directories.begin(), directories.end());
+    for (const std::string& directory : directories) {
+        collect(directory, segments);
+    }
+    std::sort(found.begin(), found.end(), [](const Segment& a, const Segment& b) {
+        return a.prefix != b.prefix ? a.prefix < b.prefix : a.index > b.index;
+    });
+    for (const Segment& segment : found) {
+        segments.push_back(segment.path);
+    }
+}
+
+bool loadIndex(const std::string& segment, SegmentIndex* index) {
+    std::ifstream in(SegmentIndex::pathFor(segment));
+    if (!in) {
+        return false;
+    }
+    std::stringstream text;
+    text << in.rdbuf();
+    return index->parse(text.str());
+}
+
+bool looksLikeTimestamp(const char* line, size_t length) {
+    static const char kPattern[] = "dddd-dd-dd dd:dd:dd.dddddd";
+    if (length < kTimestampSize) {
+        return false;
+    }
+    for (size_t i = 0; i < kTimestampSize; ++i) {
+        bool digit = line[i] >= '0' && line[i] <= '9';
+        if (kPattern[i] == 'd' ? !digit : line[i] != kPattern[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+LogReader::LogReader(const std::vector<std::string>& paths) {
+    for (const std::string& path : paths) {
+        collect(path, segments_);
+    }
+}
+
+bool LogReader::read(int64_t fromMicros, int64_t toMicros,
+                     const std::function<void(const char* line, size_t length)>& sink) {
+    stats_ = Stats();
+    LinePrefixFormatter formatter;
+    LogStamp stamp;
+    stamp.micros = fromMicros;
+    formatter.format(stamp, LogLevel::Info, line_prefix::kTimestamp, fromText_);
+    stamp.micros = toMicros;
+    formatter.format(stamp, LogLevel::Info, line_prefix::kTimestamp, toText_);
+    sink_ = &sink;
+
+    bool ok = true;
+    for (const std::string& segment : segments_) {
+        ++stats_.segments;
+        bool read = endsWith(segment, ".gz") ? readCompressed(segment, fromMicros, toMicros)
+                                             : readPlain(segment, fromMicros, toMicros);
+        ok = ok && read;
+    }
+    sink_ = nullptr;
+    return ok;
+}
+
+std::vector<LogReader::Range> LogReader::rangesFor(const std::string& segment, long size,
+                                                   int64_t fromMicros, int64_t toMicros) const {
+    SegmentIndex index;
+    // size is -1 for compressed segments, whose length is only known once
+    // they are inflated.
+    if (!loadIndex(segment, &index) || (size >= 0 && index.coveredSize() > size)) {
+        return {Range{0, -1}};
+    }
+
+    std::vector<Range> ranges;
+    // Written before the index started (a logger without one) or after it
+    // was saved (the live segment): not described, so read.
+    if (index.blocks().empty()) {
+        ranges.push_back(Range{0, index.coveredSize()});
+    } else if (index.blocks().front().offset > 0) {
+        ranges.push_back(Range{0, index.blocks().front().offset});
+    }
+    long begin = 0;
+    long end = 0;
+    if (index.find(fromMicros, toMicros, &begin, &end)) {
+        ranges.push_back(Range{begin, end});
+    }
+    // Compressed segments were rotated, so their index saw all of them.
+    if (size >= 0 && index.coveredSize() < size) {
+        ranges.push_back(Range{index.coveredSize(), -1});
+    }
+
+    std::vector<Range> merged;
+    for (const Range& range : ranges) {
+        if (range.end >= 0 && range.end <= range.begin) {
+            continue;
+        }
+        if (!merged.empty() && merged.back().end == range.begin) {
+            merged.back().end = range.end;
+        } else {
+            merged.push_back(range);
+        }
+    }
+    return merged;
+}
+
+bool LogReader::readPlain(const std::string& segment, int64_t fromMicros, int64_t toMicros) {
+    int fd = ::open(segment.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    long size = static_cast<long>(st.st_size);
+    char magic[binary_log::kMagicSize];
+    if (size >= static_cast<long>(binary_log::kMagicSize) &&
+        pread(fd, magic, sizeof(magic), 0) == static_cast<ssize_t>(sizeof(magic)) &&
+        std::memcmp(magic, binary_log::kMagic, sizeof(magic)) == 0) {
+        ::close(fd);
+        return true;
+    }
+
+    std::vector<Range> ranges = rangesFor(segment, size, fromMicros, toMicros);
+    if (ranges.empty()) {
+        ++stats_.skipped;
+    }
+    static const long kPage = sysconf(_SC_PAGESIZE);
+    bool ok = true;
+    for (const Range& range : ranges) {
+        long end = range.end < 0 ? size : std::min(range.end, size);
+        if (range.begin >= end) {
+            continue;
+        }
+        long mapped = range.begin / kPage * kPage;
+        size_t length = static_cast<size_t>(end - mapped);
+        void* data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, mapped);
+        if (data == MAP_FAILED) {
+            ok = false;
+            continue;
+        }
+        madvise(data, length, MADV_SEQUENTIAL);
+        scan(static_cast<const char*>(data) + (range.begin - mapped),
+             static_cast<size_t>(end - range.begin));
+        munmap(data, length);
+    }
+    ::close(fd);
+    return ok;
+}
+
+bool LogReader::readCompressed(const std::string& segment, int64_t fromMicros, int64_t toMicros) {
+    gzFile file = gzopen(segment.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    gzbuffer(file, 64 * 1024);
+    char magic[binary_log::kMagicSize];
+    if (gzread(file, magic, sizeof(magic)) == static_cast<int>(sizeof(magic)) &&
+        std::memcmp(magic, binary_log::kMagic, sizeof(magic)) == 0) {
+        gzclose(file);
+        return true;
+    }
+
+    std::vector<Range> ranges = rangesFor(segment, -1, fromMicros, toMicros);
+    if (ranges.empty()) {
+        ++stats_.skipped;
+    }
+    bool ok = true;
+    std::string data;
+    char buffer[64 * 1024];
+    for (const Range& range : ranges) {
+        // Seeking inflates everything before the range, but none of it is
+        // kept or scanned.
+        if (gzseek(file, range.begin, SEEK_SET) != range.begin) {
+            ok = false;
+            break;
+        }
+        data.clear();
+        long wanted = range.end < 0 ? -1 : range.end - range.begin;
+        int n = 0;
+        while (wanted != 0) {
+            unsigned chunk = wanted < 0 ? sizeof(buffer)
+                                        : static_cast<unsigned>(
+                                              std::min<long>(wanted, sizeof(buffer)));
+            n = gzread(file, buffer, chunk);
+            if (n <= 0) {
+                break;
+            }
+            data.append(buffer, static_cast<size_t>(n));
+            if (wanted > 0) {
+                wanted -= n;
+            }
+        }
+        if (n < 0) {
+            ok = false;
+        }
+        scan(data.data(), data.size());
+    }
+    gzclose(file);
+    return ok;
+}
+
+void LogReader::scan(const char* data, size_t length) {
+    stats_.bytesRead += static_cast<long>(length);
+    const char* end = data + length;
+    while (data < end) {
+        const char* newline = static_cast<const char*>(std::memchr(data, '\n', end - data));
+        if (!newline) {
+            // Still being written.
+            return;
+        }
+        size_t lineLength = static_cast<size_t>(newline - data);
+        if (!looksLikeTimestamp(data, lineLength) ||
+            (std::memcmp(data, fromText_, kTimestampSize) >= 0 &&
+             std::memcmp(data, toText_, kTimestampSize) <= 0)) {
+            ++stats_.lines;
+            (*sink_)(data, lineLength);
+        }
+        data = newline + 1;
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "line_prefix.h"
+
+// Pulls the lines logged within a time range out of text segments: the live
+// log directory, backups made by Logger::backup(), or single files. Each
+// segment's .idx sidecar (see log_index.h) narrows it to the blocks that can
+// hold the range, and only those are mapped (inflated, for .gz segments);
+// segments without an index are read in full. Lines that start with the
+// line_prefix::kTimestamp field are filtered exactly, others are returned
+// with the whole block around them. Binary segments are skipped, they are
+// for little-log-decode.
+class LogReader {
+public:
+    struct Stats {
+        int segments = 0;
+        // Segments whose index ruled them out without reading any data.
+        int skipped = 0;
+        long bytesRead = 0;
+        long lines = 0;
+    };
+
+    // Segment files and directories. A directory contributes its
+    // subdirectories first (in name order, so log_<timestamp> backups come
+    // out oldest first) and then its own segments, oldest first.
+    explicit LogReader(const std::vector<std::string>& paths);
+
+    const std::vector<std::string>& segments() const { return segments_; }
+
+    // Calls sink with every matching line, without its newline, in segment
+    // order. Returns false if a segment could not be read; the others are
+    // still visited.
+    bool read(int64_t fromMicros, int64_t toMicros,
+              const std::function<void(const char* line, size_t length)>& sink);
+
+    // Counters of the last read().
+    const Stats& stats() const { return stats_; }
+
+private:
+    struct Range {
+        long begin;
+        // -1 runs to the end of the segment.
+        long end;
+    };
+
+    std::vector<Range> rangesFor(const std::string& segment, long size, int64_t fromMicros,
+                                 int64_t toMicros) const;
+    bool readPlain(const std::string& segment, int64_t fromMicros, int64_t toMicros);
+    bool readCompressed(const std::string& segment, int64_t fromMicros, int64_t toMicros);
+    void scan(const char* data, size_t length);
+
+    std::vector<std::string> segments_;
+    Stats stats_;
+    // Range bounds in the line prefix's text form, compared bytewise.
+    char fromText_[LinePrefixFormatter::kMaxSize];
+    char toText_[LinePrefixFormatter::kMaxSize];
+    const std::function<void(const char*, size_t)>* sink_ = nullptr;
+};
@@ -0,0 +1,43 @@
+#include "log_registry.h"
+#include "real_file_system.h"
+
+LogRegistry::LogRegistry(const RegistryOptions& options, std::shared_ptr<FileSystemInterface> fs)
+    : options_(options),
+      fs_(std::make_shared<PooledFileSystem>(fs ? fs : std::make_shared<RealFileSystem>(),
+                                             options.maxOpenFiles)),
+      writer_(std::make_shared<SharedWriter>(options.writer)) {}
+
+LogRegistry::~LogRegistry() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    channels_.clear();
+}
+
+Logger& LogRegistry::channel(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<Logger>& logger = channels_[name];
+    if (!logger) {
+        LoggerOptions options = options_.logger;
+        options.async = true;
+        options.writer = writer_;
+        logger.reset(new Logger(fs_));
+        logger->init(name, options_.filePath, options_.fileSize, options_.fileNum,
+                     options_.backupPath, options_.backupMaxSize, options);
+    }
+    return *logger;
+}
+
+std::vector<std::string> LogRegistry::names() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> names;
+    for (const auto& channel : channels_) {
+        names.push_back(channel.first);
+    }
+    return names;
+}
+
+void LogRegistry::flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& channel : channels_) {
+        channel.second->flush();
+    }
+}
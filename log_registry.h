@@ -0,0 +1,57 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "logger.h"
+#include "pooled_file_system.h"
+#include "shared_writer.h"
+
+struct RegistryOptions {
+    // Channel name logs to filePath/name/name.log and backs up under
+    // backupPath/name, with the sizes (in MB) and count of Logger::init().
+    std::string filePath;
+    int fileSize = 10;
+    int fileNum = 5;
+    std::string backupPath;
+    int backupMaxSize = 100;
+    // Every channel's options. They are always async, on the shared writer.
+    LoggerOptions logger;
+    // Descriptors all channels together keep open.
+    size_t maxOpenFiles = 64;
+    SharedWriterOptions writer;
+};
+
+// Named loggers for the subsystems of one process. Every channel is a
+// complete Logger with its own segments, rotation and backup(), but all of
+// them are written by one SharedWriter thread through one PooledFileSystem,
+// so hundreds of channels cost one writer thread and maxOpenFiles
+// descriptors rather than a thread and a descriptor each.
+class LogRegistry {
+public:
+    explicit LogRegistry(const RegistryOptions& options,
+                         std::shared_ptr<FileSystemInterface> fs = nullptr);
+    // Writes out and closes every channel.
+    ~LogRegistry();
+    LogRegistry(const LogRegistry&) = delete;
+    LogRegistry& operator=(const LogRegistry&) = delete;
+
+    // The channel called name, created on first use; name becomes the
+    // channel's file prefix. Safe to call from any thread, and the reference
+    // stays valid for the registry's lifetime.
+    Logger& channel(const std::string& name);
+    std::vector<std::string> names() const;
+    // Writes out everything logged so far on every channel.
+    void flush();
+
+    const PooledFileSystem& fileSystem() const { return *fs_; }
+
+private:
+    const RegistryOptions options_;
+    std::shared_ptr<PooledFileSystem> fs_;
+    std::shared_ptr<SharedWriter> writer_;
+    mutable std::mutex mutex_;
+    // Declared last so channels detach before the writer stops.
+    std::map<std::string, std::unique_ptr<Logger>> channels_;
+};
@@ -0,0 +1,113 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "line_prefix.h"
+
+// Bounded lock-free queue of log messages using per-slot sequence numbers.
+// Slots keep their string buffers between uses, so once the ring is warm a
+// push is a CAS plus a memcpy.
+class LogRing {
+public:
+    explicit LogRing(size_t capacity, size_t slotReserve = 256)
+        : mask_(roundUpPowerOfTwo(capacity) - 1), slots_(new Slot[mask_ + 1]) {
+        for (size_t i = 0; i <= mask_; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+            slots_[i].message.reserve(slotReserve);
+        }
+        enqueuePos_.store(0, std::memory_order_relaxed);
+        dequeuePos_.store(0, std::memory_order_relaxed);
+    }
+
+    LogRing(const LogRing&) = delete;
+    LogRing& operator=(const LogRing&) = delete;
+
+    bool tryPush(const char* data, size_t length, unsigned flags = 0,
+                 const LogStamp& stamp = LogStamp()) {
+        size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots_[pos & mask_];
+            size_t seq = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.message.assign(data, length);
+                    slot.flags = flags;
+                    slot.stamp = stamp;
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // consume(const std::string& message, unsigned flags, const LogStamp&)
+    // runs while the slot is still owned by the caller; the slot is released
+    // afterwards.
+    template <typename Consumer>
+    bool tryPop(Consumer&& consume) {
+        size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots_[pos & mask_];
+            size_t seq = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    consume(static_cast<const std::string&>(slot.message), slot.flags,
+                            static_cast<const LogStamp&>(slot.stamp));
+                    slot.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool empty() const {
+        size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+        return slots_[pos & mask_].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    // Number of tickets handed out to producers so far.
+    size_t pushed() const { return enqueuePos_.load(std::memory_order_acquire); }
+    size_t popped() const { return dequeuePos_.load(std::memory_order_acquire); }
+    size_t size() const {
+        size_t tail = popped();
+        size_t head = pushed();
+        return head > tail ? head - tail : 0;
+    }
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        unsigned flags = 0;
+        LogStamp stamp;
+        std::string message;
+    };
+
+    static size_t roundUpPowerOfTwo(size_t value) {
+        size_t result = 2;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+    char pad0_[64];
+    std::atomic<size_t> enqueuePos_;
+    char pad1_[64];
+    std::atomic<size_t> dequeuePos_;
+    char pad2_[64];
+};
@@ -0,0 +1,485 @@
+#include "log_scan.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include "binary_log.h"
+#include "log_reader.h"
+#include "worker_pool.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LOG_SCAN_X86 1
+#endif
+
+namespace {
+
+char lowerAscii(char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+char upperAscii(char c) {
+    return c >= 'a' && c <= 'z' ? static_cast<char>(c - 'a' + 'A') : c;
+}
+
+bool equalAt(const char* data, const char* needle, size_t length, bool ignoreCase) {
+    if (!ignoreCase) {
+        return std::memcmp(data, needle, length) == 0;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        if (lowerAscii(data[i]) != needle[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t findScalar(const char* data, size_t size, const char* needle, size_t length,
+                  bool ignoreCase) {
+    if (length == 0) {
+        return 0;
+    }
+    if (length > size) {
+        return size;
+    }
+    const char* end = data + (size - length) + 1;
+    if (!ignoreCase) {
+        for (const char* p = data; p < end; ++p) {
+            p = static_cast<const char*>(std::memchr(p, needle[0], static_cast<size_t>(end - p)));
+            if (!p) {
+                break;
+            }
+            if (std::memcmp(p, needle, length) == 0) {
+                return static_cast<size_t>(p - data);
+            }
+        }
+        return size;
+    }
+    for (const char* p = data; p < end; ++p) {
+        if (equalAt(p, needle, length, true)) {
+            return static_cast<size_t>(p - data);
+        }
+    }
+    return size;
+}
+
+size_t countScalar(const char* data, size_t size) {
+    return static_cast<size_t>(std::count(data, data + size, '\n'));
+}
+
+size_t findEscapeScalar(const char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        unsigned char c = static_cast<unsigned char>(data[i]);
+        if (c < 0x20 || c == '"' || c == '\\') {
+            return i;
+        }
+    }
+    return size;
+}
+
+#ifdef LOG_SCAN_X86
+
+// Bytes of data equal to c, or to its other case when IgnoreCase.
+template <bool IgnoreCase>
+__attribute__((target("avx2"))) inline __m256i matchAvx2(__m256i data, __m256i c, __m256i other) {
+    __m256i hits = _mm256_cmpeq_epi8(data, c);
+    return IgnoreCase ? _mm256_or_si256(hits, _mm256_cmpeq_epi8(data, other)) : hits;
+}
+
+// Two 32-byte blocks per iteration; a candidate needs both the first and
+// the last byte of the needle in place.
+template <bool IgnoreCase>
+__attribute__((target("avx2"))) size_t findAvx2(const char* data, size_t size,
+                                                 const char* needle, size_t length) {
+    if (length == 0 || length > size) {
+        return findScalar(data, size, needle, length, IgnoreCase);
+    }
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i firstOther = _mm256_set1_epi8(upperAscii(needle[0]));
+    const __m256i last = _mm256_set1_epi8(needle[length - 1]);
+    const __m256i lastOther = _mm256_set1_epi8(upperAscii(needle[length - 1]));
+    const char* tailData = data + length - 1;
+    size_t i = 0;
+    for (; i + length - 1 + 64 <= size; i += 64) {
+        __m256i low = _mm256_and_si256(
+            matchAvx2<IgnoreCase>(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)), first, firstOther),
+            matchAvx2<IgnoreCase>(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tailData + i)), last,
+                lastOther));
+        __m256i high = _mm256_and_si256(
+            matchAvx2<IgnoreCase>(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32)), first,
+                firstOther),
+            matchAvx2<IgnoreCase>(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tailData + i + 32)), last,
+                lastOther));
+        if (_mm256_testz_si256(_mm256_or_si256(low, high), _mm256_or_si256(low, high))) {
+            continue;
+        }
+        uint64_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(low)) |
+                        static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(high)))
+                            << 32;
+        while (mask != 0) {
+            size_t at = i + static_cast<size_t>(__builtin_ctzll(mask));
+            if (equalAt(data + at, needle, length, IgnoreCase)) {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+    size_t rest = findScalar(data + i, size - i, needle, length, IgnoreCase);
+    return rest == size - i ? size : i + rest;
+}
+
+__attribute__((target("avx2"))) size_t countAvx2(const char* data, size_t size) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        count += static_cast<size_t>(__builtin_popcount(
+            static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)))));
+    }
+    return count + countScalar(data + i, size - i);
+}
+
+// Bytes equal to '"' or '\\', or at most 0x1f (unsigned min leaves them as
+// they are).
+__attribute__((target("avx2"))) size_t findEscapeAvx2(const char* data, size_t size) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, quote), _mm256_cmpeq_epi8(block, backslash)),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(block, control), block));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hits));
+        if (mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+    return i + findEscapeScalar(data + i, size - i);
+}
+
+template <bool IgnoreCase>
+__attribute__((target("sse4.2"))) inline __m128i matchSse42(__m128i data, __m128i c,
+                                                             __m128i other) {
+    __m128i hits = _mm_cmpeq_epi8(data, c);
+    return IgnoreCase ? _mm_or_si128(hits, _mm_cmpeq_epi8(data, other)) : hits;
+}
+
+template <bool IgnoreCase>
+__attribute__((target("sse4.2"))) size_t findSse42(const char* data, size_t size,
+                                                    const char* needle, size_t length) {
+    if (length == 0 || length > size) {
+        return findScalar(data, size, needle, length, IgnoreCase);
+    }
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i firstOther = _mm_set1_epi8(upperAscii(needle[0]));
+    const __m128i last = _mm_set1_epi8(needle[length - 1]);
+    const __m128i lastOther = _mm_set1_epi8(upperAscii(needle[length - 1]));
+    const char* tailData = data + length - 1;
+    size_t i = 0;
+    for (; i + length - 1 + 32 <= size; i += 32) {
+        __m128i low = _mm_and_si128(
+            matchSse42<IgnoreCase>(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)),
+                                   first, firstOther),
+            matchSse42<IgnoreCase>(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(tailData + i)), last, lastOther));
+        __m128i high = _mm_and_si128(
+            matchSse42<IgnoreCase>(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16)), first,
+                firstOther),
+            matchSse42<IgnoreCase>(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(tailData + i + 16)), last,
+                lastOther));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(low)) |
+                        static_cast<uint32_t>(_mm_movemask_epi8(high)) << 16;
+        while (mask != 0) {
+            size_t at = i + static_cast<size_t>(__builtin_ctz(mask));
+            if (equalAt(data + at, needle, length, IgnoreCase)) {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+    size_t rest = findScalar(data + i, size - i, needle, length, IgnoreCase);
+    return rest == size - i ? size : i + rest;
+}
+
+__attribute__((target("sse4.2"))) size_t countSse42(const char* data, size_t size) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        count += static_cast<size_t>(_mm_popcnt_u32(
+            static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)))));
+    }
+    return count + countScalar(data + i, size - i);
+}
+
+__attribute__((target("sse4.2"))) size_t findEscapeSse42(const char* data, size_t size) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash)),
+            _mm_cmpeq_epi8(_mm_min_epu8(block, control), block));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hits));
+        if (mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+    return i + findEscapeScalar(data + i, size - i);
+}
+
+#endif
+
+bool isBinarySegment(const char* data, size_t size) {
+    return size >= binary_log::kMagicSize &&
+           std::memcmp(data, binary_log::kMagic, binary_log::kMagicSize) == 0;
+}
+
+bool endsWith(const std::string& value, const std::string& suffix) {
+    return value.size() >= suffix.size() &&
+           value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}  // namespace
+
+namespace log_scan {
+
+Kernel bestKernel() {
+#ifdef LOG_SCAN_X86
+    static const Kernel best = __builtin_cpu_supports("avx2")     ? Kernel::Avx2
+                               : __builtin_cpu_supports("sse4.2") ? Kernel::Sse42
+                                                                  : Kernel::Scalar;
+    return best;
+#else
+    return Kernel::Scalar;
+#endif
+}
+
+const char* kernelName(Kernel kernel) {
+    switch (kernel) {
+    case Kernel::Avx2:
+        return "avx2";
+    case Kernel::Sse42:
+        return "sse4.2";
+    default:
+        return "scalar";
+    }
+}
+
+size_t find(Kernel kernel, const char* data, size_t size, const char* needle, size_t length,
+            bool ignoreCase) {
+#ifdef LOG_SCAN_X86
+    if (kernel == Kernel::Avx2) {
+        return ignoreCase ? findAvx2<true>(data, size, needle, length)
+                          : findAvx2<false>(data, size, needle, length);
+    }
+    if (kernel == Kernel::Sse42) {
+        return ignoreCase ? findSse42<true>(data, size, needle, length)
+                          : findSse42<false>(data, size, needle, length);
+    }
+#else
+    (void)kernel;
+#endif
+    return findScalar(data, size, needle, length, ignoreCase);
+}
+
+size_t countNewlines(Kernel kernel, const char* data, size_t size) {
+#ifdef LOG_SCAN_X86
+    if (kernel == Kernel::Avx2) {
+        return countAvx2(data, size);
+    }
+    if (kernel == Kernel::Sse42) {
+        return countSse42(data, size);
+    }
+#else
+    (void)kernel;
+#endif
+    return countScalar(data, size);
+}
+
+size_t findJsonEscape(Kernel kernel, const char* data, size_t size) {
+#ifdef LOG_SCAN_X86
+    if (kernel == Kernel::Avx2) {
+        return findEscapeAvx2(data, size);
+    }
+    if (kernel == Kernel::Sse42) {
+        return findEscapeSse42(data, size);
+    }
+#else
+    (void)kernel;
+#endif
+    return findEscapeScalar(data, size);
+}
+
+}  // namespace log_scan
+
+LogGrep::LogGrep(const std::vector<std::string>& paths, const std::string& pattern,
+                 const GrepOptions& options)
+    : segments_(LogReader(paths).segments()), options_(options) {
+    // A kernel the CPU lacks would fault; fall back to what it has.
+    if (static_cast<int>(options_.kernel) > static_cast<int>(log_scan::bestKernel())) {
+        options_.kernel = log_scan::bestKernel();
+    }
+    anchored_ = !pattern.empty() && pattern[0] == '^';
+    needle_ = anchored_ ? "\n" + pattern.substr(1) : pattern;
+    if (options_.ignoreCase) {
+        std::transform(needle_.begin(), needle_.end(), needle_.begin(), lowerAscii);
+    }
+}
+
+bool LogGrep::search(std::vector<GrepMatch>* matches) const {
+    size_t count = segments_.size();
+    std::vector<std::vector<GrepMatch>> found(count);
+    std::vector<long> scanned(count, 0);
+    std::vector<char> ok(count, 1);
+    int threads = options_.threads > 0 ? options_.threads
+                                       : static_cast<int>(std::thread::hardware_concurrency());
+    threads = std::max(1, std::min(threads, static_cast<int>(count)));
+    if (threads == 1) {
+        for (size_t i = 0; i < count; ++i) {
+            ok[i] = searchSegment(segments_[i], &found[i], &scanned[i]);
+        }
+    } else {
+        WorkerPool pool(threads);
+        for (size_t i = 0; i < count; ++i) {
+            pool.submit([&, i] { ok[i] = searchSegment(segments_[i], &found[i], &scanned[i]); });
+        }
+        pool.wait();
+    }
+
+    bytesScanned_ = 0;
+    bool all = true;
+    for (size_t i = 0; i < count; ++i) {
+        matches->insert(matches->end(), std::make_move_iterator(found[i].begin()),
+                        std::make_move_iterator(found[i].end()));
+        bytesScanned_ += scanned[i];
+        all = all && ok[i];
+    }
+    return all;
+}
+
+bool LogGrep::searchSegment(const std::string& segment, std::vector<GrepMatch>* matches,
+                            long* scanned) const {
+    if (endsWith(segment, ".gz")) {
+        gzFile file = gzopen(segment.c_str(), "rb");
+        if (!file) {
+            return false;
+        }
+        gzbuffer(file, 256 * 1024);
+        std::string content;
+        char buffer[64 * 1024];
+        int n;
+        while ((n = gzread(file, buffer, sizeof(buffer))) > 0) {
+            content.append(buffer, static_cast<size_t>(n));
+        }
+        bool ok = gzclose(file) == Z_OK && n == 0;
+        *scanned = static_cast<long>(content.size());
+        scan(segment, content.data(), content.size(), matches);
+        return ok;
+    }
+
+    int fd = ::open(segment.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        ::close(fd);
+        return true;
+    }
+#ifdef MAP_POPULATE
+    // Faulting in one page at a time costs more than the scan itself.
+    const int flags = MAP_PRIVATE | MAP_POPULATE;
+#else
+    const int flags = MAP_PRIVATE;
+#endif
+    void* data = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    *scanned = static_cast<long>(size);
+    scan(segment, static_cast<const char*>(data), size, matches);
+    munmap(data, size);
+    return true;
+}
+
+void LogGrep::scan(const std::string& segment, const char* data, size_t size,
+                   std::vector<GrepMatch>* matches) const {
+    if (isBinarySegment(data, size)) {
+        return;
+    }
+    const log_scan::Kernel kernel = options_.kernel;
+    const bool ignoreCase = options_.ignoreCase;
+    const char* needle = needle_.data();
+    size_t length = needle_.size();
+
+    // pos is always the start of a line; newlines before counted are
+    // already in lineNumber.
+    size_t pos = 0;
+    size_t counted = 0;
+    long lineNumber = 1;
+    while (pos < size) {
+        size_t lineStart;
+        if (anchored_ && pos == 0 && length - 1 <= size &&
+            equalAt(data, needle + 1, length - 1, ignoreCase)) {
+            lineStart = 0;
+        } else {
+            // An anchored needle starts with the newline ending the line
+            // before, which for the line at pos is at pos - 1.
+            size_t from = anchored_ && pos > 0 ? pos - 1 : pos;
+            size_t hit = log_scan::find(kernel, data + from, size - from, needle, length,
+                                        ignoreCase);
+            if (hit == size - from) {
+                break;
+            }
+            size_t at = from + hit;
+            if (anchored_) {
+                lineStart = at + 1;
+            } else {
+                lineStart = at;
+                while (lineStart > pos && data[lineStart - 1] != '\n') {
+                    --lineStart;
+                }
+            }
+        }
+        const char* end =
+            static_cast<const char*>(std::memchr(data + lineStart, '\n', size - lineStart));
+        if (!end) {
+            // Still being written.
+            break;
+        }
+        lineNumber += static_cast<long>(
+            log_scan::countNewlines(kernel, data + counted, lineStart - counted));
+        counted = lineStart;
+        GrepMatch match;
+        match.segment = segment;
+        match.lineNumber = lineNumber;
+        match.offset = static_cast<long>(lineStart);
+        match.line.assign(data + lineStart, end);
+        matches->push_back(std::move(match));
+        pos = static_cast<size_t>(end - data) + 1;
+    }
+}
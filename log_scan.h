@@ -0,0 +1,83 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Byte-scanning kernels behind LogGrep. The AVX2 and SSE4.2 versions test
+// the needle's first and last byte against 32 (16) positions at once and
+// only compare the whole needle where both agree; they are compiled with
+// per-function target attributes and picked at run time, so the library
+// itself needs no -mavx2.
+namespace log_scan {
+
+enum class Kernel {
+    Scalar,
+    Sse42,
+    Avx2,
+};
+
+// The fastest kernel this CPU runs.
+Kernel bestKernel();
+const char* kernelName(Kernel kernel);
+
+// Offset of the first occurrence of needle in data, or size if there is
+// none. ignoreCase folds ASCII letters only; needle must then be lowercase.
+size_t find(Kernel kernel, const char* data, size_t size, const char* needle, size_t length,
+            bool ignoreCase);
+size_t countNewlines(Kernel kernel, const char* data, size_t size);
+// Offset of the first byte a JSON string has to escape (a quote, a
+// backslash or a control character), or size if there is none.
+size_t findJsonEscape(Kernel kernel, const char* data, size_t size);
+
+}  // namespace log_scan
+
+struct GrepOptions {
+    bool ignoreCase = false;
+    // Segments searched at the same time; 0 uses one thread per core.
+    int threads = 0;
+    log_scan::Kernel kernel = log_scan::bestKernel();
+};
+
+struct GrepMatch {
+    std::string segment;
+    // 1-based, within the segment.
+    long lineNumber = 0;
+    // Of the line's first byte.
+    long offset = 0;
+    std::string line;
+};
+
+// Finds the lines containing a pattern in text segments laid out the way
+// Logger writes them: name.log/name.logN or name.<seq>.log (optionally .gz)
+// in the log directory and in the log_<timestamp> directories backup()
+// creates, visited in LogReader's order. A pattern starting with '^' must
+// match at the start of the line; otherwise it is a plain substring.
+// Segments are mapped (or inflated) and searched on a pool of threads;
+// binary segments are skipped.
+class LogGrep {
+public:
+    LogGrep(const std::vector<std::string>& paths, const std::string& pattern,
+            const GrepOptions& options = GrepOptions());
+
+    const std::vector<std::string>& segments() const { return segments_; }
+
+    // Appends every match in log order: segment by segment, oldest first,
+    // and by offset within a segment. Returns false if a segment could not
+    // be read; the others are still searched.
+    bool search(std::vector<GrepMatch>* matches) const;
+    // Bytes of segment data scanned by the last search().
+    long bytesScanned() const { return bytesScanned_; }
+
+private:
+    bool searchSegment(const std::string& segment, std::vector<GrepMatch>* matches,
+                       long* scanned) const;
+    void scan(const std::string& segment, const char* data, size_t size,
+              std::vector<GrepMatch>* matches) const;
+
+    std::vector<std::string> segments_;
+    GrepOptions options_;
+    bool anchored_ = false;
+    // The pattern, lowercased for ignoreCase; "\n" + pattern when anchored.
+    std::string needle_;
+    mutable long bytesScanned_ = 0;
+};
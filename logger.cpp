@@ -1,16 +1,141 @@
 #include "logger.h"
 #include "real_file_system.h"
+#include "shared_writer.h"
+#include "shm_ring.h"
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <iomanip>
-#include <iostream>
+#include <map>
 #include <sstream>
 
+namespace {
+const unsigned kTerminalFlag = 1;
+const unsigned kBinaryFlag = 2;
+const unsigned kStructuredFlag = 4;
+const unsigned kStampFlag = 8;
+const unsigned kLevelShift = 4;
+
+LogLevel levelOf(unsigned flags) {
+  return static_cast<LogLevel>((flags >> kLevelShift) & 7);
+}
+const size_t kMaxStagedBytes = 1 << 20;
+
+std::atomic<uint64_t> nextLoggerId{1};
+
+// Unbuffered, for when there is no TerminalSink to go through.
+void writeAll(int fd, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t n = ::write(fd, data, length);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    data += n;
+    length -= static_cast<size_t>(n);
+  }
+}
+
+// Whether name ends in tag followed by at least one digit.
+bool hasNumberedSuffix(const std::string &name, const char *tag) {
+  size_t last = name.find_last_not_of("0123456789");
+  size_t length = std::strlen(tag);
+  return last != std::string::npos && last + 1 < name.size() &&
+         last + 1 >= length && name.compare(last + 1 - length, length, tag) == 0;
+}
+
+bool endsWith(const std::string &name, const char *suffix) {
+  size_t length = std::strlen(suffix);
+  return name.size() >= length &&
+         name.compare(name.size() - length, length, suffix) == 0;
+}
+}
+
+struct Logger::BackupEntry {
+  // contentId() of the segment, "-" for the active file and for anything
+  // that cannot be shared.
+  std::string id;
+  long size;
+  // Relative to the backup root, e.g. log_20261017140200/app.log3.
+  std::string path;
+};
+
+struct Logger::StagingBuffer {
+  std::mutex mutex;
+  std::string records;
+};
+
 Logger::Logger(std::shared_ptr<FileSystemInterface> fs)
-    : fs_(fs ? fs : std::make_shared<RealFileSystem>()) {}
+    : fs_(fs ? fs : std::make_shared<RealFileSystem>()),
+      id_(nextLoggerId.fetch_add(1)) {}
+
+int BackupReport::count(CopyStrategy strategy) const {
+  int n = 0;
+  for (const File &file : files) {
+    if (file.strategy == strategy) {
+      ++n;
+    }
+  }
+  return n;
+}
+
+Logger::~Logger() {
+  {
+    std::unique_lock<std::mutex> lock(backupsMutex_);
+    backupsCv_.wait(lock, [this] { return backupsInFlight_ == 0; });
+  }
+  bool dumping = stopDumper();
+  stopCollector();
+  stopWriter();
+  stopFlusher();
+  {
+    std::lock_guard<std::timed_mutex> lock(appenderMutex_);
+    drainStagingLocked();
+    writeRepeats();
+    flushPending();
+    if (indexing() && currentSize_ > 0) {
+      closeIndexBlock();
+      saveIndex(getLogFilePath(0), currentSize_);
+    }
+  }
+  stopCompression();
+  if (dumping) {
+    dumpMetrics();
+  }
+}
 
 void Logger::init(const std::string &filePreName, const std::string &filePath,
                   int fileSize, int fileNum, const std::string &backupPath,
-                  int backupMaxSize) {
+                  int backupMaxSize, const LoggerOptions &options) {
+  {
+    // Their snapshots are about to be treated as leftovers.
+    std::unique_lock<std::mutex> lock(backupsMutex_);
+    backupsCv_.wait(lock, [this] { return backupsInFlight_ == 0; });
+  }
+  bool dumping = stopDumper();
+  stopCollector();
+  stopWriter();
+  stopFlusher();
+  stopCompression();
+  std::lock_guard<std::timed_mutex> lock(appenderMutex_);
+  drainStagingLocked();
+  writeRepeats();
+  flushPending();
+  batch_.unmap();
+  if (dumping) {
+    dumpMetrics();
+  }
+  if (indexing() && currentSize_ > 0) {
+    closeIndexBlock();
+    saveIndex(getLogFilePath(0), currentSize_);
+  }
+
   filePreName_ = filePreName;
   filePath_ = filePath;
   fileSize_ = fileSize * 1024 * 1024;
@@ -18,46 +143,822 @@ void Logger::init(const std::string &filePreName, const std::string &filePath,
   backupPath_ = backupPath;
   backupMaxSize_ = backupMaxSize * 1024 * 1024;
 
-  createDirectories(filePath_ + "/" + filePreName_);
-  createDirectories(backupPath_);
+  if (options.shared.role != SharedRole::Producer) {
+    createDirectories(filePath_ + "/" + filePreName_);
+    createDirectories(backupPath_);
+  }
+
+  options_ = options;
+  const SuppressionOptions &suppression = options_.suppression;
+  limiter_.reset(suppression.perSecond > 0
+                     ? new RateLimiter(suppression.perSecond, suppression.burst,
+                                       suppression.buckets)
+                     : nullptr);
+  haveLast_ = false;
+  repeats_ = 0;
+  if (options_.writer) {
+    terminal_ = options_.writer->terminal();
+  } else if (options_.terminal.enabled) {
+    terminal_ = std::make_shared<TerminalSink>(options_.terminal);
+  } else {
+    terminal_.reset();
+  }
+  {
+    std::lock_guard<std::mutex> lock(sharedMutex_);
+    sharedRing_.store(nullptr);
+    shm_.reset();
+    nextAttach_ = std::chrono::steady_clock::time_point();
+  }
+  if (options_.shared.role == SharedRole::Producer) {
+    // The collector owns the files; everything goes into its ring.
+    file_.reset();
+    currentSize_ = 0;
+    attachShared();
+    setLevel(options_.minLevel);
+    return;
+  }
+  file_.reset();
+  rotations_ = 0;
+  if (options_.rotation == RotationScheme::Sequence) {
+    loadManifest();
+  }
+  cachePaths();
+  removeLeftovers();
+  fs_->recoverFile(getLogFilePath(0));
+  recoverPending();
+  currentSize_ = fs_->getFileSize(getLogFilePath(0));
+  definedFormats_.clear();
+  loadIndex();
+
+  if (options_.compression.workers > 0) {
+    if (options_.writer) {
+      compressors_ = options_.writer->compressors();
+    }
+    if (!compressors_) {
+      compressors_ =
+          std::make_shared<WorkerPool>(options_.compression.workers);
+    }
+    // Pick up segments a previous run rotated but did not get to compress.
+    for (int i = 1; i < segmentCount(); ++i) {
+      if (fs_->fileExists(getLogFilePath(i))) {
+        queueCompression(options_.rotation == RotationScheme::Sequence
+                             ? lastSegment_ - i
+                             : rotations_ - i + 1);
+      }
+    }
+  }
+
+  setLevel(options_.minLevel);
+  if (options_.pending.mapped &&
+      !batch_.map(pendingPath(), options_.pending.capacity,
+                  options_.pending.drainOnFatalSignal)) {
+    metrics_.add(LoggerMetrics::kFileSystemErrors);
+  }
+  batch_.reserve(options_.flush.maxBufferedBytes);
+  lastSync_ = std::chrono::steady_clock::now();
+  unsyncedFlushes_ = 0;
+  if (options_.async) {
+    startWriter();
+  } else if (options_.flush.maxDelayMs > 0) {
+    startFlusher();
+  }
+  if (options_.shared.role == SharedRole::Collector) {
+    startCollector();
+  }
+  if (options_.metrics.dumpIntervalMs > 0 &&
+      !options_.metrics.dumpPath.empty()) {
+    startDumper();
+  }
 }
 
 void Logger::enableTerminal() { terminalEnabled_ = true; }
 
 void Logger::disableTerminal() { terminalEnabled_ = false; }
 
+void Logger::setLevel(LogLevel level) {
+  level_.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
 void Logger::logMsg(const std::string &message) {
-  if (terminalEnabled_) {
-    std::cout << message << std::endl;
+  logMsg(LogLevel::Info, message);
+}
+
+void Logger::logMsg(LogLevel level, const std::string &message) {
+  if (!shouldLog(level) ||
+      (limiter_ &&
+       limited(RateLimiter::hash(message.data(), message.size())))) {
+    return;
+  }
+  submit(message.data(), message.size(),
+         static_cast<unsigned>(level) << kLevelShift);
+}
+
+void Logger::logMsg(LogLevel level, const char *data, size_t length) {
+  if (!shouldLog(level) ||
+      (limiter_ && limited(RateLimiter::hash(data, length)))) {
+    return;
+  }
+  submit(data, length, static_cast<unsigned>(level) << kLevelShift);
+}
+
+void Logger::logFormat(const char *format, ...) {
+  // The format string stands for the call site, and is checked before
+  // anything is formatted.
+  if (!shouldLog(LogLevel::Info) ||
+      (limiter_ && limited(reinterpret_cast<uintptr_t>(format)))) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  logFormatted(LogLevel::Info, format, args);
+  va_end(args);
+}
+
+void Logger::logFormat(LogLevel level, const char *format, ...) {
+  if (!shouldLog(level) ||
+      (limiter_ && limited(reinterpret_cast<uintptr_t>(format)))) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  logFormatted(level, format, args);
+  va_end(args);
+}
+
+void Logger::logFormatted(LogLevel level, const char *format, va_list args) {
+  // Most lines fit the stack buffer; longer ones go to a per-thread string
+  // that keeps the largest size it has seen.
+  char buffer[512];
+  va_list retry;
+  va_copy(retry, args);
+  int length = std::vsnprintf(buffer, sizeof(buffer), format, args);
+  if (length < 0) {
+    va_end(retry);
+    return;
+  }
+  if (static_cast<size_t>(length) < sizeof(buffer)) {
+    va_end(retry);
+    submit(buffer, static_cast<size_t>(length),
+           static_cast<unsigned>(level) << kLevelShift);
+    return;
+  }
+  thread_local std::string arena;
+  arena.resize(static_cast<size_t>(length) + 1);
+  std::vsnprintf(&arena[0], arena.size(), format, retry);
+  va_end(retry);
+  submit(arena.data(), static_cast<size_t>(length),
+         static_cast<unsigned>(level) << kLevelShift);
+}
+
+void Logger::logRecord(LogLevel level, const std::string &record) {
+  submit(record.data(), record.size(),
+         kBinaryFlag | (static_cast<unsigned>(level) << kLevelShift));
+}
+
+void Logger::logStructured(LogLevel level, const std::string &record) {
+  submit(record.data(), record.size(),
+         kStructuredFlag | (static_cast<unsigned>(level) << kLevelShift));
+}
+
+void Logger::submit(const char *data, size_t length, unsigned flags) {
+  metrics_.add(LoggerMetrics::kMessages);
+  LogStamp stamp;
+  bool producer = options_.shared.role == SharedRole::Producer;
+  // Producers always stamp; whether it is printed is the collector's choice.
+  if (options_.prefix != 0 || producer) {
+    stamp = LinePrefixFormatter::stamp();
+    flags |= kStampFlag;
+  }
+  if (producer) {
+    if (pushShared(data, length, flags, stamp) && printing()) {
+      thread_local LinePrefixFormatter formatter;
+      printToTerminal(data, length,
+                      options_.prefix != 0 ? flags : flags & ~kStampFlag, stamp,
+                      formatter);
+    }
+    return;
+  }
+  enqueue(data, length, flags, stamp, printing());
+}
+
+void Logger::enqueue(const char *data, size_t length, unsigned flags,
+                     const LogStamp &stamp, bool terminal) {
+  if (ring_) {
+    if (terminal) {
+      flags |= kTerminalFlag;
+    }
+    if (options_.overload.policy == OverloadPolicy::Sample &&
+        ring_->size() >= ring_->capacity() / 2 && !keepSample(levelOf(flags))) {
+      dropMessage();
+      return;
+    }
+    if (!ring_->tryPush(data, length, flags, stamp)) {
+      metrics_.add(LoggerMetrics::kQueueFullWaits);
+      if (!pushUnderPressure(data, length, flags, stamp)) {
+        dropMessage();
+        return;
+      }
+    }
+    wakeWriter();
+    return;
+  }
+
+  if (stage(data, length, flags, stamp) && terminal) {
+    thread_local LinePrefixFormatter formatter;
+    printToTerminal(data, length, flags, stamp, formatter);
+  }
+}
+
+bool Logger::pushUnderPressure(const char *data, size_t length, unsigned flags,
+                               const LogStamp &stamp) {
+  switch (options_.overload.policy) {
+  case OverloadPolicy::Block: {
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(options_.overload.blockTimeoutMs);
+    do {
+      wakeWriter();
+      std::this_thread::yield();
+      if (options_.overload.blockTimeoutMs > 0 &&
+          std::chrono::steady_clock::now() >= deadline) {
+        return false;
+      }
+    } while (!ring_->tryPush(data, length, flags, stamp));
+    return true;
+  }
+  case OverloadPolicy::DropOldest:
+    do {
+      if (ring_->tryPop(
+              [](const std::string &, unsigned, const LogStamp &) {})) {
+        dropMessage();
+      }
+    } while (!ring_->tryPush(data, length, flags, stamp));
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool Logger::keepSample(LogLevel level) const {
+  int index = std::min(static_cast<int>(level), 5);
+  double rate = options_.overload.sampleRates[index];
+  if (rate >= 1.0) {
+    return true;
   }
-  writeToFile(message);
+  thread_local uint64_t state =
+      0x9E3779B97F4A7C15ull ^ reinterpret_cast<uintptr_t>(&state);
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return static_cast<double>(state >> 11) * (1.0 / 9007199254740992.0) < rate;
+}
+
+void Logger::dropMessage() {
+  droppedPending_.fetch_add(1, std::memory_order_relaxed);
+  metrics_.add(LoggerMetrics::kDropped);
+}
+
+void Logger::reportDrops() {
+  // Producers report theirs through the ring, see pushShared().
+  if (droppedPending_.load(std::memory_order_relaxed) == 0 ||
+      options_.shared.role == SharedRole::Producer) {
+    return;
+  }
+  std::string line = std::to_string(droppedPending_.exchange(0)) +
+                     " messages dropped";
+  unsigned flags = static_cast<unsigned>(LogLevel::Warn) << kLevelShift;
+  LogStamp stamp;
+  if (options_.prefix != 0) {
+    stamp = LinePrefixFormatter::stamp();
+    flags |= kStampFlag;
+  }
+  if (printing()) {
+    printToTerminal(line.data(), line.size(), flags, stamp, prefixFormatter_);
+  }
+  writeToFile(line.data(), line.size(), flags, stamp);
+}
+
+bool Logger::limited(uint64_t key) {
+  if (limiter_->allow(key)) {
+    return false;
+  }
+  metrics_.add(LoggerMetrics::kRateLimited);
+  return true;
+}
+
+bool Logger::repeatOf(const char *data, size_t length, unsigned flags,
+                      const LogStamp &stamp) {
+  // Whether a copy went to the terminal does not make it a different line.
+  flags &= ~kTerminalFlag;
+  if (haveLast_ && flags == lastFlags_ && length == lastMessage_.size() &&
+      std::memcmp(data, lastMessage_.data(), length) == 0) {
+    auto now = std::chrono::steady_clock::now();
+    if (repeats_++ == 0) {
+      repeatsSince_ = now;
+    }
+    lastStamp_ = stamp;
+    metrics_.add(LoggerMetrics::kRepeatsCoalesced);
+    if (now - repeatsSince_ >=
+        std::chrono::milliseconds(options_.suppression.windowMs)) {
+      writeRepeats();
+    }
+    return true;
+  }
+  writeRepeats();
+  lastMessage_.assign(data, length);
+  lastFlags_ = flags;
+  haveLast_ = true;
+  return false;
+}
+
+void Logger::writeRepeats() {
+  if (repeats_ == 0) {
+    return;
+  }
+  char line[64];
+  int n = std::snprintf(line, sizeof(line), "last message repeated %llu times",
+                        static_cast<unsigned long long>(repeats_));
+  repeats_ = 0;
+  // Later copies are still compared with the message, not with this line.
+  writeRecord(line, static_cast<size_t>(n),
+              lastFlags_ & ~(kBinaryFlag | kStructuredFlag), lastStamp_);
+}
+
+void Logger::printToTerminal(const char *data, size_t length, unsigned flags,
+                             const LogStamp &stamp,
+                             LinePrefixFormatter &formatter) {
+  thread_local std::string line;
+  line.clear();
+  if (flags & kStructuredFlag) {
+    // The prefix fields go into the JSON object.
+    structured_log::renderJson(data, length,
+                               (flags & kStampFlag) ? &stamp : nullptr,
+                               levelOf(flags), options_.prefix, line);
+  } else {
+    if (flags & kStampFlag) {
+      char prefix[LinePrefixFormatter::kMaxSize];
+      line.append(prefix, formatter.format(stamp, levelOf(flags),
+                                           options_.prefix, prefix));
+    }
+    if (flags & kBinaryFlag) {
+      binary_log::renderRecord(data, length, line);
+    } else {
+      line.append(data, length);
+    }
+  }
+  line += '\n';
+  terminal_->write(line.data(), line.size());
 }
 
 void Logger::logFact(const std::string &message) {
-  std::cout << message << std::endl;
+  thread_local std::string line;
+  line.assign(message);
+  line += '\n';
+  if (!terminal_) {
+    // Facts are never dropped, even with the terminal switched off.
+    writeAll(options_.terminal.fd, line.data(), line.size());
+    return;
+  }
+  terminal_->write(line.data(), line.size(), false);
 }
 
-void Logger::backup() {
+void Logger::flush() {
+  flushFile();
+  if (terminal_) {
+    terminal_->flush();
+  }
+}
+
+void Logger::flushFile() {
+  if (options_.shared.role == SharedRole::Producer) {
+    return;
+  }
+  if (collector_.joinable()) {
+    // Everything producers published so far goes through the pipeline
+    // below before it is flushed.
+    uint64_t target = shm_->pushed();
+    while (shm_->popped() < target) {
+      {
+        std::lock_guard<std::mutex> lock(sharedMutex_);
+        collectorWake_ = true;
+      }
+      collectorCv_.notify_one();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  if (!ring_) {
+    std::lock_guard<std::timed_mutex> lock(appenderMutex_);
+    drainStagingLocked();
+    writeRepeats();
+    flushPending();
+    return;
+  }
+  size_t target = ring_->pushed();
+  std::unique_lock<std::mutex> lock(writerMutex_);
+  if (target > flushTarget_) {
+    flushTarget_ = target;
+  }
+  writerCv_.notify_one();
+  if (sharedWriter_) {
+    sharedWriter_->wake();
+  }
+  flushedCv_.wait(lock, [&] { return flushed_ >= target; });
+}
+
+BackupReport Logger::backup() {
+  if (options_.shared.role == SharedRole::Producer) {
+    return BackupReport();
+  }
+  flushFile();
+
+  bool incremental = options_.backup.incremental;
+  std::string root = backupPath_ + "/" + filePreName_;
   std::string timestamp = getCurrentTimestamp();
-  std::string backupDir =
-      backupPath_ + "/" + filePreName_ + "/log_" + timestamp;
-  createDirectories(backupDir);
+  BackupReport report;
+  report.directory = root + "/log_" + timestamp;
+  {
+    // Later backups refer into this one, so it must not be overwritten by a
+    // second backup within the same second, including one that
+    // backupAsync() runs at the same time.
+    std::lock_guard<std::mutex> lock(backupsMutex_);
+    for (int n = 1; incremental && fs_->fileExists(report.directory); ++n) {
+      report.directory = root + "/log_" + timestamp + "_" + std::to_string(n);
+    }
+    createDirectories(report.directory);
+  }
+  std::string name = report.directory.substr(root.size() + 1);
+
+  // Content id -> where an earlier backup keeps that segment.
+  std::map<std::string, std::string> stored;
+  std::vector<BackupEntry> entries;
+  if (incremental) {
+    for (const std::string &earlier : listBackups(root)) {
+      for (const BackupEntry &entry : readBackupList(root, earlier)) {
+        if (entry.id != "-") {
+          stored.emplace(entry.id, entry.path);
+        }
+      }
+    }
+  }
+
+  // The chain as it is now. With linkFile() every segment gets a second
+  // name that rotation leaves alone, so the copies below run without
+  // holding rotation up; otherwise the chain itself is copied under the
+  // lock.
+  std::vector<BackupSource> sources;
+  std::string activeIndex;
+  std::unique_lock<std::shared_timed_mutex> rotation(rotationMutex_);
+  int segments = segmentCount();
+  for (int i = 0; i < segments; ++i) {
+    BackupSource source;
+    source.path = getLogFilePath(i);
+    if (i > 0 && compressors_ && fs_->fileExists(source.path + ".gz")) {
+      source.path += ".gz";
+    }
+    if (!fs_->fileExists(source.path)) {
+      continue;
+    }
+    source.position = i;
+    source.copy = source.path;
+    source.size = fs_->getFileSize(source.path);
+    if (indexing() && i > 0 &&
+        fs_->fileExists(SegmentIndex::pathFor(source.path))) {
+      source.index = SegmentIndex::pathFor(source.path);
+    }
+    sources.push_back(source);
+  }
+  if (indexing()) {
+    activeIndex = serializeIndex(sources.empty() || sources[0].position > 0
+                                     ? 0
+                                     : sources[0].size);
+  }
+  long lastSegment = lastSegment_;
+  if (linkBackupSources(sources)) {
+    rotation.unlock();
+  }
 
   long totalSize = 0;
-  for (int i = 0; i < fileNum_; ++i) {
-    std::string sourceFile = getLogFilePath(i);
-    if (fs_->fileExists(sourceFile)) {
-      long fileSize = fs_->getFileSize(sourceFile);
-      if (totalSize + fileSize <= backupMaxSize_) {
-        std::string destFile = backupDir + "/" + filePreName_ +
-                               (i == 0 ? ".log" : ".log" + std::to_string(i));
-        fs_->copyFile(sourceFile, destFile);
-        totalSize += fileSize;
-      } else {
+  // Sequence numbers of the newest and oldest segment the backup holds.
+  long lastHeld = 0;
+  long firstHeld = 0;
+  for (const BackupSource &source : sources) {
+    const std::string &sourceFile = source.path;
+    int i = source.position;
+    long fileSize = source.size;
+    std::string id = "-";
+    // Rotated segments never change again; the active file is always
+    // copied.
+    if (incremental && i > 0 && !fs_->contentId(source.copy, &id)) {
+      id = "-";
+    }
+    auto previous = stored.find(id);
+    if (previous != stored.end()) {
+      BackupReport::File file;
+      file.source = sourceFile;
+      file.destination = root + "/" + previous->second;
+      file.size = fileSize;
+      file.reused = true;
+      report.files.push_back(file);
+      report.totalSize += fileSize;
+      entries.push_back(BackupEntry{id, fileSize, previous->second});
+      firstHeld = lastSegment - i;
+      lastHeld = lastHeld != 0 ? lastHeld : firstHeld;
+      continue;
+    }
+    // Only what is actually copied counts against backupMaxSize.
+    if (totalSize + fileSize > backupMaxSize_) {
+      break;
+    }
+    BackupReport::File file;
+    file.source = sourceFile;
+    file.destination =
+        report.directory + sourceFile.substr(sourceFile.rfind('/'));
+    file.size = fileSize;
+    // Only the active file is still appended to; the copy stops at the
+    // size seen above so it never ends in a half-written line.
+    CopyResult result;
+    if (fs_->transferFile(source.copy, file.destination, i > 0,
+                          i == 0 ? fileSize : -1, &result)) {
+      file.strategy = result.strategy;
+      file.bytesMoved = result.bytesMoved;
+      report.bytesMoved += result.bytesMoved;
+      firstHeld = lastSegment - i;
+      lastHeld = lastHeld != 0 ? lastHeld : firstHeld;
+    } else {
+      ++report.failures;
+      metrics_.add(LoggerMetrics::kFileSystemErrors);
+      id = "-";
+    }
+    // Index sidecars go along but are not listed in the report.
+    if (i == 0 && indexing()) {
+      writeIndex(file.destination, activeIndex);
+    } else if (!source.index.empty()) {
+      fs_->transferFile(source.indexCopy,
+                        SegmentIndex::pathFor(file.destination), true, -1,
+                        nullptr);
+    }
+    report.files.push_back(file);
+    report.totalSize += fileSize;
+    totalSize += fileSize;
+    entries.push_back(BackupEntry{
+        id, fileSize, name + sourceFile.substr(sourceFile.rfind('/'))});
+  }
+  if (rotation.owns_lock()) {
+    rotation.unlock();
+  } else {
+    for (const BackupSource &source : sources) {
+      fs_->removeFile(source.copy);
+      if (!source.index.empty()) {
+        fs_->removeFile(source.indexCopy);
+      }
+    }
+  }
+
+  if (options_.rotation == RotationScheme::Sequence && lastHeld != 0) {
+    fs_->writeToFile(report.directory + manifestPath().substr(
+                                            manifestPath().rfind('/')),
+                     std::to_string(firstHeld) + " " +
+                         std::to_string(lastHeld),
+                     false);
+  }
+  if (incremental) {
+    writeBackupList(root, name, entries);
+    if (options_.backup.totalMaxBytes > 0) {
+      evictOldBackups(root, report);
+    }
+  }
+  metrics_.add(LoggerMetrics::kBackups);
+  return report;
+}
+
+bool Logger::linkBackupSources(std::vector<BackupSource> &sources) {
+  // Called under rotationMutex_, which also keeps the suffixes unique.
+  std::string suffix = ".snap" + std::to_string(++snapshots_);
+  for (size_t i = 0; i < sources.size(); ++i) {
+    BackupSource &source = sources[i];
+    source.copy = source.path + suffix;
+    bool linked = fs_->linkFile(source.path, source.copy);
+    if (linked && !source.index.empty()) {
+      source.indexCopy = source.index + suffix;
+      linked = fs_->linkFile(source.index, source.indexCopy);
+      if (!linked) {
+        fs_->removeFile(source.copy);
+      }
+    }
+    if (!linked) {
+      // Back to the chain itself for every segment.
+      for (size_t j = 0; j < sources.size(); ++j) {
+        if (j < i) {
+          fs_->removeFile(sources[j].copy);
+          if (!sources[j].index.empty()) {
+            fs_->removeFile(sources[j].indexCopy);
+          }
+        }
+        sources[j].copy = sources[j].path;
+        sources[j].indexCopy = sources[j].index;
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+void Logger::removeLeftovers() {
+  std::string directory = filePath_ + "/" + filePreName_;
+  std::vector<std::string> names;
+  if (!fs_->listDirectory(directory, &names)) {
+    return;
+  }
+  for (const std::string &name : names) {
+    // Compression leaves a link, a partial output and, once the output is
+    // in place, the uncompressed segment it replaced.
+    if (name.compare(0, filePreName_.size(), filePreName_) == 0 &&
+        (hasNumberedSuffix(name, ".snap") || hasNumberedSuffix(name, ".z") ||
+         endsWith(name, ".gz.tmp") || endsWith(name, ".old"))) {
+      fs_->removeFile(directory + "/" + name);
+    }
+  }
+}
+
+std::vector<std::string> Logger::listBackups(const std::string &root) {
+  std::vector<std::string> names;
+  std::vector<std::string> backups;
+  fs_->listDirectory(root, &names);
+  for (const std::string &name : names) {
+    if (name.compare(0, 4, "log_") == 0) {
+      backups.push_back(name);
+    }
+  }
+  // The timestamp in the name makes this oldest first.
+  std::sort(backups.begin(), backups.end());
+  return backups;
+}
+
+std::vector<Logger::BackupEntry>
+Logger::readBackupList(const std::string &root, const std::string &name) {
+  std::vector<BackupEntry> entries;
+  std::string content;
+  if (fs_->readFile(root + "/" + name + "/backup.list", &content)) {
+    std::istringstream in(content);
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      BackupEntry entry;
+      if (fields >> entry.id >> entry.size && fields.get() == ' ' &&
+          std::getline(fields, entry.path) && !entry.path.empty()) {
+        entries.push_back(entry);
+      }
+    }
+    return entries;
+  }
+  // Made without incremental backups: its own files, shared with nobody.
+  std::vector<std::string> files;
+  fs_->listDirectory(root + "/" + name, &files);
+  for (const std::string &file : files) {
+    long size = fs_->getFileSize(root + "/" + name + "/" + file);
+    entries.push_back(BackupEntry{"-", size > 0 ? size : 0, name + "/" + file});
+  }
+  return entries;
+}
+
+void Logger::writeBackupList(const std::string &root, const std::string &name,
+                             const std::vector<BackupEntry> &entries) {
+  std::string content;
+  for (const BackupEntry &entry : entries) {
+    if (!content.empty()) {
+      content += '\n';
+    }
+    content += entry.id + " " + std::to_string(entry.size) + " " + entry.path;
+  }
+  std::string path = root + "/" + name + "/backup.list";
+  if (!fs_->writeToFile(path + ".tmp", content, false) ||
+      !fs_->renameFile(path + ".tmp", path)) {
+    metrics_.add(LoggerMetrics::kFileSystemErrors);
+  }
+}
+
+void Logger::evictOldBackups(const std::string &root, BackupReport &report) {
+  std::vector<std::string> names = listBackups(root);
+  std::vector<std::vector<BackupEntry>> lists;
+  std::vector<bool> changed(names.size(), false);
+  long total = 0;
+  auto storedIn = [](const BackupEntry &entry, const std::string &name) {
+    return entry.path.compare(0, name.size() + 1, name + "/") == 0;
+  };
+  for (const std::string &name : names) {
+    lists.push_back(readBackupList(root, name));
+    for (const BackupEntry &entry : lists.back()) {
+      if (storedIn(entry, name)) {
+        total += entry.size;
+      }
+    }
+  }
+
+  // The newest backup (normally the one just made) always stays.
+  size_t oldest = 0;
+  bool ok = true;
+  while (ok && total > options_.backup.totalMaxBytes &&
+         oldest + 1 < names.size()) {
+    const std::string &name = names[oldest];
+    for (const BackupEntry &entry : lists[oldest]) {
+      if (!storedIn(entry, name)) {
+        continue;
+      }
+      size_t heir = oldest + 1;
+      auto listsEntry = [&](size_t backup) {
+        for (const BackupEntry &later : lists[backup]) {
+          if (later.path == entry.path) {
+            return true;
+          }
+        }
+        return false;
+      };
+      while (heir < names.size() && !listsEntry(heir)) {
+        ++heir;
+      }
+      std::string from = root + "/" + entry.path;
+      if (heir == names.size()) {
+        fs_->removeFile(from);
+        fs_->removeFile(SegmentIndex::pathFor(from));
+        total -= entry.size;
+        continue;
+      }
+      // Still needed: moved under the next backup that lists it, in a
+      // subdirectory named after the evicted backup so readers visit it
+      // before that backup's own segments.
+      std::string remainder = entry.path.substr(name.size() + 1);
+      std::string moved =
+          names[heir] + "/" +
+          (remainder.find('/') == std::string::npos ? name + "/" : "") +
+          remainder;
+      std::string to = root + "/" + moved;
+      createDirectories(to.substr(0, to.rfind('/')));
+      if (!fs_->renameFile(from, to)) {
+        metrics_.add(LoggerMetrics::kFileSystemErrors);
+        ok = false;
         break;
       }
+      fs_->renameFile(SegmentIndex::pathFor(from), SegmentIndex::pathFor(to));
+      for (size_t later = heir; later < names.size(); ++later) {
+        for (BackupEntry &reference : lists[later]) {
+          if (reference.path == entry.path) {
+            reference.path = moved;
+            changed[later] = true;
+          }
+        }
+      }
+    }
+    if (ok) {
+      removeTree(root + "/" + name);
+      ++report.evicted;
+      ++oldest;
+    }
+  }
+  for (size_t i = oldest; i < names.size(); ++i) {
+    if (changed[i]) {
+      writeBackupList(root, names[i], lists[i]);
+    }
+  }
+}
+
+void Logger::removeTree(const std::string &path) {
+  std::vector<std::string> children;
+  if (fs_->listDirectory(path, &children)) {
+    for (const std::string &child : children) {
+      removeTree(path + "/" + child);
     }
   }
+  fs_->removeFile(path);
+}
+
+void Logger::waitForCompression() {
+  if (compressors_) {
+    compressors_->wait();
+  }
+}
+
+MetricsSnapshot Logger::snapshot() const {
+  MetricsSnapshot snapshot = metrics_.snapshot();
+  if (ring_) {
+    snapshot.queueDepth = ring_->size();
+  }
+  snapshot.terminalDropped = terminal_ ? terminal_->dropped() : 0;
+  return snapshot;
+}
+
+std::future<BackupReport> Logger::backupAsync() {
+  {
+    std::lock_guard<std::mutex> lock(backupsMutex_);
+    ++backupsInFlight_;
+  }
+  return std::async(std::launch::async, [this] {
+    BackupReport report = backup();
+    {
+      std::lock_guard<std::mutex> lock(backupsMutex_);
+      --backupsInFlight_;
+    }
+    backupsCv_.notify_all();
+    return report;
+  });
 }
 
 void Logger::createDirectories(const std::string &path) {
@@ -68,49 +969,1042 @@ void Logger::createDirectories(const std::string &path) {
       fs_->createDirectory(dir);
     }
   }
-  fs_->createDirectory(path);
+  if (!fs_->createDirectory(path)) {
+    metrics_.add(LoggerMetrics::kFileSystemErrors);
+  }
 }
 
 void Logger::rotateLogFiles() {
+  flushPending();
+  syncIfDue(options_.flush.syncEveryFlushes > 0 ||
+            options_.flush.syncIntervalMs > 0);
+  if (indexing()) {
+    closeIndexBlock();
+    saveIndex(getLogFilePath(0), currentSize_);
+    std::lock_guard<std::mutex> lock(indexMutex_);
+    index_.clear();
+  }
+  file_.reset();
+  currentSize_ = 0;
+  definedFormats_.clear();
+
+  if (options_.rotation == RotationScheme::Sequence) {
+    ++lastSegment_;
+    if (lastSegment_ - firstSegment_ >= fileNum_) {
+      std::string oldest = segmentPath(firstSegment_++);
+      fs_->removeFile(oldest);
+      if (compressors_) {
+        fs_->removeFile(oldest + ".gz");
+      }
+      if (indexing()) {
+        fs_->removeFile(SegmentIndex::pathFor(oldest));
+      }
+    }
+    saveManifest();
+    cachePaths();
+    queueCompression(lastSegment_ - 1);
+    return;
+  }
+
   std::string oldestFile = getLogFilePath(fileNum_ - 1);
   fs_->removeFile(oldestFile);
+  if (compressors_) {
+    fs_->removeFile(oldestFile + ".gz");
+  }
+  if (indexing()) {
+    fs_->removeFile(SegmentIndex::pathFor(oldestFile));
+  }
 
   for (int i = fileNum_ - 2; i >= 1; --i) {
     std::string currentFile = getLogFilePath(i);
     std::string nextFile = getLogFilePath(i + 1);
-    if (fs_->fileExists(currentFile)) {
-      fs_->renameFile(currentFile, nextFile);
+    if (fs_->fileExists(currentFile) &&
+        !fs_->renameFile(currentFile, nextFile)) {
+      metrics_.add(LoggerMetrics::kFileSystemErrors);
+    }
+    if (compressors_ && fs_->fileExists(currentFile + ".gz")) {
+      fs_->renameFile(currentFile + ".gz", nextFile + ".gz");
+    }
+    if (indexing() && fs_->fileExists(SegmentIndex::pathFor(currentFile))) {
+      fs_->renameFile(SegmentIndex::pathFor(currentFile),
+                      SegmentIndex::pathFor(nextFile));
     }
   }
 
   std::string mainFile = getLogFilePath(0);
   std::string firstBackup = getLogFilePath(1);
-  if (fs_->fileExists(mainFile)) {
-    fs_->renameFile(mainFile, firstBackup);
+  if (fs_->fileExists(mainFile) && !fs_->renameFile(mainFile, firstBackup)) {
+    metrics_.add(LoggerMetrics::kFileSystemErrors);
+  }
+  if (indexing()) {
+    fs_->renameFile(SegmentIndex::pathFor(mainFile),
+                    SegmentIndex::pathFor(firstBackup));
+  }
+  queueCompression(++rotations_);
+}
+
+bool Logger::indexing() const {
+  return options_.index.intervalBytes > 0 && !options_.binary;
+}
+
+void Logger::indexLine(unsigned flags, const LogStamp &stamp) {
+  bool stamped = (flags & kStampFlag) != 0;
+  if (blockOpen_ &&
+      currentSize_ - openBlock_.offset <
+          static_cast<long>(options_.index.intervalBytes)) {
+    if (stamped) {
+      openBlock_.firstMicros = std::min(openBlock_.firstMicros, stamp.micros);
+      openBlock_.lastMicros = std::max(openBlock_.lastMicros, stamp.micros);
+    }
+    return;
   }
+  closeIndexBlock();
+  int64_t micros = stamped ? stamp.micros : LinePrefixFormatter::nowMicros();
+  openBlock_ = SegmentIndex::Block{currentSize_, micros, micros};
+  blockOpen_ = true;
 }
 
-void Logger::writeToFile(const std::string &message) {
-  std::string logFile = getLogFilePath(0);
+void Logger::closeIndexBlock() {
+  if (!blockOpen_) {
+    return;
+  }
+  if (options_.prefix == 0) {
+    // Without stamps all that is known is that the lines were written by now.
+    openBlock_.lastMicros =
+        std::max(openBlock_.lastMicros, LinePrefixFormatter::nowMicros());
+  }
+  std::lock_guard<std::mutex> lock(indexMutex_);
+  index_.add(openBlock_);
+  index_.setCoveredSize(currentSize_);
+  blockOpen_ = false;
+}
 
-  if (fs_->getFileSize(logFile) + message.length() + 1 > fileSize_) {
+void Logger::loadIndex() {
+  std::lock_guard<std::mutex> lock(indexMutex_);
+  index_.clear();
+  blockOpen_ = false;
+  std::string content;
+  if (!indexing() ||
+      !fs_->readFile(SegmentIndex::pathFor(getLogFilePath(0)), &content) ||
+      !index_.parse(content)) {
+    index_.clear();
+    return;
+  }
+  // Lines appended after the index was saved (a crash) have unknown times;
+  // leave them to the reader to scan rather than extend the last block.
+  index_.truncate(currentSize_);
+  if (index_.coveredSize() < currentSize_) {
+    index_.clear();
+  }
+}
+
+void Logger::saveIndex(const std::string &segment, long size) {
+  writeIndex(segment, serializeIndex(size));
+}
+
+std::string Logger::serializeIndex(long size) {
+  std::lock_guard<std::mutex> lock(indexMutex_);
+  SegmentIndex index = index_;
+  index.truncate(size);
+  return index.serialize();
+}
+
+void Logger::writeIndex(const std::string &segment, const std::string &content) {
+  std::string path = SegmentIndex::pathFor(segment);
+  if (!fs_->writeToFile(path + ".tmp", content, false) ||
+      !fs_->renameFile(path + ".tmp", path)) {
+    metrics_.add(LoggerMetrics::kFileSystemErrors);
+  }
+}
+
+std::string Logger::rotatedPath(long segment) const {
+  if (options_.rotation == RotationScheme::Sequence) {
+    return segment >= firstSegment_ && segment < lastSegment_
+               ? segmentPath(segment)
+               : std::string();
+  }
+  long index = rotations_ - segment + 1;
+  return index >= 1 && index < fileNum_
+             ? getLogFilePath(static_cast<int>(index))
+             : std::string();
+}
+
+void Logger::stopCompression() {
+  if (compressors_) {
+    // A shared pool outlives this logger, the jobs it queued for it must not.
+    compressors_->wait();
+  }
+  compressors_.reset();
+}
+
+void Logger::queueCompression(long segment) {
+  if (compressors_) {
+    compressors_->submit([this, segment] { compressSegment(segment); });
+  }
+}
+
+void Logger::compressSegment(long segment) {
+  // Sequence segments keep their name, so only the final renames have to
+  // be ordered against rotation. A Rename chain moves, so the segment is
+  // compressed through a second name that rotation leaves alone; without
+  // linkFile() the chain has to stay put throughout.
+  std::shared_lock<std::shared_timed_mutex> rotation(rotationMutex_);
+  std::string path = rotatedPath(segment);
+  if (path.empty()) {
+    return;
+  }
+  std::string source = path;
+  if (options_.rotation == RotationScheme::Rename) {
+    std::string link = getLogFilePath(0) + ".z" + std::to_string(segment);
+    if (fs_->linkFile(path, link)) {
+      source = link;
+    }
+  }
+  bool unlocked = source != path ||
+                  options_.rotation == RotationScheme::Sequence;
+  std::string temporary = source + ".gz.tmp";
+  if (unlocked) {
+    rotation.unlock();
+  }
+  bool compressed =
+      fs_->compressFile(source, temporary, options_.compression.level);
+  if (unlocked) {
+    rotation.lock();
+  }
+  if (source != path) {
+    fs_->removeFile(source);
+  }
+  if (!compressed) {
+    metrics_.add(LoggerMetrics::kFileSystemErrors);
+  }
+  // Where the segment is now; it may have moved down the chain, or off it.
+  path = rotatedPath(segment);
+  if (!compressed || path.empty()) {
+    fs_->removeFile(temporary);
+    return;
+  }
+  if (!fs_->renameFile(temporary, path + ".gz")) {
+    return;
+  }
+  // Unlinking a large file is slow; move it out of the chain and drop it
+  // after rotation may run again.
+  std::string obsolete = path + ".old";
+  bool moved = fs_->renameFile(path, obsolete);
+  rotation.unlock();
+  if (moved) {
+    fs_->removeFile(obsolete);
+  }
+}
+
+void Logger::rotateIfPossible() {
+  if (sharedWriter_ && !rotationOverdue_ && !sharedWriter_->claimRotation()) {
+    // Another logger rotates in this pass; drainRing() stops here and the
+    // next pass rotates first, so the segment only overshoots by this
+    // message.
+    rotationDeferred_ = true;
+    rotationOverdue_ = true;
+    return;
+  }
+  rotationOverdue_ = false;
+  std::unique_lock<std::shared_timed_mutex> rotation(rotationMutex_,
+                                                     std::try_to_lock);
+  if (rotation.owns_lock()) {
+    auto started = std::chrono::steady_clock::now();
     rotateLogFiles();
+    metrics_.recordRotate(std::chrono::steady_clock::now() - started);
+    metrics_.add(LoggerMetrics::kRotations);
   }
+}
+
+void Logger::writeToFile(const char *data, size_t length, unsigned flags,
+                         const LogStamp &stamp) {
+  if (options_.suppression.coalesceRepeats &&
+      repeatOf(data, length, flags, stamp)) {
+    return;
+  }
+  writeRecord(data, length, flags, stamp);
+}
 
-  fs_->writeToFile(logFile, message, true);
+void Logger::writeRecord(const char *data, size_t length, unsigned flags,
+                         const LogStamp &stamp) {
+  if (options_.binary) {
+    writeBinaryEntry(data, length, flags, stamp);
+    return;
+  }
+  if (flags & kStructuredFlag) {
+    // One JSON object per line; the prefix fields become its first members.
+    rendered_.clear();
+    structured_log::renderJson(data, length,
+                               (flags & kStampFlag) ? &stamp : nullptr,
+                               levelOf(flags), options_.prefix, rendered_);
+    data = rendered_.data();
+    length = rendered_.size();
+  } else if (flags & kBinaryFlag) {
+    rendered_.clear();
+    binary_log::renderRecord(data, length, rendered_);
+    data = rendered_.data();
+    length = rendered_.size();
+  }
+
+  char prefix[LinePrefixFormatter::kMaxSize];
+  size_t prefixLength = 0;
+  if ((flags & kStampFlag) && !(flags & kStructuredFlag)) {
+    prefixLength = prefixFormatter_.format(stamp, levelOf(flags),
+                                           options_.prefix, prefix);
+  }
+
+  if (currentSize_ + static_cast<long>(prefixLength + length + 1) >
+      fileSize_) {
+    rotateIfPossible();
+  }
+  if (indexing()) {
+    indexLine(flags, stamp);
+  }
+
+  appendToBatch(prefix, prefixLength);
+  appendToBatch(data, length);
+  appendToBatch("\n", 1);
+  batch_.publish();
+}
+
+void Logger::writeBinaryEntry(const char *data, size_t length, unsigned flags,
+                              const LogStamp &stamp) {
+  char kind = (flags & kStructuredFlag) ? binary_log::kKeyValue
+              : (flags & kBinaryFlag)   ? binary_log::kRecord
+                                        : binary_log::kText;
+  uint32_t formatId = 0;
+  if (kind == binary_log::kRecord && length >= sizeof(formatId)) {
+    std::memcpy(&formatId, data, sizeof(formatId));
+  }
+
+  auto needed = [&] {
+    size_t bytes = 1 + sizeof(uint32_t) + length;
+    if (flags & kStampFlag) {
+      bytes += binary_log::kStampEntrySize;
+    }
+    if (currentSize_ == 0) {
+      bytes += binary_log::kMagicSize;
+    }
+    if (kind == binary_log::kRecord &&
+        (formatId >= definedFormats_.size() || !definedFormats_[formatId])) {
+      bytes += binary_log::definitionEntrySize(formatId);
+    }
+    return bytes;
+  };
+  if (currentSize_ + static_cast<long>(needed()) > fileSize_) {
+    rotateIfPossible();
+  }
+
+  if (currentSize_ == 0) {
+    appendToBatch(binary_log::kMagic, binary_log::kMagicSize);
+  }
+  if (kind == binary_log::kRecord &&
+      (formatId >= definedFormats_.size() || !definedFormats_[formatId])) {
+    if (formatId >= definedFormats_.size()) {
+      definedFormats_.resize(formatId + 1, false);
+    }
+    definedFormats_[formatId] = true;
+    rendered_.clear();
+    binary_log::appendDefinition(rendered_, formatId);
+    appendToBatch(rendered_.data(), rendered_.size());
+  }
+  rendered_.clear();
+  if (flags & kStampFlag) {
+    binary_log::appendStamp(rendered_, stamp, levelOf(flags), options_.prefix);
+  }
+  binary_log::appendEntry(rendered_, kind, data, length);
+  appendToBatch(rendered_.data(), rendered_.size());
+  batch_.publish();
+}
+
+void Logger::appendToBatch(const char *data, size_t length) {
+  if (!batch_.fits(length)) {
+    // The mapping is full; what it can never hold goes straight out.
+    flushPending();
+    if (!batch_.fits(length)) {
+      writeOut(data, length);
+      currentSize_ += static_cast<long>(length);
+      return;
+    }
+  }
+  if (batch_.empty()) {
+    if (options_.flush.maxDelayMs > 0) {
+      batchStarted_ = std::chrono::steady_clock::now();
+    }
+    batch_.begin(getLogFilePath(0), currentSize_);
+  }
+  batch_.append(data, length);
+  currentSize_ += static_cast<long>(length);
+}
+
+bool Logger::flushDue() const {
+  if (batch_.empty()) {
+    return false;
+  }
+  const FlushPolicy &policy = options_.flush;
+  if (policy.maxBufferedBytes == 0 && policy.maxDelayMs == 0) {
+    return true;
+  }
+  if (policy.maxBufferedBytes > 0 && batch_.size() >= policy.maxBufferedBytes) {
+    return true;
+  }
+  return policy.maxDelayMs > 0 &&
+         std::chrono::steady_clock::now() - batchStarted_ >=
+             std::chrono::milliseconds(policy.maxDelayMs);
+}
+
+void Logger::flushPending() {
+  if (batch_.empty()) {
+    return;
+  }
+  writeOut(batch_.data(), batch_.size());
+  batch_.clear();
+}
+
+void Logger::writeOut(const char *data, size_t length) {
+  if (!file_) {
+    file_ = fs_->openForAppend(getLogFilePath(0));
+  }
+  if (file_) {
+    auto started = std::chrono::steady_clock::now();
+    bool written = file_->write(data, length);
+    metrics_.recordWrite(std::chrono::steady_clock::now() - started);
+    metrics_.add(LoggerMetrics::kWrites);
+    if (written) {
+      metrics_.add(LoggerMetrics::kBytesWritten, length);
+    } else {
+      metrics_.add(LoggerMetrics::kFileSystemErrors);
+    }
+    ++unsyncedFlushes_;
+    syncIfDue(false);
+  } else {
+    metrics_.add(LoggerMetrics::kFileSystemErrors);
+  }
+}
+
+std::string Logger::pendingPath() const {
+  return filePath_ + "/" + filePreName_ + "/" + filePreName_ + ".pending";
+}
+
+void Logger::recoverPending() {
+  std::string target;
+  long offset = 0;
+  std::string data;
+  if (!PendingBuffer::recover(pendingPath(), &target, &offset, &data)) {
+    return;
+  }
+  // The batch starts at offset in target; the crash may have come before,
+  // during or after it was written there.
+  long size = std::max(fs_->getFileSize(target), 0L);
+  long end = offset + static_cast<long>(data.size());
+  bool ok = true;
+  if (size < end) {
+    size_t written = size > offset ? static_cast<size_t>(size - offset) : 0;
+    std::unique_ptr<FileHandle> file = fs_->openForAppend(target);
+    ok = file && file->write(data.data() + written, data.size() - written);
+  }
+  // Remove it so a later rotation cannot make the same batch look unwritten.
+  if (!ok || !fs_->removeFile(pendingPath())) {
+    metrics_.add(LoggerMetrics::kFileSystemErrors);
+  }
+}
+
+void Logger::syncIfDue(bool force) {
+  if (!file_ || unsyncedFlushes_ == 0) {
+    return;
+  }
+  const FlushPolicy &policy = options_.flush;
+  auto now = std::chrono::steady_clock::now();
+  bool due = force ||
+             (policy.syncEveryFlushes > 0 &&
+              unsyncedFlushes_ >= policy.syncEveryFlushes) ||
+             (policy.syncIntervalMs > 0 &&
+              now - lastSync_ >= std::chrono::milliseconds(policy.syncIntervalMs));
+  if (due) {
+    if (!file_->sync()) {
+      metrics_.add(LoggerMetrics::kFileSystemErrors);
+    }
+    unsyncedFlushes_ = 0;
+    lastSync_ = now;
+  }
 }
 
 std::string Logger::getCurrentTimestamp() {
   auto now = std::chrono::system_clock::now();
   auto time_t = std::chrono::system_clock::to_time_t(now);
+  // backupAsync() runs backups concurrently; localtime() shares its result.
+  std::tm local;
+  localtime_r(&time_t, &local);
 
   std::stringstream ss;
-  ss << std::put_time(std::localtime(&time_t), "%Y%m%d%H%M%S");
+  ss << std::put_time(&local, "%Y%m%d%H%M%S");
   return ss.str();
 }
 
-std::string Logger::getLogFilePath(int index) const {
-  std::string logDir = filePath_ + "/" + filePreName_;
-  return logDir + "/" + filePreName_ +
-         (index == 0 ? ".log" : ".log" + std::to_string(index));
+const std::string &Logger::getLogFilePath(int index) const {
+  static const std::string kNone;
+  return index >= 0 && static_cast<size_t>(index) < paths_.size()
+             ? paths_[index]
+             : kNone;
+}
+
+void Logger::cachePaths() {
+  paths_.resize(fileNum_ + 1);
+  for (int i = 0; i <= fileNum_; ++i) {
+    if (options_.rotation == RotationScheme::Sequence) {
+      paths_[i] = segmentPath(lastSegment_ - i);
+    } else {
+      paths_[i] = filePath_ + "/" + filePreName_ + "/" + filePreName_ +
+                  (i == 0 ? ".log" : ".log" + std::to_string(i));
+    }
+  }
+}
+
+int Logger::segmentCount() const {
+  if (options_.rotation == RotationScheme::Sequence) {
+    return static_cast<int>(lastSegment_ - firstSegment_ + 1);
+  }
+  return fileNum_;
+}
+
+std::string Logger::segmentPath(long sequence) const {
+  // Zero padded so that a plain name sort is also the chronological order.
+  char number[24];
+  std::snprintf(number, sizeof(number), "%010ld", sequence);
+  return filePath_ + "/" + filePreName_ + "/" + filePreName_ + "." + number +
+         ".log";
+}
+
+std::string Logger::manifestPath() const {
+  return filePath_ + "/" + filePreName_ + "/" + filePreName_ + ".manifest";
+}
+
+void Logger::loadManifest() {
+  firstSegment_ = 1;
+  lastSegment_ = 1;
+  std::string content;
+  bool loaded = false;
+  if (fs_->readFile(manifestPath(), &content)) {
+    std::istringstream in(content);
+    long first = 0;
+    long last = 0;
+    if (in >> first >> last && first >= 1 && last >= first) {
+      firstSegment_ = first;
+      lastSegment_ = last;
+      loaded = true;
+    }
+  }
+  // fileNum may have shrunk since the manifest was written.
+  bool trimmed = false;
+  while (lastSegment_ - firstSegment_ >= fileNum_) {
+    std::string oldest = segmentPath(firstSegment_++);
+    fs_->removeFile(oldest);
+    fs_->removeFile(oldest + ".gz");
+    trimmed = true;
+  }
+  if (!loaded || trimmed) {
+    saveManifest();
+  }
+}
+
+void Logger::saveManifest() {
+  // Written aside and renamed so a crash never leaves a torn manifest.
+  std::string temporary = manifestPath() + ".tmp";
+  if (fs_->writeToFile(temporary, std::to_string(firstSegment_) + " " +
+                                      std::to_string(lastSegment_),
+                       false) &&
+      fs_->renameFile(temporary, manifestPath())) {
+    return;
+  }
+  metrics_.add(LoggerMetrics::kFileSystemErrors);
+}
+
+Logger::StagingBuffer &Logger::localStaging() {
+  struct Entry {
+    uint64_t loggerId;
+    std::shared_ptr<StagingBuffer> buffer;
+  };
+  thread_local std::vector<Entry> entries;
+  thread_local uint64_t lastId = 0;
+  thread_local StagingBuffer *last = nullptr;
+
+  if (lastId == id_) {
+    return *last;
+  }
+  for (const Entry &entry : entries) {
+    if (entry.loggerId == id_) {
+      lastId = id_;
+      last = entry.buffer.get();
+      return *last;
+    }
+  }
+
+  // Buffers only this thread still references belong to destroyed loggers.
+  entries.erase(std::remove_if(entries.begin(), entries.end(),
+                               [](const Entry &entry) {
+                                 return entry.buffer.use_count() == 1;
+                               }),
+                entries.end());
+  auto buffer = std::make_shared<StagingBuffer>();
+  {
+    std::lock_guard<std::mutex> lock(stagingMutex_);
+    stagings_.push_back(buffer);
+  }
+  entries.push_back(Entry{id_, buffer});
+  lastId = id_;
+  last = buffer.get();
+  return *last;
+}
+
+bool Logger::stage(const char *data, size_t length, unsigned flags,
+                   const LogStamp &stamp) {
+  StagingBuffer &staging = localStaging();
+  size_t staged;
+  {
+    std::lock_guard<std::mutex> lock(staging.mutex);
+    staged = staging.records.size();
+  }
+  if (options_.overload.policy == OverloadPolicy::Sample &&
+      staged >= kMaxStagedBytes / 2 && !keepSample(levelOf(flags))) {
+    dropMessage();
+    return false;
+  }
+  if (staged >= kMaxStagedBytes && !relieveStaging(staging)) {
+    dropMessage();
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(staging.mutex);
+    uint32_t length32 = static_cast<uint32_t>(length);
+    unsigned char flags8 = static_cast<unsigned char>(flags);
+    staging.records.append(reinterpret_cast<const char *>(&length32),
+                           sizeof(length32));
+    staging.records += static_cast<char>(flags8);
+    if (flags & kStampFlag) {
+      staging.records.append(reinterpret_cast<const char *>(&stamp),
+                             sizeof(stamp));
+    }
+    staging.records.append(data, length);
+  }
+  stagedCount_.fetch_add(1);
+  drainStaging();
+  return true;
+}
+
+bool Logger::relieveStaging(StagingBuffer &staging) {
+  // The appender is falling behind this thread.
+  const OverloadOptions &overload = options_.overload;
+  if (overload.policy == OverloadPolicy::DropOldest) {
+    std::lock_guard<std::mutex> lock(staging.mutex);
+    if (staging.records.size() > sizeof(uint32_t)) {
+      uint32_t length;
+      std::memcpy(&length, staging.records.data(), sizeof(length));
+      size_t header = sizeof(length) + 1;
+      if (static_cast<unsigned char>(staging.records[sizeof(length)]) &
+          kStampFlag) {
+        header += sizeof(LogStamp);
+      }
+      staging.records.erase(0, header + length);
+      dropMessage();
+    }
+    return true;
+  }
+
+  bool locked;
+  if (overload.policy != OverloadPolicy::Block) {
+    locked = appenderMutex_.try_lock();
+  } else if (overload.blockTimeoutMs > 0) {
+    locked = appenderMutex_.try_lock_for(
+        std::chrono::milliseconds(overload.blockTimeoutMs));
+  } else {
+    appenderMutex_.lock();
+    locked = true;
+  }
+  if (!locked) {
+    return false;
+  }
+  drainStagingLocked();
+  flushPending();
+  appenderMutex_.unlock();
+  return true;
+}
+
+void Logger::drainStaging() {
+  while (appenderMutex_.try_lock()) {
+    size_t seen = stagedCount_.load();
+    drainStagingLocked();
+    if (flushDue()) {
+      flushPending();
+    }
+    appenderMutex_.unlock();
+    // Records staged while we held the lock may belong to threads that
+    // gave up on try_lock(); pick them up before leaving.
+    if (stagedCount_.load() == seen) {
+      break;
+    }
+  }
+}
+
+void Logger::drainStagingLocked() {
+  std::lock_guard<std::mutex> registry(stagingMutex_);
+  for (auto it = stagings_.begin(); it != stagings_.end();) {
+    // Once the registry holds the only reference, the thread that owned the
+    // buffer has exited and nothing more can be staged into it; checked
+    // before draining so its last records are not left behind.
+    bool orphaned = it->use_count() == 1;
+    {
+      std::lock_guard<std::mutex> lock((*it)->mutex);
+      if (!(*it)->records.empty()) {
+        drained_.swap((*it)->records);
+      }
+    }
+    size_t pos = 0;
+    while (pos + sizeof(uint32_t) + 1 <= drained_.size()) {
+      uint32_t length;
+      std::memcpy(&length, drained_.data() + pos, sizeof(length));
+      pos += sizeof(length);
+      unsigned flags = static_cast<unsigned char>(drained_[pos++]);
+      LogStamp stamp;
+      if (flags & kStampFlag) {
+        std::memcpy(&stamp, drained_.data() + pos, sizeof(stamp));
+        pos += sizeof(stamp);
+      }
+      writeToFile(drained_.data() + pos, length, flags, stamp);
+      pos += length;
+    }
+    drained_.clear();
+    if (orphaned) {
+      it = stagings_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  reportDrops();
+}
+
+void Logger::startWriter() {
+  ring_.reset(new LogRing(options_.queueCapacity));
+  stopWriter_ = false;
+  written_ = 0;
+  flushed_ = 0;
+  flushTarget_ = 0;
+  if (options_.writer) {
+    sharedWriter_ = options_.writer;
+    sharedWriter_->attach(this);
+    return;
+  }
+  writer_ = std::thread(&Logger::writerLoop, this);
+}
+
+void Logger::stopWriter() {
+  if (sharedWriter_) {
+    sharedWriter_->detach(this);
+    sharedWriter_.reset();
+    while (writerStep(true) > 0) {
+    }
+    ring_.reset();
+    return;
+  }
+  if (!writer_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(writerMutex_);
+    stopWriter_ = true;
+  }
+  writerCv_.notify_one();
+  writer_.join();
+  ring_.reset();
+}
+
+void Logger::writerLoop() {
+  std::unique_lock<std::mutex> lock(writerMutex_);
+  for (;;) {
+    bool stopping = stopWriter_;
+    lock.unlock();
+    size_t drained = writerStep(stopping);
+    lock.lock();
+    if (drained > 0) {
+      continue;
+    }
+    if (stopping) {
+      break;
+    }
+
+    writerSleeping_.store(true);
+    writerCv_.wait_for(lock, writerTimeout(), [this] {
+      return stopWriter_ || flushTarget_ > flushed_ || !ring_->empty();
+    });
+    writerSleeping_.store(false);
+  }
+}
+
+size_t Logger::writerStep(bool stopping) {
+  std::unique_lock<std::mutex> lock(writerMutex_);
+  size_t target = flushTarget_;
+  lock.unlock();
+
+  std::unique_lock<std::timed_mutex> appender(appenderMutex_);
+  size_t drained = drainRing();
+  if (ring_->empty()) {
+    reportDrops();
+  }
+  // Producers discarding under DropOldest pop messages as well.
+  size_t done = ring_->popped();
+  bool requested = (target > flushed_ && done >= target) ||
+                   (stopping && drained == 0);
+  // A flood that stopped still gets its count out after windowMs.
+  if (requested ||
+      (repeats_ > 0 &&
+       std::chrono::steady_clock::now() - repeatsSince_ >=
+           std::chrono::milliseconds(options_.suppression.windowMs))) {
+    writeRepeats();
+  }
+  bool flushNow = requested || flushDue();
+  if (flushNow) {
+    flushPending();
+  }
+  appender.unlock();
+
+  lock.lock();
+  written_ = done;
+  if (flushNow) {
+    flushed_ = done;
+    flushedCv_.notify_all();
+  }
+  return drained;
+}
+
+std::chrono::milliseconds Logger::writerTimeout() const {
+  auto timeout = std::chrono::milliseconds(50);
+  if (!batch_.empty() && options_.flush.maxDelayMs > 0) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        batchStarted_ + std::chrono::milliseconds(options_.flush.maxDelayMs) -
+        std::chrono::steady_clock::now());
+    timeout = std::max(std::chrono::milliseconds(1), std::min(timeout, left));
+  }
+  return timeout;
+}
+
+size_t Logger::drainRing() {
+  size_t drained = 0;
+  auto write = [&](const std::string &message, unsigned flags,
+                   const LogStamp &stamp) {
+    if (flags & kTerminalFlag) {
+      printToTerminal(message.data(), message.size(), flags, stamp,
+                      prefixFormatter_);
+    }
+    writeToFile(message.data(), message.size(), flags, stamp);
+  };
+  metrics_.observeQueueDepth(ring_->size());
+  rotationDeferred_ = false;
+  while (drained < options_.maxBatchMessages && !rotationDeferred_ &&
+         ring_->tryPop(write)) {
+    ++drained;
+  }
+  return drained;
+}
+
+void Logger::wakeWriter() {
+  if (sharedWriter_) {
+    sharedWriter_->wake();
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (writerSleeping_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(writerMutex_);
+    writerCv_.notify_one();
+  }
+}
+
+ShmRing *Logger::attachShared() {
+  std::lock_guard<std::mutex> lock(sharedMutex_);
+  if (!shm_) {
+    // Until the collector is up, try again at most every 100 ms.
+    auto now = std::chrono::steady_clock::now();
+    if (now < nextAttach_) {
+      return nullptr;
+    }
+    nextAttach_ = now + std::chrono::milliseconds(100);
+    shm_ = ShmRing::attach(options_.shared.name);
+    if (!shm_) {
+      return nullptr;
+    }
+    sharedRing_.store(shm_.get(), std::memory_order_release);
+  }
+  return shm_.get();
+}
+
+bool Logger::pushShared(const char *data, size_t length, unsigned flags,
+                        const LogStamp &stamp) {
+  ShmRing *ring = sharedRing_.load(std::memory_order_acquire);
+  if (!ring && !(ring = attachShared())) {
+    dropMessage();
+    return false;
+  }
+  if (!ring->tryPush(data, length, flags, stamp)) {
+    metrics_.add(LoggerMetrics::kQueueFullWaits);
+    // The collector is the only consumer, so DropOldest and Sample cannot
+    // make room here and drop the new message instead.
+    if (options_.overload.policy != OverloadPolicy::Block) {
+      dropMessage();
+      return false;
+    }
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(options_.overload.blockTimeoutMs);
+    do {
+      std::this_thread::yield();
+      if (options_.overload.blockTimeoutMs > 0 &&
+          std::chrono::steady_clock::now() >= deadline) {
+        dropMessage();
+        return false;
+      }
+    } while (!ring->tryPush(data, length, flags, stamp));
+  }
+  if (droppedPending_.load(std::memory_order_relaxed) > 0) {
+    std::string line = std::to_string(droppedPending_.exchange(0)) +
+                       " messages dropped";
+    ring->tryPush(line.data(), line.size(),
+                  kStampFlag | static_cast<unsigned>(LogLevel::Warn)
+                                   << kLevelShift,
+                  LinePrefixFormatter::stamp());
+  }
+  return true;
+}
+
+void Logger::startCollector() {
+  std::lock_guard<std::mutex> lock(sharedMutex_);
+  shm_ = ShmRing::create(options_.shared.name, options_.shared.slots);
+  if (!shm_) {
+    metrics_.add(LoggerMetrics::kFileSystemErrors);
+    return;
+  }
+  sharedRing_.store(shm_.get(), std::memory_order_release);
+  stopCollector_ = false;
+  collectorWake_ = false;
+  collector_ = std::thread(&Logger::collectorLoop, this);
+}
+
+void Logger::stopCollector() {
+  if (!collector_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(sharedMutex_);
+    stopCollector_ = true;
+  }
+  collectorCv_.notify_one();
+  collector_.join();
+}
+
+void Logger::collectorLoop() {
+  // Producers never make a system call to wake the collector, so it polls,
+  // backing off while the ring stays empty.
+  auto idle = std::chrono::milliseconds(1);
+  std::unique_lock<std::mutex> lock(sharedMutex_);
+  for (;;) {
+    bool stopping = stopCollector_;
+    lock.unlock();
+    size_t drained = drainShared();
+    lock.lock();
+    if (drained > 0) {
+      idle = std::chrono::milliseconds(1);
+      continue;
+    }
+    if (stopping) {
+      break;
+    }
+    collectorCv_.wait_for(lock, idle,
+                          [this] { return stopCollector_ || collectorWake_; });
+    collectorWake_ = false;
+    idle = std::min(idle * 2, std::chrono::milliseconds(16));
+  }
+}
+
+size_t Logger::drainShared() {
+  size_t drained = 0;
+  auto collect = [this](const char *data, size_t length, unsigned flags,
+                        const LogStamp &stamp) {
+    metrics_.add(LoggerMetrics::kMessages);
+    flags &= ~kTerminalFlag;
+    flags = options_.prefix != 0 ? flags | kStampFlag : flags & ~kStampFlag;
+    enqueue(data, length, flags, stamp, false);
+  };
+  while (drained < options_.maxBatchMessages && shm_->tryPop(collect)) {
+    ++drained;
+  }
+  return drained;
+}
+
+void Logger::startDumper() {
+  stopDumper_ = false;
+  dumper_ = std::thread(&Logger::dumperLoop, this);
+}
+
+bool Logger::stopDumper() {
+  if (!dumper_.joinable()) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(dumperMutex_);
+    stopDumper_ = true;
+  }
+  dumperCv_.notify_one();
+  dumper_.join();
+  return true;
+}
+
+void Logger::dumperLoop() {
+  std::unique_lock<std::mutex> lock(dumperMutex_);
+  auto interval = std::chrono::milliseconds(options_.metrics.dumpIntervalMs);
+  while (!dumperCv_.wait_for(lock, interval, [this] { return stopDumper_; })) {
+    lock.unlock();
+    dumpMetrics();
+    lock.lock();
+  }
+}
+
+void Logger::startFlusher() {
+  stopFlusher_ = false;
+  flusher_ = std::thread(&Logger::flusherLoop, this);
+}
+
+void Logger::stopFlusher() {
+  if (!flusher_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(flusherMutex_);
+    stopFlusher_ = true;
+  }
+  flusherCv_.notify_one();
+  flusher_.join();
+}
+
+void Logger::flusherLoop() {
+  auto delay = std::chrono::milliseconds(options_.flush.maxDelayMs);
+  auto wake = std::chrono::steady_clock::now() + delay;
+  std::unique_lock<std::mutex> lock(flusherMutex_);
+  while (!flusherCv_.wait_until(lock, wake, [this] { return stopFlusher_; })) {
+    lock.unlock();
+    {
+      std::lock_guard<std::timed_mutex> appender(appenderMutex_);
+      drainStagingLocked();
+      if (flushDue()) {
+        flushPending();
+      }
+      // Sleep until the batch now pending, if any, comes of age.
+      wake = (batch_.empty() ? std::chrono::steady_clock::now()
+                             : batchStarted_) +
+             delay;
+    }
+    lock.lock();
+  }
+}
+
+void Logger::dumpMetrics() {
+  if (!fs_->writeToFile(options_.metrics.dumpPath, snapshot().toJson(), true)) {
+    metrics_.add(LoggerMetrics::kFileSystemErrors);
+  }
 }
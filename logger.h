@@ -1,20 +1,139 @@
 #pragma once
-#include <string>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstring>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#include <thread>
+#include <vector>
+#include "binary_log.h"
 #include "file_system_interface.h"
+#include "line_prefix.h"
+#include "log_index.h"
+#include "log_level.h"
+#include "log_ring.h"
+#include "logger_metrics.h"
+#include "logger_options.h"
+#include "pending_buffer.h"
+#include "rate_limiter.h"
+#include "structured_log.h"
+#include "terminal_sink.h"
+#include "worker_pool.h"
+
+class ShmRing;
+
+struct BackupReport {
+    struct File {
+        std::string source;
+        std::string destination;
+        CopyStrategy strategy = CopyStrategy::None;
+        long size = 0;
+        long bytesMoved = 0;
+        // Incremental backups: an earlier backup already holds the segment,
+        // and destination is where.
+        bool reused = false;
+    };
+
+    std::string directory;
+    std::vector<File> files;
+    long totalSize = 0;
+    long bytesMoved = 0;
+    int failures = 0;
+    // Old backups removed to stay within BackupOptions::totalMaxBytes.
+    int evicted = 0;
+
+    int count(CopyStrategy strategy) const;
+};
 
 class Logger {
 public:
     explicit Logger(std::shared_ptr<FileSystemInterface> fs = nullptr);
-    void init(const std::string& filePreName, const std::string& filePath, 
-              int fileSize, int fileNum, const std::string& backupPath, int backupMaxSize);
+    ~Logger();
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    void init(const std::string& filePreName, const std::string& filePath,
+              int fileSize, int fileNum, const std::string& backupPath, int backupMaxSize,
+              const LoggerOptions& options = LoggerOptions());
     void enableTerminal();
     void disableTerminal();
+    void setLevel(LogLevel level);
+    LogLevel level() const { return static_cast<LogLevel>(level_.load(std::memory_order_relaxed)); }
+    bool shouldLog(LogLevel level) const {
+        return static_cast<int>(level) >= level_.load(std::memory_order_relaxed);
+    }
     void logMsg(const std::string& message);
+    void logMsg(LogLevel level, const std::string& message);
+    // The overloads below take the caller's bytes as they are; none of them
+    // allocates once the thread's buffers have grown to its message sizes.
+    void logMsg(const char* message) { logMsg(LogLevel::Info, message, std::strlen(message)); }
+    void logMsg(LogLevel level, const char* message) {
+        logMsg(level, message, std::strlen(message));
+    }
+    void logMsg(const char* data, size_t length) { logMsg(LogLevel::Info, data, length); }
+    void logMsg(LogLevel level, const char* data, size_t length);
+#if __cplusplus >= 201703L
+    void logMsg(std::string_view message) {
+        logMsg(LogLevel::Info, message.data(), message.size());
+    }
+    void logMsg(LogLevel level, std::string_view message) {
+        logMsg(level, message.data(), message.size());
+    }
+#endif
+    // printf-style; formats into a per-thread buffer, and only when the
+    // level is enabled.
+    void logFormat(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    void logFormat(LogLevel level, const char* format, ...)
+        __attribute__((format(printf, 3, 4)));
     void logFact(const std::string& message);
-    void backup();
+    // Use through LITTLE_LOG_BINARY so the format is registered once per call site.
+    template <typename... Args>
+    void logBinary(uint32_t formatId, const Args&... args) {
+        logBinary(LogLevel::Info, formatId, args...);
+    }
+    template <typename... Args>
+    void logBinary(LogLevel level, uint32_t formatId, const Args&... args) {
+        if (!shouldLog(level) || (limiter_ && limited(formatId))) {
+            return;
+        }
+        thread_local std::string record;
+        binary_log::encodeRecord(record, formatId, args...);
+        logRecord(level, record);
+    }
+    // One JSON object per line: log(LogLevel::Info, "login", kv("user", id),
+    // kv("ms", elapsed)) writes {"event":"login","user":"ann","ms":12}, with
+    // the prefix fields in front as "ts", "level" and "tid". The values are
+    // only copied here; the JSON is rendered by whoever writes the file.
+    template <typename... Fields>
+    void log(LogLevel level, const char* event, const Fields&... fields) {
+        if (!shouldLog(level) || (limiter_ && limited(reinterpret_cast<uintptr_t>(event)))) {
+            return;
+        }
+        thread_local std::string record;
+        structured_log::encodeRecord(record, event, fields...);
+        logStructured(level, record);
+    }
+    // Writes out everything logged so far, terminal output included.
+    void flush();
+    BackupReport backup();
+    // Runs backup() on its own thread; the logger waits for it on destruction.
+    std::future<BackupReport> backupAsync();
+    // Blocks until every rotated segment queued so far has been compressed.
+    void waitForCompression();
+    // Counters and latency histograms since construction.
+    MetricsSnapshot snapshot() const;
 
 private:
+    friend class SharedWriter;
+
     std::shared_ptr<FileSystemInterface> fs_;
     std::string filePreName_;
     std::string filePath_;
@@ -22,11 +141,283 @@ private:
     int fileNum_;
     std::string backupPath_;
     int backupMaxSize_;
-    bool terminalEnabled_ = true;
-    
+    std::atomic<bool> terminalEnabled_{true};
+    std::atomic<int> level_{static_cast<int>(LogLevel::Trace)};
+    LoggerOptions options_;
+    // SuppressionOptions::perSecond > 0.
+    std::unique_ptr<RateLimiter> limiter_;
+
+    // Synchronous mode: every thread appends complete records to its own
+    // staging buffer, and whichever thread wins appenderMutex_ moves all of
+    // them into the file. Appender state below is only touched under it.
+    // The buffer of a thread that has exited is dropped by the next drain.
+    struct StagingBuffer;
+    const uint64_t id_;
+    std::mutex stagingMutex_;
+    std::vector<std::shared_ptr<StagingBuffer>> stagings_;
+    std::atomic<size_t> stagedCount_{0};
+    std::string drained_;
+    std::timed_mutex appenderMutex_;
+    // Dropped since the last "N messages dropped" line.
+    std::atomic<uint64_t> droppedPending_{0};
+
+    // Held by backup() while it takes its snapshot of the segment chain, and
+    // shared by compression jobs while they link and then replace a rotated
+    // segment; without linkFile() both keep it for all of their copying. The
+    // appender only try-locks it, so both postpone rotation instead of
+    // stalling writers; the active file briefly grows past fileSize.
+    std::shared_timed_mutex rotationMutex_;
+    // Suffix of backup()'s snapshot links, taken under rotationMutex_.
+    long snapshots_ = 0;
+    // Also held while backup() picks and creates its directory.
+    std::mutex backupsMutex_;
+    std::condition_variable backupsCv_;
+    int backupsInFlight_ = 0;
+
+    std::unique_ptr<FileHandle> file_;
+    long currentSize_ = 0;
+    // getLogFilePath() results, built by init() and, for Sequence, again on
+    // each rotation, so reopening the active file builds no strings.
+    std::vector<std::string> paths_;
+    // RotationScheme::Sequence: live segments are firstSegment_..lastSegment_.
+    long firstSegment_ = 1;
+    long lastSegment_ = 1;
+    // RotationScheme::Rename: rotations since init(). The segment closed by
+    // rotation r is at index rotations_ - r + 1 of the chain.
+    long rotations_ = 0;
+    std::shared_ptr<WorkerPool> compressors_;
+    // Rendered, not yet written; mapped with PendingOptions::mapped.
+    PendingBuffer batch_;
+    std::chrono::steady_clock::time_point batchStarted_;
+    std::chrono::steady_clock::time_point lastSync_;
+    int unsyncedFlushes_ = 0;
+    std::vector<bool> definedFormats_;
+    // Index of the active segment. Blocks are published to index_ once they
+    // are complete, so backup() can copy it without holding up the appender.
+    SegmentIndex::Block openBlock_{0, 0, 0};
+    bool blockOpen_ = false;
+    std::mutex indexMutex_;
+    SegmentIndex index_;
+    std::string rendered_;
+    LinePrefixFormatter prefixFormatter_;
+    // SuppressionOptions::coalesceRepeats: the last message written and the
+    // copies of it skipped since.
+    std::string lastMessage_;
+    unsigned lastFlags_ = 0;
+    bool haveLast_ = false;
+    LogStamp lastStamp_;
+    uint64_t repeats_ = 0;
+    std::chrono::steady_clock::time_point repeatsSince_;
+
+    LoggerMetrics metrics_;
+    // Set by init() unless TerminalOptions::enabled is false.
+    std::shared_ptr<TerminalSink> terminal_;
+    std::thread dumper_;
+    std::mutex dumperMutex_;
+    std::condition_variable dumperCv_;
+    bool stopDumper_ = false;
+    // Synchronous mode with FlushPolicy::maxDelayMs: writes out a batch that
+    // no later message comes along to flush.
+    std::thread flusher_;
+    std::mutex flusherMutex_;
+    std::condition_variable flusherCv_;
+    bool stopFlusher_ = false;
+
+    std::unique_ptr<LogRing> ring_;
+    std::thread writer_;
+    // Set instead of writer_ when LoggerOptions::writer does the I/O.
+    std::shared_ptr<SharedWriter> sharedWriter_;
+    bool rotationDeferred_ = false;
+    // A deferred rotation goes ahead on the next try whatever the budget.
+    bool rotationOverdue_ = false;
+
+    // SharedOptions: the ring in shared memory. Producers attach on first
+    // use and publish it in sharedRing_; the collector drains it on its own
+    // thread.
+    std::mutex sharedMutex_;
+    std::unique_ptr<ShmRing> shm_;
+    std::atomic<ShmRing*> sharedRing_{nullptr};
+    std::chrono::steady_clock::time_point nextAttach_;
+    std::thread collector_;
+    std::condition_variable collectorCv_;
+    bool stopCollector_ = false;
+    bool collectorWake_ = false;
+    std::mutex writerMutex_;
+    std::condition_variable writerCv_;
+    std::condition_variable flushedCv_;
+    std::atomic<bool> writerSleeping_{false};
+    bool stopWriter_ = false;
+    size_t written_ = 0;
+    size_t flushed_ = 0;
+    size_t flushTarget_ = 0;
+
+    void flushFile();
     void createDirectories(const std::string& path);
     void rotateLogFiles();
-    void writeToFile(const std::string& message);
+    void rotateIfPossible();
+    void submit(const char* data, size_t length, unsigned flags);
+    void enqueue(const char* data, size_t length, unsigned flags, const LogStamp& stamp,
+                 bool terminal);
+    bool pushUnderPressure(const char* data, size_t length, unsigned flags, const LogStamp& stamp);
+    bool keepSample(LogLevel level) const;
+    bool relieveStaging(StagingBuffer& staging);
+    void dropMessage();
+    void reportDrops();
+    // Counts and returns true when key is over its rate limit.
+    bool limited(uint64_t key);
+    bool repeatOf(const char* data, size_t length, unsigned flags, const LogStamp& stamp);
+    void writeRepeats();
+    void logRecord(LogLevel level, const std::string& record);
+    void logStructured(LogLevel level, const std::string& record);
+    void logFormatted(LogLevel level, const char* format, va_list args);
+    // Terminal output is enabled and init() set up a sink for it.
+    bool printing() const { return terminal_ && terminalEnabled_.load(); }
+    void printToTerminal(const char* data, size_t length, unsigned flags, const LogStamp& stamp,
+                         LinePrefixFormatter& formatter);
+    void writeToFile(const char* data, size_t length, unsigned flags, const LogStamp& stamp);
+    void writeRecord(const char* data, size_t length, unsigned flags, const LogStamp& stamp);
+    void writeBinaryEntry(const char* data, size_t length, unsigned flags, const LogStamp& stamp);
+    void appendToBatch(const char* data, size_t length);
+    bool flushDue() const;
+    void flushPending();
+    void writeOut(const char* data, size_t length);
+    std::string pendingPath() const;
+    void recoverPending();
+    void syncIfDue(bool force);
     std::string getCurrentTimestamp();
-    std::string getLogFilePath(int index = 0) const;
+    // Index 0 is the active file, up to fileNum_.
+    const std::string& getLogFilePath(int index = 0) const;
+    void cachePaths();
+    int segmentCount() const;
+    std::string segmentPath(long sequence) const;
+    std::string manifestPath() const;
+    void loadManifest();
+    void saveManifest();
+    bool indexing() const;
+    void indexLine(unsigned flags, const LogStamp& stamp);
+    void closeIndexBlock();
+    void loadIndex();
+    void saveIndex(const std::string& segment, long size);
+    std::string serializeIndex(long size);
+    void writeIndex(const std::string& segment, const std::string& content);
+    std::string rotatedPath(long segment) const;
+    struct BackupEntry;
+    // A segment backup() is about to copy, read from copy (its snapshot
+    // link, or path itself).
+    struct BackupSource {
+        int position = 0;
+        std::string path;
+        std::string copy;
+        long size = 0;
+        std::string index;
+        std::string indexCopy;
+    };
+    bool linkBackupSources(std::vector<BackupSource>& sources);
+    // Removes the names a backup or a compression job only keeps while it
+    // runs, left behind by a process that died in the middle of one.
+    void removeLeftovers();
+    std::vector<std::string> listBackups(const std::string& root);
+    std::vector<BackupEntry> readBackupList(const std::string& root, const std::string& name);
+    void writeBackupList(const std::string& root, const std::string& name,
+                         const std::vector<BackupEntry>& entries);
+    void evictOldBackups(const std::string& root, BackupReport& report);
+    void removeTree(const std::string& path);
+    void stopCompression();
+    void queueCompression(long segment);
+    void compressSegment(long segment);
+
+    StagingBuffer& localStaging();
+    bool stage(const char* data, size_t length, unsigned flags, const LogStamp& stamp);
+    void drainStaging();
+    void drainStagingLocked();
+
+    void startWriter();
+    void stopWriter();
+    void writerLoop();
+    // One round of the writer: drains a batch, flushes when due and returns
+    // how many messages it wrote.
+    size_t writerStep(bool stopping);
+    std::chrono::milliseconds writerTimeout() const;
+    size_t drainRing();
+    void wakeWriter();
+
+    ShmRing* attachShared();
+    bool pushShared(const char* data, size_t length, unsigned flags, const LogStamp& stamp);
+    void startCollector();
+    void stopCollector();
+    void collectorLoop();
+    size_t drainShared();
+
+    void startDumper();
+    // Returns whether a dumper was running; the caller writes the last dump
+    // once the writer thread is gone.
+    bool stopDumper();
+    void dumperLoop();
+    void dumpMetrics();
+
+    void startFlusher();
+    void stopFlusher();
+    void flusherLoop();
 };
+
+#define LITTLE_LOG_ENABLED(level) (static_cast<int>(LogLevel::level) >= LITTLE_LOG_MIN_LEVEL)
+
+// The message expression is only evaluated when the level passes both the
+// compile-time minimum and the logger's runtime threshold.
+#define LITTLE_LOG(logger, level, message)                                               \
+    do {                                                                                 \
+        if (LITTLE_LOG_ENABLED(level) && (logger).shouldLog(LogLevel::level)) {          \
+            (logger).logMsg(LogLevel::level, message);                                   \
+        }                                                                                \
+    } while (0)
+
+#define LITTLE_LOG_BINARY_AT(logger, level, format, ...)                                 \
+    do {                                                                                 \
+        if (LITTLE_LOG_ENABLED(level) && (logger).shouldLog(LogLevel::level)) {          \
+            static const uint32_t littleLogFormatId = binary_log::registerFormat(        \
+                format, decltype(binary_log::signatureOf(__VA_ARGS__))::get());          \
+            (logger).logBinary(LogLevel::level, littleLogFormatId, ##__VA_ARGS__);       \
+        }                                                                                \
+    } while (0)
+
+#define LITTLE_LOG_BINARY(logger, format, ...) LITTLE_LOG_BINARY_AT(logger, Info, format, ##__VA_ARGS__)
+
+#define LITTLE_LOG_DISABLED(logger, message) \
+    do {                                     \
+    } while (0)
+
+#if LITTLE_LOG_MIN_LEVEL <= 0
+#define LITTLE_LOG_TRACE(logger, message) LITTLE_LOG(logger, Trace, message)
+#else
+#define LITTLE_LOG_TRACE(logger, message) LITTLE_LOG_DISABLED(logger, message)
+#endif
+
+#if LITTLE_LOG_MIN_LEVEL <= 1
+#define LITTLE_LOG_DEBUG(logger, message) LITTLE_LOG(logger, Debug, message)
+#else
+#define LITTLE_LOG_DEBUG(logger, message) LITTLE_LOG_DISABLED(logger, message)
+#endif
+
+#if LITTLE_LOG_MIN_LEVEL <= 2
+#define LITTLE_LOG_INFO(logger, message) LITTLE_LOG(logger, Info, message)
+#else
+#define LITTLE_LOG_INFO(logger, message) LITTLE_LOG_DISABLED(logger, message)
+#endif
+
+#if LITTLE_LOG_MIN_LEVEL <= 3
+#define LITTLE_LOG_WARN(logger, message) LITTLE_LOG(logger, Warn, message)
+#else
+#define LITTLE_LOG_WARN(logger, message) LITTLE_LOG_DISABLED(logger, message)
+#endif
+
+#if LITTLE_LOG_MIN_LEVEL <= 4
+#define LITTLE_LOG_ERROR(logger, message) LITTLE_LOG(logger, Error, message)
+#else
+#define LITTLE_LOG_ERROR(logger, message) LITTLE_LOG_DISABLED(logger, message)
+#endif
+
+#if LITTLE_LOG_MIN_LEVEL <= 5
+#define LITTLE_LOG_FATAL(logger, message) LITTLE_LOG(logger, Fatal, message)
+#else
+#define LITTLE_LOG_FATAL(logger, message) LITTLE_LOG_DISABLED(logger, message)
+#endif
@@ -0,0 +1,227 @@
+#include "logger_metrics.h"
+#include <algorithm>
+#include <sstream>
+
+namespace {
+
+std::atomic<uint64_t> nextMetricsId{1};
+
+int highestBit(uint64_t value) {
+    int bit = 0;
+    while (value >>= 1) {
+        ++bit;
+    }
+    return bit;
+}
+
+void appendHistogram(std::ostringstream& out, const char* name, const LatencyHistogram& histogram) {
+    out << ",\"" << name << "\":{\"count\":" << histogram.count
+        << ",\"mean_ns\":" << (histogram.count ? histogram.sum / histogram.count : 0)
+        << ",\"p50_ns\":" << histogram.percentile(0.50)
+        << ",\"p99_ns\":" << histogram.percentile(0.99)
+        << ",\"p999_ns\":" << histogram.percentile(0.999) << ",\"max_ns\":" << histogram.max
+        << "}";
+}
+
+}  // namespace
+
+int LatencyHistogram::bucketOf(uint64_t nanoseconds) {
+    if (nanoseconds < static_cast<uint64_t>(kSubBuckets)) {
+        return static_cast<int>(nanoseconds);
+    }
+    int exponent = highestBit(nanoseconds);
+    return (exponent - 2) * kSubBuckets + static_cast<int>((nanoseconds >> (exponent - 3)) & 7);
+}
+
+uint64_t LatencyHistogram::lowerBound(int bucket) {
+    if (bucket < kSubBuckets) {
+        return static_cast<uint64_t>(bucket);
+    }
+    int exponent = bucket / kSubBuckets + 2;
+    return static_cast<uint64_t>(kSubBuckets + bucket % kSubBuckets) << (exponent - 3);
+}
+
+uint64_t LatencyHistogram::upperBound(int bucket) {
+    return bucket + 1 < kBuckets ? lowerBound(bucket + 1) - 1 : UINT64_MAX;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(p * static_cast<double>(count - 1)) + 1;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < kBuckets; ++bucket) {
+        seen += counts[bucket];
+        if (seen >= rank) {
+            return std::min(upperBound(bucket), max);
+        }
+    }
+    return max;
+}
+
+std::string MetricsSnapshot::toJson() const {
+    std::ostringstream out;
+    out << "{\"messages\":" << messages << ",\"bytes_written\":" << bytesWritten
+        << ",\"writes\":" << writes << ",\"rotations\":" << rotations
+        << ",\"backups\":" << backups << ",\"file_system_errors\":" << fileSystemErrors
+        << ",\"queue_depth\":" << queueDepth << ",\"queue_depth_max\":" << queueDepthMax
+        << ",\"queue_full_waits\":" << queueFullWaits << ",\"dropped\":" << dropped
+        << ",\"terminal_dropped\":" << terminalDropped << ",\"rate_limited\":" << rateLimited
+        << ",\"repeats_coalesced\":" << repeatsCoalesced;
+    appendHistogram(out, "write_latency", writeLatency);
+    appendHistogram(out, "rotate_latency", rotateLatency);
+    out << "}";
+    return out.str();
+}
+
+LoggerMetrics::Shard::Shard() {
+    for (auto& counter : counters) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    for (Histogram* histogram : {&write, &rotate}) {
+        for (auto& bucket : histogram->counts) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        histogram->sum.store(0, std::memory_order_relaxed);
+        histogram->max.store(0, std::memory_order_relaxed);
+    }
+}
+
+LoggerMetrics::LoggerMetrics()
+    : id_(nextMetricsId.fetch_add(1)), shards_(std::make_shared<Shards>()) {}
+
+LoggerMetrics::Shard& LoggerMetrics::local() {
+    struct Entry {
+        uint64_t metricsId;
+        std::weak_ptr<Shards> owner;
+        std::shared_ptr<Shard> shard;
+    };
+    struct Entries {
+        ~Entries() {
+            for (const Entry& entry : list) {
+                retire(entry.owner, entry.shard);
+            }
+        }
+        std::vector<Entry> list;
+    };
+    thread_local Entries entries;
+    thread_local uint64_t lastId = 0;
+    thread_local Shard* last = nullptr;
+
+    if (lastId == id_) {
+        return *last;
+    }
+    for (const Entry& entry : entries.list) {
+        if (entry.metricsId == id_) {
+            lastId = id_;
+            last = entry.shard.get();
+            return *last;
+        }
+    }
+
+    // Entries of destroyed loggers.
+    entries.list.erase(std::remove_if(entries.list.begin(), entries.list.end(),
+                                      [](const Entry& entry) { return entry.owner.expired(); }),
+                       entries.list.end());
+    auto shard = std::make_shared<Shard>();
+    {
+        std::lock_guard<std::mutex> lock(shards_->mutex);
+        shards_->live.push_back(shard);
+    }
+    entries.list.push_back(Entry{id_, shards_, shard});
+    lastId = id_;
+    last = shard.get();
+    return *last;
+}
+
+void LoggerMetrics::retire(const std::weak_ptr<Shards>& owner,
+                           const std::shared_ptr<Shard>& shard) {
+    std::shared_ptr<Shards> shards = owner.lock();
+    if (!shards) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(shards->mutex);
+    fold(*shard, shards->retired);
+    shards->live.erase(std::find(shards->live.begin(), shards->live.end(), shard));
+}
+
+void LoggerMetrics::record(Histogram& histogram, std::chrono::steady_clock::duration elapsed) {
+    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    uint64_t value = nanoseconds > 0 ? static_cast<uint64_t>(nanoseconds) : 0;
+    std::atomic<uint64_t>& bucket = histogram.counts[LatencyHistogram::bucketOf(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    histogram.sum.store(histogram.sum.load(std::memory_order_relaxed) + value,
+                        std::memory_order_relaxed);
+    if (value > histogram.max.load(std::memory_order_relaxed)) {
+        histogram.max.store(value, std::memory_order_relaxed);
+    }
+}
+
+void LoggerMetrics::fold(const Shard& from, Shard& into) {
+    auto add = [](const std::atomic<uint64_t>& value, std::atomic<uint64_t>& total) {
+        total.store(total.load(std::memory_order_relaxed) + value.load(std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+    };
+    for (int counter = 0; counter < kCounters; ++counter) {
+        add(from.counters[counter], into.counters[counter]);
+    }
+    const Histogram* sources[] = {&from.write, &from.rotate};
+    Histogram* targets[] = {&into.write, &into.rotate};
+    for (int i = 0; i < 2; ++i) {
+        for (int bucket = 0; bucket < LatencyHistogram::kBuckets; ++bucket) {
+            add(sources[i]->counts[bucket], targets[i]->counts[bucket]);
+        }
+        add(sources[i]->sum, targets[i]->sum);
+        uint64_t max = sources[i]->max.load(std::memory_order_relaxed);
+        if (max > targets[i]->max.load(std::memory_order_relaxed)) {
+            targets[i]->max.store(max, std::memory_order_relaxed);
+        }
+    }
+}
+
+void LoggerMetrics::merge(const Histogram& from, LatencyHistogram& into) {
+    for (int bucket = 0; bucket < LatencyHistogram::kBuckets; ++bucket) {
+        uint64_t count = from.counts[bucket].load(std::memory_order_relaxed);
+        into.counts[bucket] += count;
+        into.count += count;
+    }
+    into.sum += from.sum.load(std::memory_order_relaxed);
+    into.max = std::max(into.max, from.max.load(std::memory_order_relaxed));
+}
+
+MetricsSnapshot LoggerMetrics::snapshot() const {
+    uint64_t totals[kCounters] = {};
+    MetricsSnapshot snapshot;
+    {
+        std::lock_guard<std::mutex> lock(shards_->mutex);
+        auto add = [&](const Shard& shard) {
+            for (int counter = 0; counter < kCounters; ++counter) {
+                totals[counter] += shard.counters[counter].load(std::memory_order_relaxed);
+            }
+            merge(shard.write, snapshot.writeLatency);
+            merge(shard.rotate, snapshot.rotateLatency);
+        };
+        add(shards_->retired);
+        for (const auto& shard : shards_->live) {
+            add(*shard);
+        }
+    }
+    snapshot.messages = totals[kMessages];
+    snapshot.bytesWritten = totals[kBytesWritten];
+    snapshot.writes = totals[kWrites];
+    snapshot.rotations = totals[kRotations];
+    snapshot.backups = totals[kBackups];
+    snapshot.fileSystemErrors = totals[kFileSystemErrors];
+    snapshot.queueFullWaits = totals[kQueueFullWaits];
+    snapshot.dropped = totals[kDropped];
+    snapshot.rateLimited = totals[kRateLimited];
+    snapshot.repeatsCoalesced = totals[kRepeatsCoalesced];
+    snapshot.queueDepthMax = queueDepthMax_.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+size_t LoggerMetrics::liveShards() const {
+    std::lock_guard<std::mutex> lock(shards_->mutex);
+    return shards_->live.size();
+}
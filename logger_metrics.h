@@ -0,0 +1,138 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Log-linear latency histogram in the style of HdrHistogram: values (in
+// nanoseconds) below 8 get a bucket each, every power of two above that is
+// split into 8 buckets, so a bucket is never wider than 12.5% of its value.
+struct LatencyHistogram {
+    static const int kSubBuckets = 8;
+    static const int kBuckets = 62 * kSubBuckets;
+
+    static int bucketOf(uint64_t nanoseconds);
+    static uint64_t lowerBound(int bucket);
+    static uint64_t upperBound(int bucket);
+
+    // Upper bound of the bucket holding the p-th fraction of samples (never
+    // above max); 0 when empty.
+    uint64_t percentile(double p) const;
+
+    std::vector<uint64_t> counts = std::vector<uint64_t>(kBuckets, 0);
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+};
+
+struct MetricsSnapshot {
+    // Messages accepted by logMsg()/logBinary() (after level filtering).
+    uint64_t messages = 0;
+    // Bytes handed to FileHandle::write() and the number of those writes.
+    uint64_t bytesWritten = 0;
+    uint64_t writes = 0;
+    uint64_t rotations = 0;
+    uint64_t backups = 0;
+    // FileSystemInterface calls that reported failure.
+    uint64_t fileSystemErrors = 0;
+    // Async mode: messages waiting in the queue right now, the most seen by
+    // the writer thread, and pushes that found the queue full.
+    uint64_t queueDepth = 0;
+    uint64_t queueDepthMax = 0;
+    uint64_t queueFullWaits = 0;
+    // Messages discarded by the overload policy.
+    uint64_t dropped = 0;
+    // SuppressionOptions: messages over their rate limit, and repeats
+    // folded into a "last message repeated N times" line.
+    uint64_t rateLimited = 0;
+    uint64_t repeatsCoalesced = 0;
+    // Terminal lines dropped by TerminalPolicy::Drop or a failing stdout.
+    uint64_t terminalDropped = 0;
+    // Time spent in FileHandle::write() per batch, and per rotation.
+    LatencyHistogram writeLatency;
+    LatencyHistogram rotateLatency;
+
+    // One JSON object on a single line.
+    std::string toJson() const;
+};
+
+// Counters are kept per thread: the owning thread updates its shard with
+// relaxed loads and stores, and snapshot() adds all shards up. A thread that
+// exits folds its shard into a retired total, so the shard list only holds
+// live threads.
+class LoggerMetrics {
+public:
+    enum Counter {
+        kMessages,
+        kBytesWritten,
+        kWrites,
+        kRotations,
+        kBackups,
+        kFileSystemErrors,
+        kQueueFullWaits,
+        kDropped,
+        kRateLimited,
+        kRepeatsCoalesced,
+        kCounters
+    };
+
+    LoggerMetrics();
+    LoggerMetrics(const LoggerMetrics&) = delete;
+    LoggerMetrics& operator=(const LoggerMetrics&) = delete;
+
+    void add(Counter counter, uint64_t value = 1) {
+        std::atomic<uint64_t>& slot = local().counters[counter];
+        slot.store(slot.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+    void recordWrite(std::chrono::steady_clock::duration elapsed) {
+        record(local().write, elapsed);
+    }
+    void recordRotate(std::chrono::steady_clock::duration elapsed) {
+        record(local().rotate, elapsed);
+    }
+    // Only called by the async writer thread.
+    void observeQueueDepth(uint64_t depth) {
+        if (depth > queueDepthMax_.load(std::memory_order_relaxed)) {
+            queueDepthMax_.store(depth, std::memory_order_relaxed);
+        }
+    }
+
+    // queueDepth and terminalDropped are left for the caller to fill in.
+    MetricsSnapshot snapshot() const;
+    // Shards of threads that have not exited yet.
+    size_t liveShards() const;
+
+private:
+    struct Histogram {
+        std::atomic<uint64_t> counts[LatencyHistogram::kBuckets];
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+    };
+    struct Shard {
+        Shard();
+        std::atomic<uint64_t> counters[kCounters];
+        Histogram write;
+        Histogram rotate;
+    };
+
+    // Outlives the LoggerMetrics for threads that exit after it.
+    struct Shards {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<Shard>> live;
+        Shard retired;
+    };
+
+    Shard& local();
+    static void retire(const std::weak_ptr<Shards>& owner, const std::shared_ptr<Shard>& shard);
+    static void record(Histogram& histogram, std::chrono::steady_clock::duration elapsed);
+    static void fold(const Shard& from, Shard& into);
+    static void merge(const Histogram& from, LatencyHistogram& into);
+
+    const uint64_t id_;
+    const std::shared_ptr<Shards> shards_;
+    std::atomic<uint64_t> queueDepthMax_{0};
+};
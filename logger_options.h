@@ -0,0 +1,189 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string>
+#include "line_prefix.h"
+#include "log_level.h"
+
+class SharedWriter;
+
+// With both thresholds at zero every message is written as soon as it is
+// logged. Otherwise lines are buffered and written together once either
+// threshold is reached. The async writer wakes up for maxDelayMs; in
+// synchronous mode a small flusher thread, started only when maxDelayMs is
+// set, writes out a batch that no later message comes along to flush.
+struct FlushPolicy {
+    size_t maxBufferedBytes = 0;
+    int maxDelayMs = 0;
+    // fdatasync() after this many writes / after this long, 0 disables.
+    int syncEveryFlushes = 0;
+    int syncIntervalMs = 0;
+};
+
+enum class RotationScheme {
+    // name.log is always the active file; rotating renames every name.logN
+    // to name.logN+1, so it costs fileNum renames.
+    Rename,
+    // Segments are named name.<sequence>.log and never renamed; name.manifest
+    // records the oldest and newest sequence. Rotating starts a new segment
+    // and removes at most the oldest one.
+    Sequence,
+};
+
+// Rotated segments are gzip-compressed in the background into name.logN.gz
+// (name.<seq>.log.gz) and the uncompressed file is removed.
+struct CompressionOptions {
+    // Threads compressing segments in parallel; 0 leaves segments as they are.
+    int workers = 0;
+    int level = 6;
+};
+
+// What logMsg() does when the write path cannot keep up: the async queue is
+// full, or in synchronous mode the calling thread's staging buffer is.
+enum class OverloadPolicy {
+    // Wait for room; after blockTimeoutMs (0 waits forever) the message is
+    // dropped.
+    Block,
+    // Drop the message being logged.
+    DropNewest,
+    // Discard the oldest queued message to make room.
+    DropOldest,
+    // Once the queue (staging buffer) is half full, keep each message with
+    // the probability sampleRates[level]; a full one drops.
+    Sample,
+};
+
+struct OverloadOptions {
+    OverloadPolicy policy = OverloadPolicy::Block;
+    int blockTimeoutMs = 0;
+    // Indexed by LogLevel, Trace..Fatal.
+    double sampleRates[6] = {0.01, 0.1, 0.5, 1.0, 1.0, 1.0};
+};
+
+// Floods of the same line. With coalesceRepeats a message identical to the
+// one written just before it (same bytes and level) is skipped; the next
+// different message, flush(), or windowMs after the first skipped one writes
+// "last message repeated N times" instead (in synchronous mode the window is
+// only checked when the next copy arrives). perSecond > 0 also passes every
+// message through a token bucket holding up to burst messages, keyed by the
+// message bytes for logMsg(), by the format string (the call site) for
+// logFormat(), by the call site's format for LITTLE_LOG_BINARY and by the
+// event string for log(); messages over the limit are discarded before they
+// are queued. Both are counted in snapshot().
+struct SuppressionOptions {
+    bool coalesceRepeats = false;
+    int windowMs = 1000;
+    double perSecond = 0;
+    double burst = 10;
+    // Buckets in the table; keys that collide share one.
+    size_t buckets = 4096;
+};
+
+// Every text segment gets a sparse time index, <segment>.idx (see
+// log_index.h), written when the segment is rotated, copied by backup() and
+// read by LogReader. A block is started every intervalBytes of log; 0
+// writes no index.
+struct IndexOptions {
+    size_t intervalBytes = 0;
+};
+
+// backup() with incremental set only copies rotated segments that no
+// earlier backup under the same backupPath holds (compared by
+// FileSystemInterface::contentId()); every backup lists all of its segments,
+// copied or not, in its backup.list. With totalMaxBytes > 0 the oldest
+// backups are then evicted until the segments stored in the whole backup
+// tree fit; segments a newer backup still lists are moved into it first.
+struct BackupOptions {
+    bool incremental = false;
+    long totalMaxBytes = 0;
+};
+
+enum class TerminalPolicy {
+    // Callers wait for the terminal writer once the buffer is full.
+    Block,
+    // Lines that do not fit are discarded and counted.
+    Drop,
+};
+
+struct TerminalOptions {
+    // When false no terminal writer thread is started, and enableTerminal()
+    // has no effect until init() is called with it set again. logFact() is
+    // unaffected: without a sink it writes straight to fd.
+    bool enabled = true;
+    int fd = 1;
+    size_t bufferBytes = 256 * 1024;
+    TerminalPolicy policy = TerminalPolicy::Block;
+};
+
+// Every dumpIntervalMs a Logger::snapshot() is appended to dumpPath as one
+// JSON line, plus a last one when the logger is shut down or re-initialized.
+struct MetricsOptions {
+    std::string dumpPath;
+    int dumpIntervalMs = 0;
+};
+
+// Lines waiting for a flush (see FlushPolicy) are kept in
+// filePath/filePreName/filePreName.pending, a file-backed mapping, rather
+// than on the heap, so they survive the process dying: the next init() with
+// the same filePreName and filePath appends whatever had not reached the log
+// before logging resumes. That recovery runs whether or not mapped is set.
+struct PendingOptions {
+    bool mapped = false;
+    // Room in the mapping; a batch that reaches it is written out early.
+    size_t capacity = 4 << 20;
+    // Also write the mapping out from SIGSEGV, SIGBUS, SIGILL, SIGFPE and
+    // SIGABRT, then let the signal's previous disposition run.
+    bool drainOnFatalSignal = false;
+};
+
+enum class SharedRole {
+    None,
+    // Puts every record into the shared ring and never touches the log
+    // files; backup() is the collector's job and returns an empty report.
+    Producer,
+    // Creates the ring and writes what all producers put into it, through
+    // its own synchronous or async path, to its files.
+    Collector,
+};
+
+// Several processes logging to one filePath/filePreName: each of them runs
+// a Producer, and exactly one process (or one logger in it) the Collector,
+// which alone rotates and backs up the files. The ring is the POSIX shared
+// memory object /name (see shm_ring.h); its slots are only set by the
+// collector. Producers started first keep trying to attach and drop their
+// messages until they can.
+struct SharedOptions {
+    SharedRole role = SharedRole::None;
+    std::string name;
+    size_t slots = 16384;
+};
+
+struct LoggerOptions {
+    // Queue messages and let a background thread do all file I/O.
+    bool async = false;
+    size_t queueCapacity = 8192;
+    size_t maxBatchMessages = 256;
+    // Async mode: leave the file I/O to this shared thread instead of starting
+    // one, and use its terminal sink and compression pool. See LogRegistry.
+    std::shared_ptr<SharedWriter> writer;
+    FlushPolicy flush;
+    // Messages below this level are discarded; see Logger::setLevel().
+    LogLevel minLevel = LogLevel::Trace;
+    // line_prefix::kTimestamp | kLevel | kThreadId fields put in front of
+    // every line; 0 writes messages as they are.
+    unsigned prefix = 0;
+    // Write binary segments (see binary_log.h) instead of text lines.
+    bool binary = false;
+    RotationScheme rotation = RotationScheme::Rename;
+    CompressionOptions compression;
+    IndexOptions index;
+    BackupOptions backup;
+    MetricsOptions metrics;
+    TerminalOptions terminal;
+    // Dropped messages are reported by one "N messages dropped" line once the
+    // backlog has been written.
+    OverloadOptions overload;
+    SuppressionOptions suppression;
+    PendingOptions pending;
+    SharedOptions shared;
+};
@@ -0,0 +1,254 @@
+#include "mapped_file_system.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include "binary_log.h"
+
+namespace {
+
+size_t pageSize() {
+    static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+size_t roundUpToPage(size_t value) {
+    size_t page = pageSize();
+    return (value + page - 1) / page * page;
+}
+
+// Length of the prefix of data that ends on a complete line, or on a
+// complete entry for binary segments. Binary entries are cut at the first
+// zero kind byte or truncated entry; an entry whose last pages never reached
+// the disk still reads back with zeroed bytes.
+size_t completeLength(const char* data, size_t size) {
+    if (size >= binary_log::kMagicSize &&
+        std::memcmp(data, binary_log::kMagic, binary_log::kMagicSize) == 0) {
+        size_t pos = binary_log::kMagicSize;
+        while (pos + 1 + sizeof(uint32_t) <= size && binary_log::isEntryKind(data[pos])) {
+            uint32_t length;
+            std::memcpy(&length, data + pos + 1, sizeof(length));
+            if (length > size - pos - 1 - sizeof(uint32_t)) {
+                break;
+            }
+            pos += 1 + sizeof(uint32_t) + length;
+        }
+        return pos;
+    }
+    while (size > 0 && data[size - 1] != '\n') {
+        --size;
+    }
+    return size;
+}
+
+long recoveredLength(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        return 0;
+    }
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    size_t length = completeLength(static_cast<const char*>(data), size);
+    munmap(data, size);
+    return static_cast<long>(length);
+}
+
+bool preallocate(int fd, size_t size) {
+#if defined(__linux__)
+    if (fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0) {
+        return true;
+    }
+#endif
+    return ftruncate(fd, static_cast<off_t>(size)) == 0;
+}
+
+}  // namespace
+
+class MappedFileSystem::MappedHandle : public FileHandle {
+public:
+    MappedHandle(MappedFileSystem* owner, const std::string& path, int fd, size_t length)
+        : owner_(owner), path_(path), fd_(fd), length_(length), synced_(length) {}
+
+    ~MappedHandle() override {
+        {
+            std::lock_guard<std::mutex> lock(owner_->handlesMutex_);
+            auto it = owner_->handles_.find(path_);
+            if (it != owner_->handles_.end() && it->second == this) {
+                owner_->handles_.erase(it);
+            }
+        }
+        if (base_) {
+            munmap(base_, capacity_);
+        }
+        if (ftruncate(fd_, static_cast<off_t>(length_.load())) != 0) {
+            // Nothing better to do; recoverFile() trims the tail next time.
+        }
+        close(fd_);
+    }
+
+    bool map(size_t capacity) {
+        std::lock_guard<std::mutex> lock(mapMutex_);
+        return remap(capacity);
+    }
+
+    bool write(const char* data, size_t length) override {
+        size_t offset = length_.load(std::memory_order_relaxed);
+        if (offset + length > capacity_) {
+            std::lock_guard<std::mutex> lock(mapMutex_);
+            if (!remap(std::max(capacity_ * 2, roundUpToPage(offset + length)))) {
+                return false;
+            }
+        }
+        std::memcpy(base_ + offset, data, length);
+        length_.store(offset + length, std::memory_order_release);
+        return true;
+    }
+
+    bool sync() override {
+        std::lock_guard<std::mutex> lock(mapMutex_);
+        size_t length = length_.load(std::memory_order_acquire);
+        return length == 0 || msync(base_, length, MS_SYNC) == 0;
+    }
+
+    size_t length() const { return length_.load(std::memory_order_acquire); }
+
+    // Starts write-back of everything appended since the last call and
+    // releases the pages that are complete; the writer never touches them
+    // again.
+    void flushWritten() {
+        std::lock_guard<std::mutex> lock(mapMutex_);
+        size_t length = length_.load(std::memory_order_acquire);
+        if (length <= synced_) {
+            return;
+        }
+        size_t start = synced_ / pageSize() * pageSize();
+        msync(base_ + start, length - start, MS_ASYNC);
+        size_t done = length / pageSize() * pageSize();
+        if (done > start) {
+            madvise(base_ + start, done - start, MADV_DONTNEED);
+        }
+        synced_ = length;
+    }
+
+private:
+    bool remap(size_t capacity) {
+        if (!preallocate(fd_, capacity)) {
+            return false;
+        }
+        void* base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED) {
+            return false;
+        }
+        if (base_) {
+            munmap(base_, capacity_);
+        }
+        base_ = static_cast<char*>(base);
+        capacity_ = capacity;
+#if defined(__linux__)
+        madvise(base_, capacity_, MADV_SEQUENTIAL);
+#endif
+        return true;
+    }
+
+    MappedFileSystem* owner_;
+    std::string path_;
+    int fd_;
+    // base_ and capacity_ only change under mapMutex_, and only on the
+    // writing thread, so write() may read them without it.
+    std::mutex mapMutex_;
+    char* base_ = nullptr;
+    size_t capacity_ = 0;
+    std::atomic<size_t> length_;
+    size_t synced_;
+};
+
+MappedFileSystem::MappedFileSystem(size_t segmentSize, int syncIntervalMs)
+    : segmentSize_(roundUpToPage(segmentSize > 0 ? segmentSize : 1)),
+      syncIntervalMs_(syncIntervalMs > 0 ? syncIntervalMs : 1000),
+      flusher_(&MappedFileSystem::flusherLoop, this) {}
+
+MappedFileSystem::~MappedFileSystem() {
+    {
+        std::lock_guard<std::mutex> lock(flusherMutex_);
+        stopping_ = true;
+    }
+    flusherCv_.notify_one();
+    flusher_.join();
+}
+
+long MappedFileSystem::getFileSize(const std::string& path) {
+    {
+        std::lock_guard<std::mutex> lock(handlesMutex_);
+        auto it = handles_.find(path);
+        if (it != handles_.end()) {
+            return static_cast<long>(it->second->length());
+        }
+    }
+    return RealFileSystem::getFileSize(path);
+}
+
+bool MappedFileSystem::recoverFile(const std::string& path) {
+    {
+        std::lock_guard<std::mutex> lock(handlesMutex_);
+        if (handles_.count(path)) {
+            return true;
+        }
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return !RealFileSystem::fileExists(path);
+    }
+    struct stat st;
+    long length = recoveredLength(fd);
+    bool ok = length >= 0 && fstat(fd, &st) == 0 &&
+              (st.st_size == length || ftruncate(fd, length) == 0);
+    close(fd);
+    return ok;
+}
+
+std::unique_ptr<FileHandle> MappedFileSystem::openForAppend(const std::string& path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return nullptr;
+    }
+    // Drop a torn tail first so the preallocated space behind the data is
+    // zero-filled and a later recovery cannot mistake leftovers for lines.
+    long length = recoveredLength(fd);
+    if (length < 0 || ftruncate(fd, length) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    std::unique_ptr<MappedHandle> handle(
+        new MappedHandle(this, path, fd, static_cast<size_t>(length)));
+    size_t capacity = std::max(segmentSize_, roundUpToPage(static_cast<size_t>(length) + 1));
+    if (!handle->map(capacity)) {
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock(handlesMutex_);
+        handles_[path] = handle.get();
+    }
+    return handle;
+}
+
+void MappedFileSystem::flusherLoop() {
+    std::unique_lock<std::mutex> lock(flusherMutex_);
+    while (!stopping_) {
+        flusherCv_.wait_for(lock, std::chrono::milliseconds(syncIntervalMs_));
+        std::lock_guard<std::mutex> handles(handlesMutex_);
+        for (auto& entry : handles_) {
+            entry.second->flushWritten();
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "real_file_system.h"
+
+// Appends go through a shared mapping of a segment that is preallocated to
+// segmentSize bytes, so writing a batch is a memcpy instead of a write().
+// A background thread msyncs what has been written every syncIntervalMs and
+// drops the written pages from the mapping. Closing a handle truncates the
+// file to what was actually written; after a crash the zero-filled tail is
+// cut off again by recoverFile(). Pass the logger's fileSize as segmentSize.
+class MappedFileSystem : public RealFileSystem {
+public:
+    explicit MappedFileSystem(size_t segmentSize, int syncIntervalMs = 1000);
+    ~MappedFileSystem() override;
+
+    long getFileSize(const std::string& path) override;
+    bool recoverFile(const std::string& path) override;
+    std::unique_ptr<FileHandle> openForAppend(const std::string& path) override;
+
+private:
+    class MappedHandle;
+
+    void flusherLoop();
+
+    size_t segmentSize_;
+    int syncIntervalMs_;
+    // Open handles by path, so getFileSize() reports the written length
+    // rather than the preallocated one.
+    std::mutex handlesMutex_;
+    std::map<std::string, MappedHandle*> handles_;
+    std::mutex flusherMutex_;
+    std::condition_variable flusherCv_;
+    bool stopping_ = false;
+    // Declared last: the thread starts in the constructor and uses every
+    // member above.
+    std::thread flusher_;
+};
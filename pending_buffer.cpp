@@ -0,0 +1,251 @@
+#include "pending_buffer.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+
+namespace {
+const char kMagic[16] = "little-log-pend";
+const uint32_t kVersion = 1;
+const size_t kHeaderSize = 4096;
+
+struct Header {
+    char magic[16];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t capacity;
+    // Published bytes, and where they go. length is 0 whenever offset and
+    // target are being changed.
+    std::atomic<uint64_t> length;
+    std::atomic<int64_t> offset;
+    char target[kHeaderSize - 48];
+};
+
+Header* headerOf(void* memory) {
+    return static_cast<Header*>(memory);
+}
+
+// Mappings the fatal signal handler writes out. It may run on any thread at
+// any time, so it only reads these slots and calls async-signal-safe
+// functions.
+const int kFatalSignals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+const size_t kSignals = sizeof(kFatalSignals) / sizeof(kFatalSignals[0]);
+const size_t kMaxDrains = 64;
+std::atomic<void*> drains[kMaxDrains];
+struct sigaction previous[kSignals];
+std::once_flag installed;
+
+void drainMapping(void* memory) {
+    Header* header = headerOf(memory);
+    uint64_t length = header->length.load(std::memory_order_acquire);
+    if (length == 0 || length > header->capacity) {
+        return;
+    }
+    // Writing at the batch's own offset cannot duplicate anything the
+    // logger already wrote, whether it got that far or not.
+    off_t offset = static_cast<off_t>(header->offset.load(std::memory_order_relaxed));
+    int fd = open(header->target, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    const char* data = static_cast<const char*>(memory) + kHeaderSize;
+    while (length > 0) {
+        ssize_t n = pwrite(fd, data, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        data += n;
+        length -= static_cast<uint64_t>(n);
+        offset += n;
+    }
+    close(fd);
+}
+
+void onFatalSignal(int signo) {
+    int saved = errno;
+    for (std::atomic<void*>& slot : drains) {
+        void* memory = slot.load(std::memory_order_acquire);
+        if (memory) {
+            drainMapping(memory);
+        }
+    }
+    // Hand the signal to whoever had it before; it is blocked until we
+    // return, and a fault simply happens again under the old disposition.
+    for (size_t i = 0; i < kSignals; ++i) {
+        if (kFatalSignals[i] == signo) {
+            sigaction(signo, &previous[i], nullptr);
+        }
+    }
+    errno = saved;
+    raise(signo);
+}
+
+void installHandler() {
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = onFatalSignal;
+    action.sa_flags = SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < kSignals; ++i) {
+        sigaction(kFatalSignals[i], &action, &previous[i]);
+    }
+}
+
+bool addDrain(void* memory) {
+    std::call_once(installed, installHandler);
+    for (std::atomic<void*>& slot : drains) {
+        void* empty = nullptr;
+        if (slot.compare_exchange_strong(empty, memory)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void removeDrain(void* memory) {
+    for (std::atomic<void*>& slot : drains) {
+        void* expected = memory;
+        slot.compare_exchange_strong(expected, nullptr);
+    }
+}
+}  // namespace
+
+PendingBuffer::~PendingBuffer() {
+    unmap();
+}
+
+bool PendingBuffer::map(const std::string& path, size_t capacity, bool drainOnSignal) {
+    unmap();
+    size_t size = kHeaderSize + capacity;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        close(fd);
+        return false;
+    }
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    static_assert(sizeof(Header) == kHeaderSize, "pending header layout changed");
+    Header* header = headerOf(memory);
+    header->length.store(0, std::memory_order_relaxed);
+    std::memcpy(header->magic, kMagic, sizeof(kMagic));
+    header->version = kVersion;
+    header->reserved = 0;
+    header->capacity = capacity;
+    header->offset.store(0, std::memory_order_relaxed);
+    header->target[0] = '\0';
+
+    heap_.clear();
+    memory_ = memory;
+    mappedSize_ = size;
+    size_ = 0;
+    draining_ = drainOnSignal && addDrain(memory);
+    return true;
+}
+
+void PendingBuffer::unmap() {
+    if (!memory_) {
+        return;
+    }
+    if (draining_) {
+        removeDrain(memory_);
+        draining_ = false;
+    }
+    munmap(memory_, mappedSize_);
+    memory_ = nullptr;
+    mappedSize_ = 0;
+    size_ = 0;
+}
+
+bool PendingBuffer::recover(const std::string& path, std::string* target, long* offset,
+                            std::string* data) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= kHeaderSize;
+    void* memory = ok ? mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0)
+                      : MAP_FAILED;
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    const Header* header = headerOf(memory);
+    uint64_t length = header->length.load(std::memory_order_acquire);
+    ok = std::memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+         header->version == kVersion && length > 0 &&
+         length <= static_cast<size_t>(st.st_size) - kHeaderSize &&
+         std::memchr(header->target, '\0', sizeof(header->target)) != nullptr &&
+         header->target[0] != '\0';
+    if (ok) {
+        target->assign(header->target);
+        *offset = static_cast<long>(header->offset.load(std::memory_order_relaxed));
+        data->assign(static_cast<const char*>(memory) + kHeaderSize, length);
+    }
+    munmap(memory, static_cast<size_t>(st.st_size));
+    return ok;
+}
+
+bool PendingBuffer::fits(size_t length) const {
+    return !mapped() || size_ + length <= mappedSize_ - kHeaderSize;
+}
+
+void PendingBuffer::begin(const std::string& target, long offset) {
+    if (!mapped()) {
+        return;
+    }
+    Header* header = headerOf(memory_);
+    size_t n = std::min(target.size(), sizeof(header->target) - 1);
+    std::memcpy(header->target, target.data(), n);
+    header->target[n] = '\0';
+    header->offset.store(offset, std::memory_order_relaxed);
+}
+
+void PendingBuffer::append(const char* data, size_t length) {
+    if (!mapped()) {
+        heap_.append(data, length);
+        return;
+    }
+    std::memcpy(static_cast<char*>(memory_) + kHeaderSize + size_, data, length);
+    size_ += length;
+}
+
+void PendingBuffer::publish() {
+    if (mapped()) {
+        headerOf(memory_)->length.store(size_, std::memory_order_release);
+    }
+}
+
+void PendingBuffer::clear() {
+    if (!mapped()) {
+        heap_.clear();
+        return;
+    }
+    headerOf(memory_)->length.store(0, std::memory_order_release);
+    size_ = 0;
+}
+
+void PendingBuffer::reserve(size_t capacity) {
+    if (!mapped()) {
+        heap_.reserve(capacity);
+    }
+}
+
+const char* PendingBuffer::data() const {
+    return mapped() ? static_cast<const char*>(memory_) + kHeaderSize : heap_.data();
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// The rendered bytes the logger holds until its next flush. Normally a plain
+// string; once map()ped they live in a shared file mapping instead, which
+// the kernel keeps when the process dies, so a later run can recover() what
+// never reached the log. Next to the bytes the mapping notes which file they
+// belong to and at what offset, which makes writing them out idempotent.
+class PendingBuffer {
+public:
+    PendingBuffer() = default;
+    ~PendingBuffer();
+    PendingBuffer(const PendingBuffer&) = delete;
+    PendingBuffer& operator=(const PendingBuffer&) = delete;
+
+    // Moves the (empty) buffer into path, with room for capacity bytes.
+    // drainOnSignal also writes it out from a SIGSEGV, SIGBUS, SIGILL, SIGFPE
+    // or SIGABRT handler before the previous disposition runs. Returns false,
+    // staying in memory, if path cannot be mapped.
+    bool map(const std::string& path, size_t capacity, bool drainOnSignal);
+    void unmap();
+    bool mapped() const { return memory_ != nullptr; }
+
+    // What a run that used path left unflushed: the file the bytes belong
+    // to, their offset in it, and the bytes. False if there is nothing.
+    static bool recover(const std::string& path, std::string* target, long* offset,
+                        std::string* data);
+
+    // A mapped buffer is full; the in-memory one never is.
+    bool fits(size_t length) const;
+    // Called before the first append of a batch bound for target at offset.
+    void begin(const std::string& target, long offset);
+    void append(const char* data, size_t length);
+    // Appended bytes only count for recovery from here on; the logger calls
+    // it once a whole record is in.
+    void publish();
+    void clear();
+    void reserve(size_t capacity);
+
+    const char* data() const;
+    size_t size() const { return mapped() ? size_ : heap_.size(); }
+    bool empty() const { return size() == 0; }
+
+private:
+    std::string heap_;
+    void* memory_ = nullptr;
+    size_t mappedSize_ = 0;
+    size_t size_ = 0;
+    bool draining_ = false;
+};
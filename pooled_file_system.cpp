@@ -0,0 +1,154 @@
+#include "pooled_file_system.h"
+#include <algorithm>
+
+class PooledFileSystem::PooledHandle : public FileHandle {
+public:
+    PooledHandle(PooledFileSystem* pool, const std::string& path) : pool_(pool), path_(path) {}
+
+    ~PooledHandle() override {
+        std::lock_guard<std::mutex> lock(pool_->mutex_);
+        pool_->release(this);
+    }
+
+    bool write(const char* data, size_t length) override {
+        std::lock_guard<std::mutex> lock(pool_->mutex_);
+        if (!pool_->acquire(this)) {
+            return false;
+        }
+        unsynced_ = true;
+        return file_->write(data, length);
+    }
+
+    bool sync() override {
+        std::lock_guard<std::mutex> lock(pool_->mutex_);
+        // Closing did not sync; a reopened descriptor syncs the same file.
+        if (!unsynced_) {
+            return true;
+        }
+        if (!pool_->acquire(this)) {
+            return false;
+        }
+        unsynced_ = false;
+        return file_->sync();
+    }
+
+private:
+    friend class PooledFileSystem;
+
+    PooledFileSystem* pool_;
+    std::string path_;
+    std::unique_ptr<FileHandle> file_;
+    std::list<PooledHandle*>::iterator position_;
+    bool opened_ = false;
+    bool unsynced_ = false;
+};
+
+PooledFileSystem::PooledFileSystem(std::shared_ptr<FileSystemInterface> inner, size_t maxOpen)
+    : inner_(std::move(inner)), maxOpen_(std::max<size_t>(maxOpen, 1)) {}
+
+bool PooledFileSystem::createDirectory(const std::string& path) {
+    return inner_->createDirectory(path);
+}
+
+bool PooledFileSystem::fileExists(const std::string& path) {
+    return inner_->fileExists(path);
+}
+
+long PooledFileSystem::getFileSize(const std::string& path) {
+    return inner_->getFileSize(path);
+}
+
+bool PooledFileSystem::removeFile(const std::string& path) {
+    return inner_->removeFile(path);
+}
+
+bool PooledFileSystem::renameFile(const std::string& from, const std::string& to) {
+    return inner_->renameFile(from, to);
+}
+
+bool PooledFileSystem::copyFile(const std::string& from, const std::string& to) {
+    return inner_->copyFile(from, to);
+}
+
+bool PooledFileSystem::writeToFile(const std::string& path, const std::string& content,
+                                   bool append) {
+    return inner_->writeToFile(path, content, append);
+}
+
+bool PooledFileSystem::readFile(const std::string& path, std::string* content) {
+    return inner_->readFile(path, content);
+}
+
+bool PooledFileSystem::transferFile(const std::string& from, const std::string& to,
+                                    bool immutable, long length, CopyResult* result) {
+    return inner_->transferFile(from, to, immutable, length, result);
+}
+
+bool PooledFileSystem::linkFile(const std::string& from, const std::string& to) {
+    return inner_->linkFile(from, to);
+}
+
+bool PooledFileSystem::compressFile(const std::string& from, const std::string& to, int level) {
+    return inner_->compressFile(from, to, level);
+}
+
+bool PooledFileSystem::recoverFile(const std::string& path) {
+    return inner_->recoverFile(path);
+}
+
+bool PooledFileSystem::listDirectory(const std::string& path, std::vector<std::string>* names) {
+    return inner_->listDirectory(path, names);
+}
+
+bool PooledFileSystem::contentId(const std::string& path, std::string* id) {
+    return inner_->contentId(path, id);
+}
+
+std::unique_ptr<FileHandle> PooledFileSystem::openForAppend(const std::string& path) {
+    std::unique_ptr<PooledHandle> handle(new PooledHandle(this, path));
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!acquire(handle.get())) {
+        return nullptr;
+    }
+    return handle;
+}
+
+size_t PooledFileSystem::openCount() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return open_.size();
+}
+
+size_t PooledFileSystem::reopens() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return reopens_;
+}
+
+bool PooledFileSystem::acquire(PooledHandle* handle) {
+    if (handle->file_) {
+        open_.splice(open_.begin(), open_, handle->position_);
+        return true;
+    }
+    while (open_.size() >= maxOpen_) {
+        PooledHandle* victim = open_.back();
+        open_.pop_back();
+        victim->file_.reset();
+    }
+    handle->file_ = inner_->openForAppend(handle->path_);
+    if (!handle->file_) {
+        return false;
+    }
+    if (handle->opened_) {
+        ++reopens_;
+    }
+    handle->opened_ = true;
+    open_.push_front(handle);
+    handle->position_ = open_.begin();
+    return true;
+}
+
+void PooledFileSystem::release(PooledHandle* handle) {
+    if (handle->file_) {
+        open_.erase(handle->position_);
+        handle->file_.reset();
+    }
+}
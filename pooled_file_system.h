@@ -0,0 +1,55 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include "file_system_interface.h"
+
+// Forwards to another file system but keeps at most maxOpen of its append
+// handles open. The handles it returns stay usable; the least recently
+// written ones are closed underneath them and reopened by path on their next
+// write or sync. A file must therefore not be renamed while a handle to it
+// is alive, which Logger already ensures by closing the active file before
+// rotating. Handle calls share one mutex, so this suits a single writer such
+// as LogRegistry's rather than many threads writing at once.
+class PooledFileSystem : public FileSystemInterface {
+public:
+    PooledFileSystem(std::shared_ptr<FileSystemInterface> inner, size_t maxOpen);
+    // Handles must not outlive the pool.
+    ~PooledFileSystem() override = default;
+
+    bool createDirectory(const std::string& path) override;
+    bool fileExists(const std::string& path) override;
+    long getFileSize(const std::string& path) override;
+    bool removeFile(const std::string& path) override;
+    bool renameFile(const std::string& from, const std::string& to) override;
+    bool copyFile(const std::string& from, const std::string& to) override;
+    bool writeToFile(const std::string& path, const std::string& content, bool append = true) override;
+    bool readFile(const std::string& path, std::string* content) override;
+    bool transferFile(const std::string& from, const std::string& to, bool immutable, long length,
+                      CopyResult* result) override;
+    bool linkFile(const std::string& from, const std::string& to) override;
+    bool compressFile(const std::string& from, const std::string& to, int level) override;
+    bool recoverFile(const std::string& path) override;
+    bool listDirectory(const std::string& path, std::vector<std::string>* names) override;
+    bool contentId(const std::string& path, std::string* id) override;
+    std::unique_ptr<FileHandle> openForAppend(const std::string& path) override;
+
+    // Handles of the wrapped file system open right now.
+    size_t openCount() const;
+    // Times a handle had to be opened again after being closed for another.
+    size_t reopens() const;
+
+private:
+    class PooledHandle;
+
+    // With mutex_ held: makes sure handle has its file open and marks it
+    // most recently used.
+    bool acquire(PooledHandle* handle);
+    void release(PooledHandle* handle);
+
+    std::shared_ptr<FileSystemInterface> inner_;
+    const size_t maxOpen_;
+    mutable std::mutex mutex_;
+    // Most recently used first.
+    std::list<PooledHandle*> open_;
+    size_t reopens_ = 0;
+};
@@ -0,0 +1,81 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Token buckets in a fixed table indexed by key, one atomic word per bucket:
+// the word holds the time at which the bucket would be full again (the
+// generic cell rate algorithm), so a check is a load and, when it passes,
+// one CAS. Keys that collide share a bucket.
+class RateLimiter {
+public:
+    RateLimiter(double perSecond, double burst, size_t buckets)
+        : interval_(static_cast<int64_t>(1e9 / perSecond)),
+          tolerance_(static_cast<int64_t>((std::max(burst, 1.0) - 1) * 1e9 / perSecond)),
+          mask_(roundUpPowerOfTwo(std::max<size_t>(buckets, 1)) - 1),
+          buckets_(new std::atomic<int64_t>[mask_ + 1]) {
+        for (size_t i = 0; i <= mask_; ++i) {
+            buckets_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    // Takes a token from key's bucket; false if it is empty. now is in
+    // nanoseconds on any monotonic clock.
+    bool allow(uint64_t key, int64_t now) {
+        std::atomic<int64_t>& bucket = buckets_[mix(key) & mask_];
+        int64_t full = bucket.load(std::memory_order_relaxed);
+        for (;;) {
+            int64_t start = std::max(full, now);
+            if (start - now > tolerance_) {
+                return false;
+            }
+            if (bucket.compare_exchange_weak(full, start + interval_, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+    bool allow(uint64_t key) {
+        return allow(key, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now().time_since_epoch())
+                              .count());
+    }
+
+    // FNV-1a, for keying by message text.
+    static uint64_t hash(const char* data, size_t length) {
+        uint64_t h = 14695981039346656037ull;
+        for (size_t i = 0; i < length; ++i) {
+            h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+        }
+        return h;
+    }
+
+private:
+    // Spreads keys that differ only in their low or high bits, such as
+    // pointers and small ids.
+    static uint64_t mix(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        return key;
+    }
+
+    static size_t roundUpPowerOfTwo(size_t n) {
+        size_t p = 1;
+        while (p < n) {
+            p <<= 1;
+        }
+        return p;
+    }
+
+    const int64_t interval_;
+    const int64_t tolerance_;
+    const size_t mask_;
+    std::unique_ptr<std::atomic<int64_t>[]> buckets_;
+};
@@ -1,7 +1,174 @@
 #include "real_file_system.h"
+#include <dirent.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <cerrno>
 #include <fstream>
+#include <iterator>
 #include <cstdio>
+#include <cstring>
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+namespace {
+
+bool writeAll(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = ::write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        length -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+class FdFileHandle : public FileHandle {
+public:
+    explicit FdFileHandle(int fd) : fd_(fd) {}
+    ~FdFileHandle() override { close(fd_); }
+
+    bool write(const char* data, size_t length) override { return writeAll(fd_, data, length); }
+
+    bool sync() override {
+#if defined(__linux__)
+        return fdatasync(fd_) == 0;
+#else
+        return fsync(fd_) == 0;
+#endif
+    }
+
+private:
+    int fd_;
+};
+
+// The source ending before length bytes (it was truncated) is a failure;
+// *moved says how far the copy got either way.
+bool streamCopy(int src, int dst, long length, long* moved) {
+    *moved = 0;
+    // Start over in case a faster strategy gave up half way.
+    if (ftruncate(dst, 0) != 0 || lseek(dst, 0, SEEK_SET) != 0) {
+        return false;
+    }
+    char buffer[64 * 1024];
+    off_t offset = 0;
+    while (length > 0) {
+        size_t chunk = length < static_cast<long>(sizeof(buffer)) ? static_cast<size_t>(length)
+                                                                   : sizeof(buffer);
+        ssize_t n = pread(src, buffer, chunk, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        if (!writeAll(dst, buffer, static_cast<size_t>(n))) {
+            return false;
+        }
+        offset += n;
+        *moved = offset;
+        length -= n;
+    }
+    return true;
+}
+
+bool deflateFd(int src, int dst, int level) {
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    // 16 + MAX_WBITS selects the gzip wrapper so gzip/zcat can read the output.
+    if (deflateInit2(&stream, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    unsigned char in[64 * 1024];
+    unsigned char out[64 * 1024];
+    bool ok = true;
+    int flush = Z_NO_FLUSH;
+    while (ok && flush != Z_FINISH) {
+        ssize_t n = ::read(src, in, sizeof(in));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+        stream.next_in = in;
+        stream.avail_in = static_cast<uInt>(n);
+        do {
+            stream.next_out = out;
+            stream.avail_out = sizeof(out);
+            deflate(&stream, flush);
+            size_t produced = sizeof(out) - stream.avail_out;
+            if (!writeAll(dst, reinterpret_cast<const char*>(out), produced)) {
+                ok = false;
+                break;
+            }
+        } while (stream.avail_out == 0);
+    }
+    deflateEnd(&stream);
+    return ok;
+}
+
+#if defined(__linux__)
+// Returns 1 once all length bytes are copied, 0 if the kernel or file system
+// cannot do it (so the caller should try the next strategy) and -1 on a real
+// error, including the source ending early. *moved is the bytes copied.
+int copyRange(int src, int dst, long length, long* moved) {
+    loff_t in = 0;
+    loff_t out = 0;
+    *moved = 0;
+    while (length > 0) {
+        ssize_t n = copy_file_range(src, &in, dst, &out, static_cast<size_t>(length), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            bool unsupported = errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                               errno == EOPNOTSUPP;
+            return in == 0 && unsupported ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        *moved = in;
+        length -= n;
+    }
+    return 1;
+}
+
+int sendFile(int src, int dst, long length, long* moved) {
+    off_t offset = 0;
+    *moved = 0;
+    while (length > 0) {
+        ssize_t n = sendfile(dst, src, &offset, static_cast<size_t>(length));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return offset == 0 && (errno == EINVAL || errno == ENOSYS) ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        *moved = offset;
+        length -= n;
+    }
+    return 1;
+}
+#endif
+
+}  // namespace
 
 bool RealFileSystem::createDirectory(const std::string& path) {
     return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
@@ -26,12 +193,194 @@ bool RealFileSystem::renameFile(const std::string& from, const std::string& to)
 }
 
 bool RealFileSystem::copyFile(const std::string& from, const std::string& to) {
-    std::ifstream src(from, std::ios::binary);
-    std::ofstream dst(to, std::ios::binary);
-    return src.is_open() && dst.is_open() && (dst << src.rdbuf()).good();
+    return transferFile(from, to, false, -1, nullptr);
+}
+
+bool RealFileSystem::transferFile(const std::string& from, const std::string& to, bool immutable,
+                                  long length, CopyResult* result) {
+    CopyResult local;
+    CopyResult& report = result ? *result : local;
+    report = CopyResult();
+
+    int src = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(src, &st) != 0) {
+        close(src);
+        return false;
+    }
+    bool whole = length < 0 || length >= st.st_size;
+    if (whole) {
+        length = st.st_size;
+    }
+
+    // to may be a hardlink an earlier transfer left; truncating it would
+    // truncate from as well.
+    unlink(to.c_str());
+    int dst = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dst < 0) {
+        close(src);
+        return false;
+    }
+
+    bool ok = false;
+#if defined(__linux__)
+    if (whole && ioctl(dst, FICLONE, src) == 0) {
+        report.strategy = CopyStrategy::Reflink;
+        ok = true;
+    }
+#endif
+    if (!ok && whole && immutable) {
+        close(dst);
+        dst = -1;
+        if (unlink(to.c_str()) == 0 && link(from.c_str(), to.c_str()) == 0) {
+            report.strategy = CopyStrategy::Hardlink;
+            ok = true;
+        } else {
+            dst = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (dst < 0) {
+                close(src);
+                return false;
+            }
+        }
+    }
+    // A copy that stops short of length falls through to the next strategy;
+    // if the source really has shrunk, the stream copy fails as well.
+#if defined(__linux__)
+    if (!ok) {
+        int copied = copyRange(src, dst, length, &report.bytesMoved);
+        if (copied > 0) {
+            report.strategy = CopyStrategy::CopyFileRange;
+            ok = true;
+        } else if (copied == 0) {
+            copied = sendFile(src, dst, length, &report.bytesMoved);
+            if (copied > 0) {
+                report.strategy = CopyStrategy::Sendfile;
+                ok = true;
+            }
+        }
+    }
+#endif
+    if (!ok && streamCopy(src, dst, length, &report.bytesMoved)) {
+        report.strategy = CopyStrategy::Stream;
+        ok = true;
+    }
+
+    close(src);
+    if (dst >= 0) {
+        close(dst);
+    }
+    return ok;
 }
 
 bool RealFileSystem::writeToFile(const std::string& path, const std::string& content, bool append) {
     std::ofstream file(path, append ? std::ios::app : std::ios::trunc);
     return file.is_open() && (file << content << std::endl).good();
 }
+
+bool RealFileSystem::readFile(const std::string& path, std::string* content) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    content->assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+bool RealFileSystem::linkFile(const std::string& from, const std::string& to) {
+    unlink(to.c_str());
+    return link(from.c_str(), to.c_str()) == 0;
+}
+
+bool RealFileSystem::compressFile(const std::string& from, const std::string& to, int level) {
+    int src = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+        return false;
+    }
+    int dst = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dst < 0) {
+        close(src);
+        return false;
+    }
+    bool ok = deflateFd(src, dst, level);
+    close(src);
+    return close(dst) == 0 && ok;
+}
+
+std::unique_ptr<FileHandle> RealFileSystem::openForAppend(const std::string& path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return nullptr;
+    }
+    return std::unique_ptr<FileHandle>(new FdFileHandle(fd));
+}
+
+bool RealFileSystem::listDirectory(const std::string& path, std::vector<std::string>* names) {
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        return false;
+    }
+    while (dirent* entry = readdir(dir)) {
+        if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0) {
+            names->push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    return true;
+}
+
+bool RealFileSystem::contentId(const std::string& path, std::string* id) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+#if defined(__APPLE__)
+    long modifiedNs =
+        static_cast<long>(st.st_mtimespec.tv_sec) * 1000000000L + st.st_mtimespec.tv_nsec;
+#else
+    long modifiedNs = static_cast<long>(st.st_mtim.tv_sec) * 1000000000L + st.st_mtim.tv_nsec;
+#endif
+    FileKey key(static_cast<unsigned long>(st.st_dev), static_cast<unsigned long>(st.st_ino),
+                static_cast<long>(st.st_size), modifiedNs);
+    {
+        std::lock_guard<std::mutex> lock(idsMutex_);
+        auto found = ids_.find(key);
+        if (found != ids_.end()) {
+            close(fd);
+            *id = found->second;
+            return true;
+        }
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    bool ok = true;
+    if (size == 0) {
+        *id = contentIdOf("", 0);
+    } else {
+        void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ok = false;
+        } else {
+            *id = contentIdOf(static_cast<const char*>(data), size);
+            munmap(data, size);
+        }
+    }
+    close(fd);
+    if (ok) {
+        std::lock_guard<std::mutex> lock(idsMutex_);
+        // One entry per segment ever backed up; start over rather than grow
+        // without bound in a long-lived process.
+        if (ids_.size() >= 4096) {
+            ids_.clear();
+        }
+        ids_[key] = *id;
+    }
+    return ok;
+}
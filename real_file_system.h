@@ -1,4 +1,7 @@
 #pragma once
+#include <map>
+#include <mutex>
+#include <tuple>
 #include "file_system_interface.h"
 
 class RealFileSystem : public FileSystemInterface {
@@ -10,4 +13,19 @@ public:
     bool renameFile(const std::string& from, const std::string& to) override;
     bool copyFile(const std::string& from, const std::string& to) override;
     bool writeToFile(const std::string& path, const std::string& content, bool append = true) override;
+    bool readFile(const std::string& path, std::string* content) override;
+    bool transferFile(const std::string& from, const std::string& to, bool immutable, long length,
+                      CopyResult* result) override;
+    bool linkFile(const std::string& from, const std::string& to) override;
+    bool compressFile(const std::string& from, const std::string& to, int level) override;
+    std::unique_ptr<FileHandle> openForAppend(const std::string& path) override;
+    bool listDirectory(const std::string& path, std::vector<std::string>* names) override;
+    // Hashes each file once: ids are remembered by device, inode, size and
+    // modification time, which renames along the segment chain keep.
+    bool contentId(const std::string& path, std::string* id) override;
+
+private:
+    typedef std::tuple<unsigned long, unsigned long, long, long> FileKey;
+    std::mutex idsMutex_;
+    std::map<FileKey, std::string> ids_;
 };
@@ -0,0 +1,101 @@
+#include "shared_writer.h"
+#include <algorithm>
+#include <chrono>
+#include "logger.h"
+
+SharedWriter::SharedWriter(const SharedWriterOptions& options)
+    : options_(options),
+      terminal_(options.terminal.enabled ? std::make_shared<TerminalSink>(options.terminal)
+                                         : nullptr),
+      thread_(&SharedWriter::run, this) {}
+
+SharedWriter::~SharedWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.notify_one();
+    thread_.join();
+}
+
+std::shared_ptr<WorkerPool> SharedWriter::compressors() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!compressors_ && options_.compressionWorkers > 0) {
+        compressors_ = std::make_shared<WorkerPool>(options_.compressionWorkers);
+    }
+    return compressors_;
+}
+
+size_t SharedWriter::attached() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return loggers_.size();
+}
+
+void SharedWriter::attach(Logger* logger) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        loggers_.push_back(logger);
+    }
+    wake();
+}
+
+void SharedWriter::detach(Logger* logger) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    loggers_.erase(std::remove(loggers_.begin(), loggers_.end(), logger), loggers_.end());
+    std::replace(pass_.begin(), pass_.end(), logger, static_cast<Logger*>(nullptr));
+    idle_.wait(lock, [&] { return current_ != logger; });
+}
+
+void SharedWriter::wake() {
+    pending_.store(true);
+    if (sleeping_.load()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wakeup_.notify_one();
+    }
+}
+
+bool SharedWriter::claimRotation() {
+    // Final drains run on the logger's own thread and are not scheduled.
+    if (std::this_thread::get_id() != thread_.get_id()) {
+        return true;
+    }
+    if (rotationsLeft_ <= 0) {
+        return false;
+    }
+    --rotationsLeft_;
+    return true;
+}
+
+void SharedWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t start = 0;
+    while (!stopping_) {
+        pending_.store(false);
+        rotationsLeft_ = options_.maxRotationsPerPass;
+        pass_.assign(loggers_.begin(), loggers_.end());
+        size_t drained = 0;
+        auto timeout = std::chrono::milliseconds(50);
+        for (size_t i = 0; i < pass_.size(); ++i) {
+            Logger* logger = pass_[(start + i) % pass_.size()];
+            if (!logger) {
+                continue;
+            }
+            current_ = logger;
+            lock.unlock();
+            drained += logger->writerStep(false);
+            timeout = std::min(timeout, logger->writerTimeout());
+            lock.lock();
+            current_ = nullptr;
+            idle_.notify_all();
+        }
+        if (!pass_.empty()) {
+            start = (start + 1) % pass_.size();
+        }
+        if (drained > 0) {
+            continue;
+        }
+        sleeping_.store(true);
+        wakeup_.wait_for(lock, timeout, [this] { return stopping_ || pending_.load(); });
+        sleeping_.store(false);
+    }
+}
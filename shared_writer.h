@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "logger_options.h"
+#include "terminal_sink.h"
+#include "worker_pool.h"
+
+class Logger;
+
+struct SharedWriterOptions {
+    // Rotations one pass over the attached loggers may start. The others
+    // append one more message and rotate on the next pass regardless, so
+    // loggers that fill up together rotate one after another instead of
+    // all at once.
+    int maxRotationsPerPass = 1;
+    // Threads compressing rotated segments for every attached logger that
+    // enables compression; started on first use.
+    int compressionWorkers = 1;
+    TerminalOptions terminal;
+};
+
+// One thread doing the file I/O of many async loggers (set as
+// LoggerOptions::writer). Each pass drains up to maxBatchMessages from every
+// attached logger's queue, starting one logger further along each time, and
+// sleeps once a pass finds nothing to do. The loggers also share its
+// terminal sink and compression pool. See LogRegistry.
+class SharedWriter {
+public:
+    explicit SharedWriter(const SharedWriterOptions& options = SharedWriterOptions());
+    // Every logger must have been destroyed or re-initialised without it.
+    ~SharedWriter();
+    SharedWriter(const SharedWriter&) = delete;
+    SharedWriter& operator=(const SharedWriter&) = delete;
+
+    // Null when SharedWriterOptions::terminal is not enabled.
+    const std::shared_ptr<TerminalSink>& terminal() const { return terminal_; }
+    std::shared_ptr<WorkerPool> compressors();
+    size_t attached() const;
+
+private:
+    friend class Logger;
+
+    void attach(Logger* logger);
+    // Returns once the thread is no longer working for logger.
+    void detach(Logger* logger);
+    void wake();
+    // Asked by the writer thread before it rotates a segment.
+    bool claimRotation();
+    void run();
+
+    const SharedWriterOptions options_;
+    std::shared_ptr<TerminalSink> terminal_;
+    std::shared_ptr<WorkerPool> compressors_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::condition_variable idle_;
+    std::vector<Logger*> loggers_;
+    // The loggers of the running pass; detach() clears its entry.
+    std::vector<Logger*> pass_;
+    Logger* current_ = nullptr;
+    bool stopping_ = false;
+    std::atomic<bool> pending_{false};
+    std::atomic<bool> sleeping_{false};
+    int rotationsLeft_ = 0;
+    std::thread thread_;
+};
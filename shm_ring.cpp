@@ -0,0 +1,324 @@
+#include "shm_ring.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+const char kMagic[16] = "little-log-shm";
+const uint32_t kVersion = 2;
+const size_t kHeaderSize = 4096;
+// A slot's sequence while a producer fills it in: this bit and its pid.
+const uint64_t kClaimed = 1ull << 63;
+
+std::string objectName(const std::string& name) {
+    return name.compare(0, 1, "/") == 0 ? name : "/" + name;
+}
+}  // namespace
+
+struct ShmRing::Header {
+    char magic[16];
+    uint32_t version;
+    uint32_t slotSize;
+    uint64_t slots;
+    // Set last by the collector, once the slots are initialised.
+    std::atomic<uint32_t> ready;
+    alignas(64) std::atomic<uint64_t> enqueuePos;
+    // Only the collector moves it; kept here so the next collector resumes.
+    alignas(64) std::atomic<uint64_t> dequeuePos;
+};
+
+struct ShmRing::Slot {
+    // Same protocol as LogRing: position + 1 once published, position +
+    // capacity once the collector is done with it; kClaimed | pid in
+    // between.
+    std::atomic<uint64_t> sequence;
+    // Bytes of the record in this slot.
+    uint32_t length;
+    // Slots the record spans, in its first slot; 0 in the others.
+    uint32_t span;
+    uint32_t flags;
+    LogStamp stamp;
+    char data[kSlotSize - 40];
+};
+
+std::unique_ptr<ShmRing> ShmRing::create(const std::string& name, size_t slots) {
+    uint64_t count = 64;
+    while (count < slots) {
+        count <<= 1;
+    }
+    size_t size = kHeaderSize + count * kSlotSize;
+    int fd = shm_open(objectName(name).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    bool existing = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == size;
+    if (!existing && ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+
+    Header* header = static_cast<Header*>(memory);
+    if (!existing || header->ready.load(std::memory_order_acquire) != 1 ||
+        std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+        header->version != kVersion || header->slotSize != kSlotSize || header->slots != count) {
+        header->ready.store(0, std::memory_order_relaxed);
+        std::memcpy(header->magic, kMagic, sizeof(kMagic));
+        header->version = kVersion;
+        header->slotSize = kSlotSize;
+        header->slots = count;
+        header->enqueuePos.store(0, std::memory_order_relaxed);
+        header->dequeuePos.store(0, std::memory_order_relaxed);
+        char* base = static_cast<char*>(memory) + kHeaderSize;
+        for (uint64_t i = 0; i < count; ++i) {
+            Slot* slot = reinterpret_cast<Slot*>(base + i * kSlotSize);
+            slot->sequence.store(i, std::memory_order_relaxed);
+        }
+        header->ready.store(1, std::memory_order_release);
+    }
+    return std::unique_ptr<ShmRing>(new ShmRing(memory, size));
+}
+
+std::unique_ptr<ShmRing> ShmRing::attach(const std::string& name) {
+    int fd = shm_open(objectName(name).c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < kHeaderSize) {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    Header* header = static_cast<Header*>(memory);
+    if (header->ready.load(std::memory_order_acquire) != 1 ||
+        std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+        header->version != kVersion || header->slotSize != kSlotSize || header->slots == 0 ||
+        (header->slots & (header->slots - 1)) != 0 ||
+        size != kHeaderSize + header->slots * kSlotSize) {
+        munmap(memory, size);
+        return nullptr;
+    }
+    return std::unique_ptr<ShmRing>(new ShmRing(memory, size));
+}
+
+bool ShmRing::remove(const std::string& name) {
+    return shm_unlink(objectName(name).c_str()) == 0;
+}
+
+ShmRing::ShmRing(void* memory, size_t size)
+    : memory_(memory),
+      size_(size),
+      header_(static_cast<Header*>(memory)),
+      slots_(static_cast<char*>(memory) + kHeaderSize),
+      mask_(header_->slots - 1),
+      pid_(static_cast<int32_t>(getpid())) {
+    static_assert(sizeof(Header) <= kHeaderSize, "ring header outgrew its page");
+    static_assert(sizeof(Slot) == kSlotSize, "slot layout changed");
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared counters need lock-free atomics");
+}
+
+ShmRing::~ShmRing() {
+    munmap(memory_, size_);
+}
+
+ShmRing::Slot& ShmRing::slot(uint64_t position) const {
+    return *reinterpret_cast<Slot*>(slots_ + (position & mask_) * kSlotSize);
+}
+
+size_t ShmRing::maxMessage() const {
+    return std::min<size_t>(capacity() / 2, 1024) * sizeof(Slot::data);
+}
+
+uint64_t ShmRing::pushed() const {
+    return header_->enqueuePos.load(std::memory_order_acquire);
+}
+
+uint64_t ShmRing::popped() const {
+    return header_->dequeuePos.load(std::memory_order_acquire);
+}
+
+bool ShmRing::tryPush(const char* data, size_t length, unsigned flags, const LogStamp& stamp) {
+    Reservation reservation;
+    return reserve(length, &reservation) && publish(reservation, data, flags, stamp);
+}
+
+bool ShmRing::reserve(size_t length, Reservation* reservation) {
+    const size_t payload = sizeof(Slot::data);
+    length = std::min(length, maxMessage());
+    uint64_t span = length == 0 ? 1 : (length + payload - 1) / payload;
+    uint64_t pos = header_->enqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+        // The collector frees slots in order, so if the last one is free
+        // for this lap all of them are.
+        uint64_t last = pos + span - 1;
+        uint64_t seq = slot(last).sequence.load(std::memory_order_acquire);
+        int64_t diff = static_cast<int64_t>(seq) - static_cast<int64_t>(last);
+        if (diff == 0) {
+            if (header_->enqueuePos.compare_exchange_weak(pos, pos + span,
+                                                          std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = header_->enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    reservation->position = pos;
+    reservation->span = span;
+    reservation->length = length;
+    return true;
+}
+
+bool ShmRing::publish(const Reservation& reservation, const char* data, unsigned flags,
+                      const LogStamp& stamp) {
+    const size_t payload = sizeof(Slot::data);
+    const uint64_t pos = reservation.position;
+    const uint64_t span = reservation.span;
+    const size_t length = reservation.length;
+    // The collector only takes back the oldest slot nobody has published, so
+    // the slots lost here come before every one claimed. Those are still
+    // published, and dropped by the collector as the rest of a record whose
+    // start it gave up on.
+    uint64_t first = span;
+    for (uint64_t i = 0; i < span; ++i) {
+        uint64_t expected = pos + i;
+        if (slot(pos + i).sequence.compare_exchange_strong(
+                expected, kClaimed | static_cast<uint32_t>(pid_), std::memory_order_acquire) &&
+            first == span) {
+            first = i;
+        }
+    }
+    for (uint64_t i = first; i < span; ++i) {
+        Slot& current = slot(pos + i);
+        size_t offset = static_cast<size_t>(i) * payload;
+        current.length = static_cast<uint32_t>(std::min(payload, length - offset));
+        current.span = i == 0 ? static_cast<uint32_t>(span) : 0;
+        current.flags = flags;
+        current.stamp = stamp;
+        std::memcpy(current.data, data + offset, current.length);
+        current.sequence.store(pos + i + 1, std::memory_order_release);
+    }
+    return first == 0;
+}
+
+bool ShmRing::next(const char** data, size_t* length, unsigned* flags, LogStamp* stamp) {
+    for (;;) {
+        uint64_t pos = header_->dequeuePos.load(std::memory_order_relaxed);
+        Slot& first = slot(pos);
+        uint64_t seq = first.sequence.load(std::memory_order_acquire);
+        if (!(seq & kClaimed) && seq > pos + 1) {
+            // Freed by a collector that stopped before moving past it.
+            header_->dequeuePos.store(pos + 1, std::memory_order_release);
+            continue;
+        }
+        if (seq != pos + 1) {
+            if (pos >= header_->enqueuePos.load(std::memory_order_acquire) ||
+                !deserted(pos, seq) || !reclaim(pos, seq)) {
+                return false;
+            }
+            ++abandoned_;
+            discard(pos, 1);
+            continue;
+        }
+
+        uint64_t span = first.span;
+        if (span == 0 || span > capacity() / 2) {
+            // The rest of a record whose first slot was given up on.
+            ++abandoned_;
+            discard(pos, 1);
+            continue;
+        }
+        uint64_t ready = 1;
+        uint64_t pending = 0;
+        while (ready < span) {
+            pending = slot(pos + ready).sequence.load(std::memory_order_acquire);
+            if (pending != pos + ready + 1) {
+                break;
+            }
+            ++ready;
+        }
+        if (ready < span) {
+            if (!deserted(pos + ready, pending) || !reclaim(pos + ready, pending)) {
+                return false;
+            }
+            // The producer died halfway through the record.
+            abandoned_ += ready + 1;
+            discard(pos, ready + 1);
+            continue;
+        }
+
+        waitingAt_ = ~0ull;
+        *flags = first.flags;
+        *stamp = first.stamp;
+        if (span == 1) {
+            *data = first.data;
+            *length = first.length;
+        } else {
+            record_.clear();
+            for (uint64_t i = 0; i < span; ++i) {
+                const Slot& part = slot(pos + i);
+                record_.append(part.data, part.length);
+            }
+            *data = record_.data();
+            *length = record_.size();
+        }
+        holding_ = span;
+        return true;
+    }
+}
+
+void ShmRing::release() {
+    discard(header_->dequeuePos.load(std::memory_order_relaxed), holding_);
+    holding_ = 0;
+}
+
+bool ShmRing::deserted(uint64_t position, uint64_t seq) {
+    if (seq & kClaimed) {
+        auto owner = static_cast<int32_t>(seq & 0xffffffff);
+        return owner != pid_ && kill(owner, 0) != 0 && errno == ESRCH;
+    }
+    // Reserved but not claimed: the producer crashed or stalled right after
+    // reserving; reclaim() settles the race with a late claim.
+    auto now = std::chrono::steady_clock::now();
+    if (waitingAt_ != position) {
+        waitingAt_ = position;
+        waitingSince_ = now;
+        return false;
+    }
+    return now - waitingSince_ >= std::chrono::seconds(2);
+}
+
+bool ShmRing::reclaim(uint64_t position, uint64_t seq) {
+    if (slot(position).sequence.compare_exchange_strong(seq, position + capacity(),
+                                                        std::memory_order_relaxed)) {
+        return true;
+    }
+    // Its producer claimed it after all.
+    waitingAt_ = ~0ull;
+    return false;
+}
+
+void ShmRing::discard(uint64_t position, uint64_t count) {
+    for (uint64_t i = 0; i < count; ++i) {
+        slot(position + i).sequence.store(position + i + capacity(), std::memory_order_release);
+    }
+    header_->dequeuePos.store(position + count, std::memory_order_release);
+    waitingAt_ = ~0ull;
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "line_prefix.h"
+
+// Multi-process log queue in a POSIX shared memory object: producers in any
+// number of processes reserve fixed-size slots with one compare-and-swap and
+// never make a system call; one collector takes the records out in order.
+// A record longer than a slot spans several consecutive ones. Published
+// records live in the shared object, not in the producer, so they survive
+// the producer crashing. A producer claims each of its slots by swapping its
+// pid into the slot's sequence, and the collector frees slots claimed by a
+// process that no longer exists, or reserved but left unclaimed for too
+// long, instead of waiting for them forever (producers and collector must
+// share a pid namespace).
+class ShmRing {
+public:
+    static const size_t kSlotSize = 256;
+
+    // Collector side: opens the object, creating it if needed. Records left
+    // by an earlier collector are kept, unless slots differs from the
+    // existing geometry; change that only while no producer is running.
+    // slots is rounded up to a power of two. Returns null on failure.
+    static std::unique_ptr<ShmRing> create(const std::string& name, size_t slots);
+    // Producer side: fails until a collector has created the object.
+    static std::unique_ptr<ShmRing> attach(const std::string& name);
+    static bool remove(const std::string& name);
+
+    ~ShmRing();
+    ShmRing(const ShmRing&) = delete;
+    ShmRing& operator=(const ShmRing&) = delete;
+
+    // Producers. Messages longer than maxMessage() are cut there; returns
+    // false if the ring is full or the record was given up on (see publish()).
+    bool tryPush(const char* data, size_t length, unsigned flags, const LogStamp& stamp);
+
+    // tryPush() in its two steps: reserve() takes the slots for a message of
+    // length bytes, publish() claims them and fills them in. If the
+    // producer stalls in between for long enough, the collector takes the
+    // slots back; publish() then leaves them alone and returns false.
+    struct Reservation {
+        uint64_t position = 0;
+        uint64_t span = 0;
+        size_t length = 0;
+    };
+    bool reserve(size_t length, Reservation* reservation);
+    bool publish(const Reservation& reservation, const char* data, unsigned flags,
+                 const LogStamp& stamp);
+
+    // Collector only. Calls consume(const char* data, size_t length,
+    // unsigned flags, const LogStamp&) with the oldest record; returns false
+    // if none is complete yet.
+    template <typename Consumer>
+    bool tryPop(Consumer&& consume) {
+        const char* data;
+        size_t length;
+        unsigned flags;
+        LogStamp stamp;
+        if (!next(&data, &length, &flags, &stamp)) {
+            return false;
+        }
+        consume(data, length, flags, static_cast<const LogStamp&>(stamp));
+        release();
+        return true;
+    }
+
+    size_t capacity() const { return static_cast<size_t>(mask_ + 1); }
+    size_t maxMessage() const;
+    // Slots reserved so far, and slots the collector is done with.
+    uint64_t pushed() const;
+    uint64_t popped() const;
+    // Slots the collector gave up on because their producer died.
+    uint64_t abandoned() const { return abandoned_; }
+
+private:
+    struct Header;
+    struct Slot;
+
+    ShmRing(void* memory, size_t size);
+    Slot& slot(uint64_t position) const;
+    bool next(const char** data, size_t* length, unsigned* flags, LogStamp* stamp);
+    void release();
+    // A slot at position was reserved but is not published (its sequence
+    // is seq): true once it is certain its producer will never publish it.
+    bool deserted(uint64_t position, uint64_t seq);
+    // Takes a deserted slot back unless its producer claims it first.
+    bool reclaim(uint64_t position, uint64_t seq);
+    void discard(uint64_t position, uint64_t count);
+
+    void* memory_;
+    size_t size_;
+    Header* header_;
+    char* slots_;
+    uint64_t mask_;
+    const int32_t pid_;
+
+    // Collector state: the record handed out by next(), reassembled when it
+    // spans several slots, and how long the head slot has been waited for.
+    std::string record_;
+    uint64_t holding_ = 0;
+    uint64_t waitingAt_ = ~0ull;
+    std::chrono::steady_clock::time_point waitingSince_;
+    uint64_t abandoned_ = 0;
+};
@@ -0,0 +1,196 @@
+#include "structured_log.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "log_scan.h"
+
+namespace {
+
+template <typename T>
+bool readValue(const char*& data, const char* end, T* value) {
+    if (static_cast<size_t>(end - data) < sizeof(T)) {
+        return false;
+    }
+    std::memcpy(value, data, sizeof(T));
+    data += sizeof(T);
+    return true;
+}
+
+void appendNumber(std::string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void appendNumber(std::string& out, const char* format, ...) {
+    char buffer[40];
+    va_list args;
+    va_start(args, format);
+    int n = std::vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (n > 0) {
+        out.append(buffer, std::min<size_t>(static_cast<size_t>(n), sizeof(buffer) - 1));
+    }
+}
+
+void appendDouble(std::string& out, double value) {
+    // JSON has no NaN or infinity.
+    if (!std::isfinite(value)) {
+        out += "null";
+        return;
+    }
+    // The shortest of the two that reads back as the same value.
+    char buffer[32];
+    int n = std::snprintf(buffer, sizeof(buffer), "%.15g", value);
+    if (std::strtod(buffer, nullptr) != value) {
+        n = std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+    }
+    out.append(buffer, static_cast<size_t>(n));
+}
+
+bool appendValue(std::string& out, char tag, const char*& data, const char* end) {
+    switch (tag) {
+    case 'i': {
+        int64_t value;
+        if (!readValue(data, end, &value)) {
+            return false;
+        }
+        appendNumber(out, "%lld", static_cast<long long>(value));
+        return true;
+    }
+    case 'u': {
+        uint64_t value;
+        if (!readValue(data, end, &value)) {
+            return false;
+        }
+        appendNumber(out, "%llu", static_cast<unsigned long long>(value));
+        return true;
+    }
+    case 'd': {
+        double value;
+        if (!readValue(data, end, &value)) {
+            return false;
+        }
+        appendDouble(out, value);
+        return true;
+    }
+    case 'b': {
+        uint8_t value;
+        if (!readValue(data, end, &value)) {
+            return false;
+        }
+        out += value ? "true" : "false";
+        return true;
+    }
+    case 's': {
+        uint32_t length;
+        if (!readValue(data, end, &length) || static_cast<size_t>(end - data) < length) {
+            return false;
+        }
+        structured_log::appendJsonString(out, data, length);
+        data += length;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+}  // namespace
+
+namespace structured_log {
+
+void appendJsonString(std::string& out, const char* data, size_t length) {
+    static const log_scan::Kernel kernel = log_scan::bestKernel();
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    while (length > 0) {
+        size_t run = log_scan::findJsonEscape(kernel, data, length);
+        out.append(data, run);
+        if (run == length) {
+            break;
+        }
+        unsigned char c = static_cast<unsigned char>(data[run]);
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default: {
+            char escaped[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+            out.append(escaped, sizeof(escaped));
+        }
+        }
+        data += run + 1;
+        length -= run + 1;
+    }
+    out += '"';
+}
+
+bool renderJson(const char* payload, size_t length, const LogStamp* stamp, LogLevel level,
+                unsigned prefixFields, std::string& out) {
+    size_t start = out.size();
+    const char* data = payload;
+    const char* end = payload + length;
+    uint16_t eventLength;
+    if (!readValue(data, end, &eventLength) || static_cast<size_t>(end - data) < eventLength) {
+        return false;
+    }
+    const char* event = data;
+    data += eventLength;
+    uint8_t count;
+    if (!readValue(data, end, &count)) {
+        return false;
+    }
+
+    out += '{';
+    if (stamp && (prefixFields & line_prefix::kTimestamp)) {
+        // The text prefix's timestamp, without its trailing space.
+        LinePrefixFormatter formatter;
+        char text[LinePrefixFormatter::kMaxSize];
+        size_t n = formatter.format(*stamp, level, line_prefix::kTimestamp, text);
+        out += "\"ts\":\"";
+        out.append(text, n > 0 ? n - 1 : 0);
+        out += "\",";
+    }
+    if (stamp && (prefixFields & line_prefix::kLevel)) {
+        out += "\"level\":\"";
+        out += logLevelName(level);
+        out += "\",";
+    }
+    if (stamp && (prefixFields & line_prefix::kThreadId)) {
+        appendNumber(out, "\"tid\":%u,", static_cast<unsigned>(stamp->threadId));
+    }
+    out += "\"event\":";
+    appendJsonString(out, event, eventLength);
+    for (uint8_t i = 0; i < count; ++i) {
+        uint8_t keyLength;
+        char tag;
+        if (!readValue(data, end, &keyLength) || static_cast<size_t>(end - data) < keyLength) {
+            out.resize(start);
+            return false;
+        }
+        out += ',';
+        appendJsonString(out, data, keyLength);
+        out += ':';
+        data += keyLength;
+        if (!readValue(data, end, &tag) || !appendValue(out, tag, data, end)) {
+            out.resize(start);
+            return false;
+        }
+    }
+    out += '}';
+    return true;
+}
+
+}  // namespace structured_log
@@ -0,0 +1,112 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#include "binary_log.h"
+#include "line_prefix.h"
+#include "log_level.h"
+
+// Key-value records: Logger::log(LogLevel::Info, "login", kv("user", id),
+// kv("ms", elapsed)). Field types are resolved at compile time, like the
+// arguments of LITTLE_LOG_BINARY, and the calling thread only copies the
+// values into a compact payload:
+//
+//   [event length:u16][event][field count:u8]
+//   per field: [key length:u8][key][tag:u8][value]
+//
+// with the values of binary_log ('i', 'u', 'd', 's') plus 'b' for bool.
+// The logger turns it into one JSON line in text segments, and stores it
+// as it is, in a binary_log::kKeyValue entry, in binary segments.
+namespace structured_log {
+
+template <typename T>
+struct ValueTraits : binary_log::ArgTraits<T> {};
+
+template <>
+struct ValueTraits<bool> {
+    static const char tag = 'b';
+    static size_t size(bool) { return 1; }
+    static void encode(char* out, bool value) { *out = value ? 1 : 0; }
+};
+
+#if __cplusplus >= 201703L
+template <>
+struct ValueTraits<std::string_view> : binary_log::StringArgTraits {
+    static size_t size(std::string_view value) { return encodedSize(value.size()); }
+    static void encode(char* out, std::string_view value) {
+        StringArgTraits::encode(out, value.data(), value.size());
+    }
+};
+#endif
+
+template <typename T>
+using ValueOf = ValueTraits<typename std::decay<T>::type>;
+
+template <typename T>
+struct Field {
+    const char* key;
+    const T& value;
+};
+
+// The value is referenced, not copied; use it within the log() call.
+template <typename T>
+Field<T> kv(const char* key, const T& value) {
+    return Field<T>{key, value};
+}
+
+inline size_t keyLength(const char* key) {
+    return std::min<size_t>(std::strlen(key), 0xff);
+}
+
+inline size_t fieldsSize() { return 0; }
+
+template <typename T, typename... Rest>
+size_t fieldsSize(const Field<T>& field, const Rest&... rest) {
+    return 1 + keyLength(field.key) + 1 + ValueOf<T>::size(field.value) + fieldsSize(rest...);
+}
+
+inline void encodeFields(char*) {}
+
+template <typename T, typename... Rest>
+void encodeFields(char* out, const Field<T>& field, const Rest&... rest) {
+    size_t length = keyLength(field.key);
+    *out++ = static_cast<char>(length);
+    std::memcpy(out, field.key, length);
+    out += length;
+    *out++ = ValueOf<T>::tag;
+    ValueOf<T>::encode(out, field.value);
+    encodeFields(out + ValueOf<T>::size(field.value), rest...);
+}
+
+template <typename... Fields>
+void encodeRecord(std::string& out, const char* event, const Fields&... fields) {
+    static_assert(sizeof...(Fields) <= 0xff, "too many fields in one record");
+    uint16_t eventLength = static_cast<uint16_t>(std::min<size_t>(std::strlen(event), 0xffff));
+    out.resize(sizeof(eventLength) + eventLength + 1 + fieldsSize(fields...));
+    char* data = &out[0];
+    std::memcpy(data, &eventLength, sizeof(eventLength));
+    data += sizeof(eventLength);
+    std::memcpy(data, event, eventLength);
+    data += eventLength;
+    *data++ = static_cast<char>(sizeof...(Fields));
+    encodeFields(data, fields...);
+}
+
+// Appends data as a quoted JSON string. The bytes that need escaping are
+// found with log_scan's SIMD kernels; everything else is copied in runs.
+void appendJsonString(std::string& out, const char* data, size_t length);
+
+// Appends a payload as one JSON object. With a stamp, the prefix fields
+// (line_prefix::kTimestamp, kLevel, kThreadId) come first as "ts", "level"
+// and "tid", then "event" and the fields in order. Returns false, appending
+// nothing, if the payload is malformed.
+bool renderJson(const char* payload, size_t length, const LogStamp* stamp, LogLevel level,
+                unsigned prefixFields, std::string& out);
+
+}  // namespace structured_log
+
+using structured_log::kv;
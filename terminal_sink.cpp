@@ -0,0 +1,80 @@
+#include "terminal_sink.h"
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+
+TerminalSink::TerminalSink(const TerminalOptions& options)
+    : fd_(options.fd),
+      capacity_(std::max<size_t>(options.bufferBytes, 1)),
+      policy_(options.policy),
+      thread_(&TerminalSink::run, this) {}
+
+TerminalSink::~TerminalSink() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    ready_.notify_one();
+    thread_.join();
+}
+
+bool TerminalSink::write(const char* data, size_t length, bool mayDrop) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // A line longer than the whole buffer still goes out, on its own.
+    auto fits = [&] { return buffer_.empty() || buffer_.size() + length <= capacity_; };
+    if (!fits()) {
+        if (mayDrop && policy_ == TerminalPolicy::Drop) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        space_.wait(lock, fits);
+    }
+    bool wake = buffer_.empty();
+    buffer_.append(data, length);
+    accepted_ += length;
+    lock.unlock();
+    if (wake) {
+        ready_.notify_one();
+    }
+    return true;
+}
+
+void TerminalSink::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    uint64_t target = accepted_;
+    written_.wait(lock, [&] { return done_ >= target; });
+}
+
+void TerminalSink::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        ready_.wait(lock, [this] { return stopping_ || !buffer_.empty(); });
+        if (buffer_.empty()) {
+            return;
+        }
+        writing_.swap(buffer_);
+        lock.unlock();
+        space_.notify_all();
+
+        size_t offset = 0;
+        while (offset < writing_.size()) {
+            ssize_t n = ::write(fd_, writing_.data() + offset, writing_.size() - offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                // The reader is gone; the rest of the batch is lost.
+                dropped_.fetch_add(std::count(writing_.begin() + static_cast<long>(offset),
+                                              writing_.end(), '\n'),
+                                   std::memory_order_relaxed);
+                break;
+            }
+            offset += static_cast<size_t>(n);
+        }
+
+        lock.lock();
+        done_ += writing_.size();
+        writing_.clear();
+        written_.notify_all();
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "logger_options.h"
+
+// Terminal output with its own buffer and writer thread. Callers append
+// whole lines; the thread hands everything buffered to write(fd) in one go,
+// so a slow reader on the other end of a pipe (journald, a container log
+// driver) only ever stalls that thread. Once bufferBytes are waiting, lines
+// are dropped or the caller blocks, depending on the policy.
+class TerminalSink {
+public:
+    explicit TerminalSink(const TerminalOptions& options = TerminalOptions());
+    // Writes out whatever is still buffered.
+    ~TerminalSink();
+    TerminalSink(const TerminalSink&) = delete;
+    TerminalSink& operator=(const TerminalSink&) = delete;
+
+    // data must end with '\n'. A line is only dropped when mayDrop is set and
+    // the policy is TerminalPolicy::Drop; returns false if it was.
+    bool write(const char* data, size_t length, bool mayDrop = true);
+    // Blocks until every line accepted so far has been written to the fd.
+    void flush();
+    // Lines dropped because the buffer was full or the fd failed.
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    void run();
+
+    const int fd_;
+    const size_t capacity_;
+    const TerminalPolicy policy_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable space_;
+    std::condition_variable written_;
+    std::string buffer_;
+    std::string writing_;
+    // Bytes accepted into buffer_ and bytes handed to the fd, since start.
+    uint64_t accepted_ = 0;
+    uint64_t done_ = 0;
+    bool stopping_ = false;
+    std::atomic<uint64_t> dropped_{0};
+    std::thread thread_;
+};
@@ -2,8 +2,64 @@
 #include <gmock/gmock.h>
 #include "logger.h"
 #include "real_file_system.h"
+#include "io_uring_file_system.h"
+#include "mapped_file_system.h"
+#include "pooled_file_system.h"
 #include "file_system_interface.h"
+#include "binary_log.h"
+#include "line_prefix.h"
+#include "log_index.h"
+#include "log_registry.h"
+#include "log_reader.h"
+#include "log_scan.h"
+#include "rate_limiter.h"
+#include "shm_ring.h"
+#include "structured_log.h"
+#include "terminal_sink.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <regex>
+#include <set>
 #include <sstream>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+// Counts the allocations made by the current thread while enabled; replaces
+// the global operator new for the whole test binary, library included.
+namespace {
+thread_local bool countingAllocations = false;
+thread_local long allocationCount = 0;
+}  // namespace
+
+void* operator new(std::size_t size) {
+    if (countingAllocations) {
+        ++allocationCount;
+    }
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
 
 class MockFileSystem : public FileSystemInterface {
 public:
@@ -43,6 +99,132 @@ protected:
     std::string testDir;
 };
 
+class SyncCountingFileSystem : public RealFileSystem {
+public:
+    std::unique_ptr<FileHandle> openForAppend(const std::string& path) override {
+        std::unique_ptr<FileHandle> inner = RealFileSystem::openForAppend(path);
+        if (!inner) {
+            return nullptr;
+        }
+        return std::unique_ptr<FileHandle>(new CountingHandle(std::move(inner), this));
+    }
+
+    std::atomic<int> writes{0};
+    std::atomic<int> syncs{0};
+
+private:
+    class CountingHandle : public FileHandle {
+    public:
+        CountingHandle(std::unique_ptr<FileHandle> inner, SyncCountingFileSystem* owner)
+            : inner_(std::move(inner)), owner_(owner) {}
+        bool write(const char* data, size_t length) override {
+            ++owner_->writes;
+            return inner_->write(data, length);
+        }
+        bool sync() override {
+            ++owner_->syncs;
+            return inner_->sync();
+        }
+
+    private:
+        std::unique_ptr<FileHandle> inner_;
+        SyncCountingFileSystem* owner_;
+    };
+};
+
+// transferFile() and compressFile() wait until release() is called, so
+// tests can stall a backup or a compression job half way.
+class StallingFileSystem : public RealFileSystem {
+public:
+    bool transferFile(const std::string& from, const std::string& to, bool immutable, long length,
+                      CopyResult* result) override {
+        stall();
+        return RealFileSystem::transferFile(from, to, immutable, length, result);
+    }
+
+    bool compressFile(const std::string& from, const std::string& to, int level) override {
+        stall();
+        return RealFileSystem::compressFile(from, to, level);
+    }
+
+    void waitForCopy() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return copies_ > 0; });
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        released_ = true;
+        cv_.notify_all();
+    }
+
+private:
+    void stall() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++copies_;
+        cv_.notify_all();
+        cv_.wait(lock, [this] { return released_; });
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    int copies_ = 0;
+    bool released_ = false;
+};
+
+// Writes wait until open() is called, so tests can stall the write path.
+class GatedFileSystem : public RealFileSystem {
+public:
+    std::unique_ptr<FileHandle> openForAppend(const std::string& path) override {
+        std::unique_ptr<FileHandle> inner = RealFileSystem::openForAppend(path);
+        if (!inner) {
+            return nullptr;
+        }
+        return std::unique_ptr<FileHandle>(new GatedHandle(std::move(inner), this));
+    }
+
+    void open() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            open_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    // Blocks until a write is waiting at the gate.
+    void waitForBlockedWrite() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return blocked_ > 0; });
+    }
+
+private:
+    class GatedHandle : public FileHandle {
+    public:
+        GatedHandle(std::unique_ptr<FileHandle> inner, GatedFileSystem* owner)
+            : inner_(std::move(inner)), owner_(owner) {}
+        bool write(const char* data, size_t length) override {
+            {
+                std::unique_lock<std::mutex> lock(owner_->mutex_);
+                ++owner_->blocked_;
+                owner_->cv_.notify_all();
+                owner_->cv_.wait(lock, [this] { return owner_->open_; });
+                --owner_->blocked_;
+            }
+            return inner_->write(data, length);
+        }
+        bool sync() override { return inner_->sync(); }
+
+    private:
+        std::unique_ptr<FileHandle> inner_;
+        GatedFileSystem* owner_;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool open_ = false;
+    int blocked_ = 0;
+};
+
 class IntegrationTest : public ::testing::Test {
 protected:
     void SetUp() override {
@@ -59,6 +241,46 @@ protected:
     std::string testDir;
 };
 
+static bool readGzip(const std::string& path, std::string* content) {
+    gzFile file = gzopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    char buffer[4096];
+    int n;
+    while ((n = gzread(file, buffer, sizeof(buffer))) > 0) {
+        content->append(buffer, static_cast<size_t>(n));
+    }
+    gzclose(file);
+    return n == 0;
+}
+
+// Reads a segment whether or not it has been compressed yet.
+static bool readSegment(const std::string& path, std::string* content) {
+    std::ifstream in(path);
+    if (in.is_open()) {
+        std::stringstream buffer;
+        buffer << in.rdbuf();
+        *content = buffer.str();
+        return true;
+    }
+    return readGzip(path + ".gz", content);
+}
+
+// Reads until fd has nothing more to give right now.
+static std::string readAvailable(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    std::string content;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        content.append(buffer, static_cast<size_t>(n));
+    }
+    fcntl(fd, F_SETFL, flags);
+    return content;
+}
+
 // Mock tests
 TEST_F(LoggerTest, InitCreatesDirectories) {
     EXPECT_CALL(*mockFs, createDirectory(::testing::_))
@@ -107,6 +329,31 @@ TEST_F(LoggerTest, LogMsgTriggersRotationWhenFileTooLarge) {
     logger->logMsg("large message");
 }
 
+TEST_F(LoggerTest, SequenceRotationRenamesOnlyTheManifest) {
+    using ::testing::_;
+    using ::testing::HasSubstr;
+    EXPECT_CALL(*mockFs, createDirectory(_))
+        .WillRepeatedly(::testing::Return(true));
+    EXPECT_CALL(*mockFs, getFileSize(_))
+        .WillOnce(::testing::Return(2 * 1024 * 1024));
+    EXPECT_CALL(*mockFs, fileExists(_)).Times(0);
+    EXPECT_CALL(*mockFs, removeFile(_)).Times(0);
+    EXPECT_CALL(*mockFs, writeToFile("./logs/test/test.manifest.tmp", "1 1", false))
+        .WillOnce(::testing::Return(true));
+    EXPECT_CALL(*mockFs, writeToFile("./logs/test/test.manifest.tmp", "1 2", false))
+        .WillOnce(::testing::Return(true));
+    EXPECT_CALL(*mockFs, renameFile("./logs/test/test.manifest.tmp", "./logs/test/test.manifest"))
+        .Times(2)
+        .WillRepeatedly(::testing::Return(true));
+    EXPECT_CALL(*mockFs, writeToFile("./logs/test/test.0000000002.log", "large message", true))
+        .WillOnce(::testing::Return(true));
+
+    LoggerOptions options;
+    options.rotation = RotationScheme::Sequence;
+    logger->init("test", "./logs", 1, 5, "./backup", 10, options);
+    logger->logMsg("large message");
+}
+
 TEST_F(LoggerTest, BackupCopiesFiles) {
     EXPECT_CALL(*mockFs, createDirectory(::testing::_))
         .WillRepeatedly(::testing::Return(true));
@@ -149,6 +396,30 @@ TEST_F(LoggerTest, BackupSkipsNonExistentFiles) {
     logger->backup();
 }
 
+TEST_F(LoggerTest, BackupReportsEachCopy) {
+    EXPECT_CALL(*mockFs, createDirectory(::testing::_))
+        .WillRepeatedly(::testing::Return(true));
+    EXPECT_CALL(*mockFs, fileExists(::testing::_))
+        .WillRepeatedly(::testing::Return(true));
+    EXPECT_CALL(*mockFs, getFileSize(::testing::_))
+        .WillRepeatedly(::testing::Return(1024));
+    EXPECT_CALL(*mockFs, copyFile(::testing::_, ::testing::_))
+        .WillOnce(::testing::Return(true))
+        .WillOnce(::testing::Return(false))
+        .WillRepeatedly(::testing::Return(true));
+
+    logger->init("test", "./logs", 1, 3, "./backup", 10);
+    BackupReport report = logger->backup();
+    ASSERT_EQ(3u, report.files.size());
+    EXPECT_EQ("./logs/test/test.log1", report.files[1].source);
+    EXPECT_EQ(report.directory + "/test.log1", report.files[1].destination);
+    EXPECT_EQ(CopyStrategy::None, report.files[1].strategy);
+    EXPECT_EQ(2, report.count(CopyStrategy::Stream));
+    EXPECT_EQ(1, report.failures);
+    EXPECT_EQ(3 * 1024, report.totalSize);
+    EXPECT_EQ(2 * 1024, report.bytesMoved);
+}
+
 TEST_F(LoggerTest, RotationWithMissingFiles) {
     EXPECT_CALL(*mockFs, createDirectory(::testing::_))
         .WillRepeatedly(::testing::Return(true));
@@ -167,6 +438,599 @@ TEST_F(LoggerTest, RotationWithMissingFiles) {
     logger->logMsg("message");
 }
 
+TEST_F(LoggerTest, LogMsgStatsOnlyAtInit) {
+    EXPECT_CALL(*mockFs, createDirectory(::testing::_))
+        .WillRepeatedly(::testing::Return(true));
+    EXPECT_CALL(*mockFs, getFileSize(::testing::_))
+        .Times(1)
+        .WillOnce(::testing::Return(0));
+    EXPECT_CALL(*mockFs, writeToFile(::testing::_, ::testing::_, true))
+        .Times(3)
+        .WillRepeatedly(::testing::Return(true));
+
+    logger->init("test", "./logs", 1, 5, "./backup", 10);
+    logger->logMsg("one");
+    logger->logMsg("two");
+    logger->logMsg("three");
+}
+
+TEST_F(LoggerTest, TrackedSizeTriggersRotation) {
+    EXPECT_CALL(*mockFs, createDirectory(::testing::_))
+        .WillRepeatedly(::testing::Return(true));
+    EXPECT_CALL(*mockFs, getFileSize(::testing::_))
+        .WillOnce(::testing::Return(1024 * 1024 - 6));
+    EXPECT_CALL(*mockFs, writeToFile(::testing::_, ::testing::_, true))
+        .WillRepeatedly(::testing::Return(true));
+    EXPECT_CALL(*mockFs, fileExists(::testing::_))
+        .WillRepeatedly(::testing::Return(false));
+    EXPECT_CALL(*mockFs, removeFile(::testing::_))
+        .Times(1)
+        .WillOnce(::testing::Return(true));
+
+    logger->init("test", "./logs", 1, 5, "./backup", 10);
+    logger->logMsg("abc");
+    logger->logMsg("abc");
+}
+
+TEST_F(LoggerTest, FlushPolicyBatchesBySize) {
+    LoggerOptions options;
+    options.flush.maxBufferedBytes = 16;
+    EXPECT_CALL(*mockFs, createDirectory(::testing::_))
+        .WillRepeatedly(::testing::Return(true));
+    EXPECT_CALL(*mockFs, getFileSize(::testing::_))
+        .WillOnce(::testing::Return(0));
+    EXPECT_CALL(*mockFs, writeToFile(::testing::_, "aaaa\nbbbb\ncccc\ndddd", true))
+        .WillOnce(::testing::Return(true));
+    EXPECT_CALL(*mockFs, writeToFile(::testing::_, "eeee", true))
+        .WillOnce(::testing::Return(true));
+
+    logger->init("test", "./logs", 1, 5, "./backup", 10, options);
+    logger->disableTerminal();
+    logger->logMsg("aaaa");
+    logger->logMsg("bbbb");
+    logger->logMsg("cccc");
+    logger->logMsg("dddd");
+    logger->logMsg("eeee");
+    logger->flush();
+}
+
+TEST_F(LoggerTest, LevelThresholdSkipsArgumentEvaluation) {
+    EXPECT_CALL(*mockFs, createDirectory(::testing::_))
+        .WillRepeatedly(::testing::Return(true));
+    EXPECT_CALL(*mockFs, getFileSize(::testing::_))
+        .WillOnce(::testing::Return(0));
+    EXPECT_CALL(*mockFs, writeToFile(::testing::_, "warn 1", true))
+        .WillOnce(::testing::Return(true));
+    EXPECT_CALL(*mockFs, writeToFile(::testing::_, "plain", true))
+        .WillOnce(::testing::Return(true));
+
+    LoggerOptions options;
+    options.minLevel = LogLevel::Info;
+    logger->init("test", "./logs", 1, 5, "./backup", 10, options);
+    logger->disableTerminal();
+    logger->setLevel(LogLevel::Warn);
+
+    int evaluated = 0;
+    auto build = [&evaluated](const char* text) {
+        ++evaluated;
+        return std::string(text) + " " + std::to_string(evaluated);
+    };
+    LITTLE_LOG_DEBUG(*logger, build("debug"));
+    LITTLE_LOG_INFO(*logger, build("info"));
+    LITTLE_LOG_WARN(*logger, build("warn"));
+    LITTLE_LOG_BINARY(*logger, "binary %d", build("binary").size());
+    logger->logMsg(LogLevel::Debug, "dropped");
+    logger->logMsg(LogLevel::Error, "plain");
+    EXPECT_EQ(1, evaluated);
+    EXPECT_EQ(LogLevel::Warn, logger->level());
+    static_assert(LITTLE_LOG_ENABLED(Trace), "default build keeps every level");
+}
+
+TEST_F(LoggerTest, AsyncLogMsgWritesOnWriterThread) {
+    LoggerOptions options;
+    options.async = true;
+    EXPECT_CALL(*mockFs, createDirectory(::testing::_))
+        .WillRepeatedly(::testing::Return(true));
+    EXPECT_CALL(*mockFs, getFileSize(::testing::_))
+        .WillRepeatedly(::testing::Return(0));
+    EXPECT_CALL(*mockFs, writeToFile(::testing::_, "async message", true))
+        .WillOnce(::testing::Return(true));
+
+    logger->init("test", "./logs", 1, 5, "./backup", 10, options);
+    logger->disableTerminal();
+    logger->logMsg("async message");
+    logger->flush();
+}
+
+TEST_F(LoggerTest, AsyncDestructorDrainsQueue) {
+    LoggerOptions options;
+    options.async = true;
+    options.queueCapacity = 4;
+    EXPECT_CALL(*mockFs, createDirectory(::testing::_))
+        .WillRepeatedly(::testing::Return(true));
+    EXPECT_CALL(*mockFs, getFileSize(::testing::_))
+        .WillRepeatedly(::testing::Return(0));
+    int lines = 0;
+    EXPECT_CALL(*mockFs, writeToFile(::testing::_, ::testing::_, true))
+        .WillRepeatedly(::testing::Invoke(
+            [&lines](const std::string&, const std::string& content, bool) {
+                lines += 1 + static_cast<int>(std::count(content.begin(), content.end(), '\n'));
+                return true;
+            }));
+
+    logger->init("test", "./logs", 1, 5, "./backup", 10, options);
+    logger->disableTerminal();
+    for (int i = 0; i < 100; ++i) {
+        logger->logMsg("message " + std::to_string(i));
+    }
+    logger.reset();
+    EXPECT_EQ(100, lines);
+}
+
+TEST_F(LoggerTest, MetricsCountWritesRotationsAndFailures) {
+    using ::testing::_;
+    using ::testing::Return;
+    EXPECT_CALL(*mockFs, createDirectory(_)).WillRepeatedly(Return(true));
+    EXPECT_CALL(*mockFs, getFileSize(_)).WillOnce(Return(1024 * 1024 - 6));
+    EXPECT_CALL(*mockFs, fileExists(_)).WillRepeatedly(Return(false));
+    EXPECT_CALL(*mockFs, removeFile(_)).WillOnce(Return(true));
+    EXPECT_CALL(*mockFs, writeToFile(_, "abc", true))
+        .WillOnce(Return(false))
+        .WillOnce(Return(true));
+
+    logger->init("test", "./logs", 1, 5, "./backup", 10);
+    logger->disableTerminal();
+    logger->setLevel(LogLevel::Info);
+    logger->logMsg("abc");
+    logger->logMsg("abc");
+    logger->logMsg(LogLevel::Trace, "below the level");
+
+    MetricsSnapshot metrics = logger->snapshot();
+    EXPECT_EQ(2u, metrics.messages);
+    EXPECT_EQ(2u, metrics.writes);
+    EXPECT_EQ(4u, metrics.bytesWritten);
+    EXPECT_EQ(1u, metrics.rotations);
+    EXPECT_EQ(1u, metrics.fileSystemErrors);
+    EXPECT_EQ(2u, metrics.writeLatency.count);
+    EXPECT_EQ(1u, metrics.rotateLatency.count);
+    EXPECT_EQ(0u, metrics.queueDepth);
+}
+
+TEST(BinaryLogTest, RendersPrintfConversions) {
+    uint32_t id = binary_log::registerFormat("user %s took %5.2f ms (%d/%u) %x %%",
+                                             binary_log::Signature<const char*, double, int, unsigned, int>::get());
+    std::string record;
+    binary_log::encodeRecord(record, id, "alice", 3.14159, -7, 42u, 255);
+    std::string text;
+    ASSERT_TRUE(binary_log::renderRecord(record.data(), record.size(), text));
+    EXPECT_EQ("user alice took  3.14 ms (-7/42) ff %", text);
+}
+
+TEST(BinaryLogTest, DecodeRejectsTextFiles) {
+    std::istringstream in("plain text line\n");
+    std::ostringstream out;
+    EXPECT_FALSE(binary_log::decode(in, out));
+}
+
+TEST(LatencyHistogramTest, BucketsStayWithinAnEighth) {
+    for (uint64_t value : {0ull, 7ull, 8ull, 15ull, 16ull, 1000ull, 123456789ull, 1ull << 62}) {
+        int bucket = LatencyHistogram::bucketOf(value);
+        EXPECT_LE(LatencyHistogram::lowerBound(bucket), value);
+        EXPECT_GE(LatencyHistogram::upperBound(bucket), value);
+        EXPECT_LE(LatencyHistogram::upperBound(bucket) - LatencyHistogram::lowerBound(bucket),
+                  LatencyHistogram::lowerBound(bucket) / 8);
+    }
+    EXPECT_EQ(LatencyHistogram::kBuckets - 1, LatencyHistogram::bucketOf(UINT64_MAX));
+
+    LatencyHistogram histogram;
+    for (uint64_t value = 1; value <= 1000; ++value) {
+        ++histogram.counts[LatencyHistogram::bucketOf(value * 1000)];
+        ++histogram.count;
+        histogram.max = value * 1000;
+    }
+    EXPECT_NEAR(500000.0, static_cast<double>(histogram.percentile(0.5)), 500000.0 / 8);
+    EXPECT_NEAR(990000.0, static_cast<double>(histogram.percentile(0.99)), 990000.0 / 8);
+    EXPECT_EQ(1000000u, histogram.percentile(1.0));
+    EXPECT_EQ(0u, LatencyHistogram().percentile(0.5));
+}
+
+TEST(LoggerMetricsTest, ExitedThreadsFoldTheirShards) {
+    LoggerMetrics metrics;
+    metrics.add(LoggerMetrics::kMessages);
+    for (int i = 0; i < 100; ++i) {
+        std::thread([&metrics] {
+            metrics.add(LoggerMetrics::kMessages, 2);
+            metrics.recordWrite(std::chrono::microseconds(5));
+        }).join();
+    }
+    EXPECT_EQ(1u, metrics.liveShards());
+    MetricsSnapshot snapshot = metrics.snapshot();
+    EXPECT_EQ(201u, snapshot.messages);
+    EXPECT_EQ(100u, snapshot.writeLatency.count);
+    EXPECT_EQ(5000u, snapshot.writeLatency.max);
+
+    // A thread outliving the metrics finds nothing to fold into.
+    std::unique_ptr<LoggerMetrics> shortLived(new LoggerMetrics);
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool destroyed = false;
+    std::thread late([&] {
+        shortLived->add(LoggerMetrics::kMessages);
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return destroyed; });
+    });
+    while (shortLived->liveShards() == 0) {
+        std::this_thread::yield();
+    }
+    shortLived.reset();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        destroyed = true;
+    }
+    cv.notify_all();
+    late.join();
+}
+
+TEST(SegmentIndexTest, FindsBlocksOutOfTimeOrder) {
+    SegmentIndex index;
+    index.add({0, 100, 200});
+    index.add({10, 150, 300});
+    index.add({20, 400, 500});
+    index.add({30, 350, 600});
+    index.add({40, 700, 800});
+    index.setCoveredSize(50);
+
+    long begin = 0;
+    long end = 0;
+    ASSERT_TRUE(index.find(450, 460, &begin, &end));
+    EXPECT_EQ(20, begin);
+    EXPECT_EQ(40, end);
+    ASSERT_TRUE(index.find(750, 900, &begin, &end));
+    EXPECT_EQ(40, begin);
+    EXPECT_EQ(50, end);
+    EXPECT_FALSE(index.find(810, 900, &begin, &end));
+    EXPECT_FALSE(index.find(0, 50, &begin, &end));
+
+    SegmentIndex parsed;
+    ASSERT_TRUE(parsed.parse(index.serialize()));
+    EXPECT_EQ(50, parsed.coveredSize());
+    ASSERT_EQ(5u, parsed.blocks().size());
+    EXPECT_EQ(350, parsed.blocks()[3].firstMicros);
+    EXPECT_FALSE(parsed.parse("little-log-index 1 50\n10 1 2\n0 1 2"));
+    EXPECT_FALSE(parsed.parse("not an index"));
+    EXPECT_EQ("/logs/a.log3.idx", SegmentIndex::pathFor("/logs/a.log3.gz"));
+}
+
+TEST(LogScanTest, KernelsAgreeWithScalarSearch) {
+    std::string data;
+    unsigned seed = 7;
+    for (int i = 0; i < 5000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        data += "abcdEFGH\n"[(seed >> 16) % 9];
+    }
+    std::vector<log_scan::Kernel> kernels = {log_scan::Kernel::Scalar};
+    if (log_scan::bestKernel() != log_scan::Kernel::Scalar) {
+        kernels.push_back(log_scan::Kernel::Sse42);
+    }
+    if (log_scan::bestKernel() == log_scan::Kernel::Avx2) {
+        kernels.push_back(log_scan::Kernel::Avx2);
+    }
+    for (size_t length : {1u, 2u, 3u, 5u, 8u, 17u, 40u}) {
+        for (size_t start = 0; start + length <= data.size(); start += 997) {
+            std::string needle = data.substr(start, length);
+            std::string lower = needle;
+            std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+            for (size_t offset : {0u, 1u, 31u, 100u}) {
+                const char* begin = data.data() + offset;
+                size_t size = data.size() - offset;
+                size_t expected = std::search(begin, begin + size, needle.begin(), needle.end()) - begin;
+                size_t folded = std::search(begin, begin + size, lower.begin(), lower.end(),
+                                            [](char a, char b) { return ::tolower(a) == b; }) -
+                                begin;
+                for (log_scan::Kernel kernel : kernels) {
+                    EXPECT_EQ(expected, log_scan::find(kernel, begin, size, needle.data(), length, false))
+                        << log_scan::kernelName(kernel) << " " << needle;
+                    EXPECT_EQ(folded, log_scan::find(kernel, begin, size, lower.data(), length, true))
+                        << log_scan::kernelName(kernel) << " " << lower;
+                }
+            }
+        }
+    }
+    size_t newlines = std::count(data.begin(), data.end(), '\n');
+    for (log_scan::Kernel kernel : kernels) {
+        EXPECT_EQ(newlines, log_scan::countNewlines(kernel, data.data(), data.size()));
+        EXPECT_EQ(data.size(), log_scan::find(kernel, data.data(), data.size(), "zz", 2, false));
+    }
+}
+
+TEST(StructuredLogTest, JsonEscapingAgreesAcrossKernels) {
+    std::string data;
+    unsigned seed = 11;
+    for (int i = 0; i < 5000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        data += (seed >> 16) % 50 == 0 ? "\"\\\n\x01\x1f"[(seed >> 8) % 5] : static_cast<char>(0x20 + (seed >> 16) % 0xe0);
+    }
+    std::vector<log_scan::Kernel> kernels = {log_scan::Kernel::Scalar};
+    if (log_scan::bestKernel() != log_scan::Kernel::Scalar) {
+        kernels.push_back(log_scan::Kernel::Sse42);
+    }
+    if (log_scan::bestKernel() == log_scan::Kernel::Avx2) {
+        kernels.push_back(log_scan::Kernel::Avx2);
+    }
+    for (size_t start = 0; start < data.size(); start += 37) {
+        const char* begin = data.data() + start;
+        size_t size = data.size() - start;
+        size_t expected = std::find_if(begin, begin + size,
+                                       [](char c) {
+                                           return c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20;
+                                       }) -
+                          begin;
+        for (log_scan::Kernel kernel : kernels) {
+            EXPECT_EQ(expected, log_scan::findJsonEscape(kernel, begin, size)) << log_scan::kernelName(kernel);
+        }
+    }
+
+    std::string out;
+    const char raw[] = "say \"hi\"\\\n\t\r\x01 caf\xc3\xa9";
+    structured_log::appendJsonString(out, raw, sizeof(raw) - 1);
+    EXPECT_EQ("\"say \\\"hi\\\"\\\\\\n\\t\\r\\u0001 caf\xc3\xa9\"", out);
+}
+
+TEST(TerminalSinkTest, WritesLinesInOrder) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    std::string expected;
+    {
+        TerminalOptions options;
+        options.fd = fds[1];
+        TerminalSink sink(options);
+        for (int i = 0; i < 200; ++i) {
+            std::string line = "line " + std::to_string(i) + "\n";
+            EXPECT_TRUE(sink.write(line.data(), line.size()));
+            expected += line;
+        }
+        sink.flush();
+        EXPECT_EQ(expected, readAvailable(fds[0]));
+        EXPECT_TRUE(sink.write("last\n", 5));
+    }
+    EXPECT_EQ("last\n", readAvailable(fds[0]));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(TerminalSinkTest, DropPolicyDoesNotWaitForAStuckReader) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    fcntl(fds[1], F_SETPIPE_SZ, 4096);
+    TerminalOptions options;
+    options.fd = fds[1];
+    options.bufferBytes = 1024;
+    options.policy = TerminalPolicy::Drop;
+    std::string line(99, 'd');
+    line += '\n';
+    {
+        TerminalSink sink(options);
+        int accepted = 0;
+        for (int i = 0; i < 10000; ++i) {
+            accepted += sink.write(line.data(), line.size()) ? 1 : 0;
+        }
+        EXPECT_EQ(static_cast<uint64_t>(10000 - accepted), sink.dropped());
+        EXPECT_GT(sink.dropped(), 0u);
+        // Lines that must not be lost wait for room instead.
+        std::atomic<bool> done{false};
+        std::thread reader([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            while (!done) {
+                readAvailable(fds[0]);
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+        uint64_t dropped = sink.dropped();
+        for (int i = 0; i < 20; ++i) {
+            EXPECT_TRUE(sink.write(line.data(), line.size(), false));
+        }
+        sink.flush();
+        done = true;
+        reader.join();
+        EXPECT_EQ(dropped, sink.dropped());
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(TerminalSinkTest, BlockPolicyDeliversEverything) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    fcntl(fds[1], F_SETPIPE_SZ, 4096);
+    TerminalOptions options;
+    options.fd = fds[1];
+    options.bufferBytes = 1024;
+    std::string line(99, 'b');
+    line += '\n';
+    std::string received;
+    {
+        TerminalSink sink(options);
+        std::thread reader([&] {
+            while (received.size() < 1000 * line.size()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                received += readAvailable(fds[0]);
+            }
+        });
+        for (int i = 0; i < 1000; ++i) {
+            EXPECT_TRUE(sink.write(line.data(), line.size()));
+        }
+        sink.flush();
+        reader.join();
+        EXPECT_EQ(0u, sink.dropped());
+    }
+    EXPECT_EQ(1000 * line.size(), received.size());
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(LinePrefixTest, FormatsAndPatchesSubSecondDigits) {
+    std::tm local = {};
+    local.tm_year = 2026 - 1900;
+    local.tm_mon = 9;
+    local.tm_mday = 17;
+    local.tm_hour = 14;
+    local.tm_min = 2;
+    local.tm_sec = 3;
+    local.tm_isdst = -1;
+    int64_t second = static_cast<int64_t>(std::mktime(&local));
+
+    LinePrefixFormatter formatter;
+    char out[LinePrefixFormatter::kMaxSize];
+    LogStamp stamp;
+    stamp.micros = second * 1000000 + 42;
+    stamp.threadId = 4242;
+    size_t n = formatter.format(stamp, LogLevel::Info, line_prefix::kAll, out);
+    EXPECT_EQ("2026-10-17 14:02:03.000042 INFO  [4242] ", std::string(out, n));
+
+    stamp.micros = second * 1000000 + 999999;
+    n = formatter.format(stamp, LogLevel::Error, line_prefix::kTimestamp | line_prefix::kLevel, out);
+    EXPECT_EQ("2026-10-17 14:02:03.999999 ERROR ", std::string(out, n));
+
+    stamp.micros = (second + 57) * 1000000;
+    n = formatter.format(stamp, LogLevel::Warn, line_prefix::kTimestamp, out);
+    EXPECT_EQ("2026-10-17 14:03:00.000000 ", std::string(out, n));
+
+    n = formatter.format(stamp, LogLevel::Debug, line_prefix::kLevel | line_prefix::kThreadId, out);
+    EXPECT_EQ("DEBUG [4242] ", std::string(out, n));
+}
+
+TEST(RateLimiterTest, BucketsRefillAtTheConfiguredRate) {
+    RateLimiter limiter(10, 5, 64);
+    const int64_t second = 1000000000;
+    int64_t now = 7 * second;
+    for (int i = 0; i < 5; ++i) {
+        EXPECT_TRUE(limiter.allow(1, now));
+    }
+    EXPECT_FALSE(limiter.allow(1, now));
+    EXPECT_TRUE(limiter.allow(2, now));
+
+    // One token every 100 ms, never more than burst.
+    EXPECT_FALSE(limiter.allow(1, now + second / 20));
+    EXPECT_TRUE(limiter.allow(1, now + second / 10));
+    EXPECT_FALSE(limiter.allow(1, now + second / 10));
+    int allowed = 0;
+    for (int i = 0; i < 20; ++i) {
+        allowed += limiter.allow(1, now + 10 * second) ? 1 : 0;
+    }
+    EXPECT_EQ(5, allowed);
+    EXPECT_NE(RateLimiter::hash("abc", 3), RateLimiter::hash("abd", 3));
+}
+
+
+TEST(ShmRingTest, RecordsOutliveACrashedProducer) {
+    std::string name = "little-log-test-" + std::to_string(getpid());
+    ShmRing::remove(name);
+    auto collector = ShmRing::create(name, 256);
+    ASSERT_TRUE(collector);
+    EXPECT_EQ(256u, collector->capacity());
+
+    // The child publishes some records, then faults while copying a record
+    // whose source runs into an unreadable page: its first slot is
+    // published, the rest stay reserved.
+    pid_t child = fork();
+    ASSERT_GE(child, 0);
+    if (child == 0) {
+        struct rlimit noCore = {0, 0};
+        setrlimit(RLIMIT_CORE, &noCore);
+        auto producer = ShmRing::attach(name);
+        if (!producer) {
+            _exit(1);
+        }
+        LogStamp stamp;
+        for (int i = 0; i < 20; ++i) {
+            stamp.micros = i;
+            std::string text = i % 5 == 4 ? std::string(600, 'm') : "record " + std::to_string(i);
+            producer->tryPush(text.data(), text.size(), static_cast<unsigned>(i), stamp);
+        }
+        long page = sysconf(_SC_PAGESIZE);
+        char* pages = static_cast<char*>(
+            mmap(nullptr, page * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        mprotect(pages + page, page, PROT_NONE);
+        producer->tryPush(pages + page - 300, 1000, 0, stamp);
+        _exit(0);
+    }
+    int status = 0;
+    ASSERT_EQ(child, waitpid(child, &status, 0));
+    ASSERT_TRUE(WIFSIGNALED(status));
+
+    auto other = ShmRing::attach(name);
+    ASSERT_TRUE(other);
+    LogStamp stamp;
+    stamp.micros = 99;
+    EXPECT_TRUE(other->tryPush("after the crash", 15, 100, stamp));
+
+    std::vector<std::string> records;
+    std::vector<unsigned> flags;
+    while (collector->tryPop([&](const char* data, size_t length, unsigned f, const LogStamp& s) {
+        records.emplace_back(data, length);
+        flags.push_back(f);
+        EXPECT_EQ(f == 100 ? 99 : static_cast<int64_t>(f), s.micros);
+    })) {
+    }
+    ASSERT_EQ(21u, records.size());
+    for (int i = 0; i < 20; ++i) {
+        EXPECT_EQ(i % 5 == 4 ? std::string(600, 'm') : "record " + std::to_string(i), records[i]);
+        EXPECT_EQ(static_cast<unsigned>(i), flags[i]);
+    }
+    EXPECT_EQ("after the crash", records[20]);
+    EXPECT_EQ(5u, collector->abandoned());
+    EXPECT_EQ(collector->pushed(), collector->popped());
+
+    // Records longer than a ring can hold are cut, not rejected.
+    std::string huge(collector->maxMessage() + 100, 'h');
+    EXPECT_TRUE(other->tryPush(huge.data(), huge.size(), 0, stamp));
+    EXPECT_TRUE(collector->tryPop([&](const char* data, size_t length, unsigned, const LogStamp&) {
+        EXPECT_EQ(huge.substr(0, collector->maxMessage()), std::string(data, length));
+    }));
+    EXPECT_TRUE(ShmRing::remove(name));
+}
+TEST(ShmRingTest, StalledProducerLeavesReclaimedSlotsAlone) {
+    std::string name = "little-log-stall-" + std::to_string(getpid());
+    ShmRing::remove(name);
+    auto collector = ShmRing::create(name, 64);
+    auto stalled = ShmRing::attach(name);
+    auto other = ShmRing::attach(name);
+    ASSERT_TRUE(collector && stalled && other);
+    LogStamp stamp;
+    std::vector<std::string> records;
+    auto collect = [&](const char* data, size_t length, unsigned, const LogStamp&) {
+        records.emplace_back(data, length);
+    };
+
+    // The producer stops between reserving its slot and publishing it for
+    // longer than the collector waits for an unclaimed slot.
+    ShmRing::Reservation reservation;
+    ASSERT_TRUE(stalled->reserve(4, &reservation));
+    EXPECT_TRUE(other->tryPush("behind", 6, 0, stamp));
+    EXPECT_FALSE(collector->tryPop(collect));
+    std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+    EXPECT_TRUE(collector->tryPop(collect));
+    EXPECT_EQ(1u, collector->abandoned());
+    EXPECT_EQ(std::vector<std::string>{"behind"}, records);
+
+    // Its slot is handed out again before it wakes up; the late publish
+    // must not touch it.
+    records.clear();
+    for (size_t i = 0; i < collector->capacity(); ++i) {
+        std::string text = "lap " + std::to_string(i);
+        ASSERT_TRUE(other->tryPush(text.data(), text.size(), 0, stamp));
+    }
+    EXPECT_FALSE(stalled->publish(reservation, "late", 0, stamp));
+    while (collector->tryPop(collect)) {
+    }
+    ASSERT_EQ(collector->capacity(), records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        EXPECT_EQ("lap " + std::to_string(i), records[i]);
+    }
+    EXPECT_EQ(collector->pushed(), collector->popped());
+    EXPECT_TRUE(ShmRing::remove(name));
+}
+
 // Real file system tests
 TEST_F(RealFileSystemTest, CreateDirectory) {
     EXPECT_TRUE(realFs->createDirectory(testDir));
@@ -193,6 +1057,22 @@ TEST_F(RealFileSystemTest, WriteToFile) {
     EXPECT_TRUE(realFs->writeToFile(testDir + "/test.txt", "world", true));
 }
 
+TEST_F(RealFileSystemTest, OpenForAppend) {
+    realFs->createDirectory(testDir);
+    realFs->writeToFile(testDir + "/test.txt", "first", false);
+    auto handle = realFs->openForAppend(testDir + "/test.txt");
+    ASSERT_TRUE(handle != nullptr);
+    EXPECT_TRUE(handle->write("second\n", 7));
+    EXPECT_TRUE(handle->write("third\n", 6));
+    handle.reset();
+
+    std::ifstream in(testDir + "/test.txt");
+    std::stringstream content;
+    content << in.rdbuf();
+    EXPECT_EQ("first\nsecond\nthird\n", content.str());
+    EXPECT_TRUE(realFs->openForAppend(testDir + "/missing/test.txt") == nullptr);
+}
+
 TEST_F(RealFileSystemTest, CopyFile) {
     realFs->createDirectory(testDir);
     realFs->writeToFile(testDir + "/source.txt", "content", false);
@@ -200,6 +1080,165 @@ TEST_F(RealFileSystemTest, CopyFile) {
     EXPECT_TRUE(realFs->fileExists(testDir + "/dest.txt"));
 }
 
+TEST_F(RealFileSystemTest, TransferFile) {
+    realFs->createDirectory(testDir);
+    realFs->writeToFile(testDir + "/source.txt", "line one\nline two", false);
+    realFs->writeToFile(testDir + "/dest.txt", "stale content that is longer", false);
+
+    CopyResult result;
+    EXPECT_TRUE(realFs->transferFile(testDir + "/source.txt", testDir + "/dest.txt", false, -1,
+                                     &result));
+    EXPECT_NE(CopyStrategy::None, result.strategy);
+    EXPECT_NE(CopyStrategy::Hardlink, result.strategy);
+    EXPECT_EQ(18, realFs->getFileSize(testDir + "/dest.txt"));
+
+    EXPECT_TRUE(realFs->transferFile(testDir + "/source.txt", testDir + "/prefix.txt", false, 9,
+                                     &result));
+    EXPECT_EQ(9, result.bytesMoved);
+    std::ifstream in(testDir + "/prefix.txt");
+    std::stringstream content;
+    content << in.rdbuf();
+    EXPECT_EQ("line one\n", content.str());
+
+    EXPECT_TRUE(realFs->transferFile(testDir + "/source.txt", testDir + "/frozen.txt", true, -1,
+                                     &result));
+    EXPECT_EQ(18, realFs->getFileSize(testDir + "/frozen.txt"));
+    // Copying over what may be a hardlink to the source leaves the source be.
+    EXPECT_TRUE(realFs->transferFile(testDir + "/source.txt", testDir + "/frozen.txt", false, 9,
+                                     &result));
+    EXPECT_EQ(9, realFs->getFileSize(testDir + "/frozen.txt"));
+    EXPECT_EQ(18, realFs->getFileSize(testDir + "/source.txt"));
+    EXPECT_FALSE(realFs->transferFile(testDir + "/missing.txt", testDir + "/other.txt", false, -1,
+                                      nullptr));
+
+    // sysfs files claim a page but hold a few bytes, like a source that was
+    // truncated after its size was read: the copy fails and says how far it
+    // got.
+    const std::string shorter = "/sys/devices/system/cpu/online";
+    if (realFs->getFileSize(shorter) == 4096) {
+        EXPECT_FALSE(realFs->transferFile(shorter, testDir + "/short.txt", false, -1, &result));
+        EXPECT_GT(result.bytesMoved, 0);
+        EXPECT_LT(result.bytesMoved, 4096);
+    }
+}
+
+TEST_F(RealFileSystemTest, CompressFile) {
+    realFs->createDirectory(testDir);
+    std::string text;
+    for (int i = 0; i < 1000; ++i) {
+        text += "repeated log line " + std::to_string(i % 10) + "\n";
+    }
+    std::ofstream(testDir + "/plain.log") << text;
+    EXPECT_TRUE(realFs->compressFile(testDir + "/plain.log", testDir + "/plain.log.gz", 6));
+    EXPECT_LT(realFs->getFileSize(testDir + "/plain.log.gz") * 10, static_cast<long>(text.size()));
+
+    std::string inflated;
+    ASSERT_TRUE(readGzip(testDir + "/plain.log.gz", &inflated));
+    EXPECT_EQ(text, inflated);
+    EXPECT_FALSE(realFs->compressFile(testDir + "/missing.log", testDir + "/missing.log.gz", 6));
+}
+
+TEST_F(RealFileSystemTest, MappedAppendTruncatesOnClose) {
+    realFs->createDirectory(testDir);
+    std::string path = testDir + "/mapped.log";
+    MappedFileSystem mapped(64 * 1024);
+    auto handle = mapped.openForAppend(path);
+    ASSERT_TRUE(handle != nullptr);
+    EXPECT_TRUE(handle->write("first\n", 6));
+    EXPECT_TRUE(handle->write("second\n", 7));
+    EXPECT_EQ(64 * 1024, realFs->getFileSize(path));
+    EXPECT_EQ(13, mapped.getFileSize(path));
+    EXPECT_TRUE(handle->sync());
+
+    // Writing past the preallocated size grows the mapping.
+    std::string big(100 * 1024, 'z');
+    big += '\n';
+    EXPECT_TRUE(handle->write(big.data(), big.size()));
+    handle.reset();
+    EXPECT_EQ(static_cast<long>(13 + big.size()), realFs->getFileSize(path));
+
+    handle = mapped.openForAppend(path);
+    ASSERT_TRUE(handle != nullptr);
+    EXPECT_TRUE(handle->write("third\n", 6));
+    handle.reset();
+    std::string content;
+    ASSERT_TRUE(realFs->readFile(path, &content));
+    EXPECT_EQ("first\nsecond\n" + big + "third\n", content);
+}
+
+TEST_F(RealFileSystemTest, MappedRecoversTornSegments) {
+    realFs->createDirectory(testDir);
+    MappedFileSystem mapped(4096);
+
+    // What a crash leaves behind: preallocated zeros after a half line.
+    std::string text = "one\ntwo\nthr";
+    text.resize(8192, '\0');
+    std::ofstream(testDir + "/text.log", std::ios::binary) << text;
+    EXPECT_TRUE(mapped.recoverFile(testDir + "/text.log"));
+    std::string content;
+    ASSERT_TRUE(realFs->readFile(testDir + "/text.log", &content));
+    EXPECT_EQ("one\ntwo\n", content);
+
+    std::string binary(binary_log::kMagic, binary_log::kMagicSize);
+    binary_log::appendEntry(binary, binary_log::kText, "kept", 4);
+    size_t complete = binary.size();
+    std::string padded = binary;
+    padded.resize(8192, '\0');
+    std::ofstream(testDir + "/padded.log", std::ios::binary) << padded;
+    EXPECT_TRUE(mapped.recoverFile(testDir + "/padded.log"));
+    EXPECT_EQ(static_cast<long>(complete), realFs->getFileSize(testDir + "/padded.log"));
+
+    binary_log::appendEntry(binary, binary_log::kText, "torn entry", 10);
+    binary.resize(binary.size() - 3);
+    std::ofstream(testDir + "/binary.log", std::ios::binary) << binary;
+    EXPECT_TRUE(mapped.recoverFile(testDir + "/binary.log"));
+    EXPECT_EQ(static_cast<long>(complete), realFs->getFileSize(testDir + "/binary.log"));
+
+    EXPECT_TRUE(mapped.recoverFile(testDir + "/missing.log"));
+}
+
+TEST_F(RealFileSystemTest, IoUringOperations) {
+    IoUringFileSystem uring;
+    if (!uring.available()) {
+        GTEST_SKIP() << "io_uring is not available";
+    }
+    EXPECT_TRUE(uring.createDirectory(testDir));
+    EXPECT_TRUE(uring.createDirectory(testDir));
+
+    std::string expected;
+    {
+        std::unique_ptr<FileHandle> handle = uring.openForAppend(testDir + "/a.log");
+        ASSERT_TRUE(handle);
+        for (int i = 0; i < 1000; ++i) {
+            std::string line = "line " + std::to_string(i) + "\n";
+            EXPECT_TRUE(handle->write(line.data(), line.size()));
+            expected += line;
+        }
+        // Sizes count every submitted write, completed or not.
+        EXPECT_EQ(static_cast<long>(expected.size()), uring.getFileSize(testDir + "/a.log"));
+        EXPECT_TRUE(handle->sync());
+    }
+    std::string content;
+    ASSERT_TRUE(uring.readFile(testDir + "/a.log", &content));
+    EXPECT_EQ(expected, content);
+
+    CopyResult result;
+    EXPECT_TRUE(uring.transferFile(testDir + "/a.log", testDir + "/b.log", false, -1, &result));
+    EXPECT_EQ(CopyStrategy::IoUring, result.strategy);
+    EXPECT_EQ(static_cast<long>(expected.size()), result.bytesMoved);
+    ASSERT_TRUE(uring.readFile(testDir + "/b.log", &content));
+    EXPECT_EQ(expected, content);
+    EXPECT_TRUE(uring.transferFile(testDir + "/a.log", testDir + "/c.log", false, 10, &result));
+    EXPECT_EQ(10, uring.getFileSize(testDir + "/c.log"));
+
+    EXPECT_TRUE(uring.renameFile(testDir + "/b.log", testDir + "/d.log"));
+    EXPECT_FALSE(uring.fileExists(testDir + "/b.log"));
+    EXPECT_TRUE(uring.removeFile(testDir + "/d.log"));
+    EXPECT_FALSE(uring.fileExists(testDir + "/d.log"));
+    EXPECT_FALSE(uring.removeFile(testDir + "/d.log"));
+    EXPECT_FALSE(uring.renameFile(testDir + "/d.log", testDir + "/e.log"));
+}
+
 TEST_F(RealFileSystemTest, RenameFile) {
     realFs->createDirectory(testDir);
     realFs->writeToFile(testDir + "/old.txt", "content", false);
@@ -215,21 +1254,1530 @@ TEST_F(RealFileSystemTest, RemoveFile) {
     EXPECT_FALSE(realFs->fileExists(testDir + "/test.txt"));
 }
 
-// Integration tests
-TEST_F(IntegrationTest, FullWorkflow) {
-    logger->init("test", testDir, 1, 3, testDir + "/backup", 10);
-    
-    // Test logging
-    logger->logMsg("Message 1");
-    logger->logMsg("Message 2");
-    logger->disableTerminal();
-    logger->logMsg("Message 3");
-    logger->logFact("Force message");
-    
+TEST_F(RealFileSystemTest, ContentIdFollowsTheBytes) {
+    realFs->createDirectory(testDir);
+    realFs->writeToFile(testDir + "/a.log", "same content", false);
+    realFs->writeToFile(testDir + "/b.log", "same content", false);
+    realFs->writeToFile(testDir + "/c.log", "other content", false);
+    std::string a, b, c;
+    ASSERT_TRUE(realFs->contentId(testDir + "/a.log", &a));
+    ASSERT_TRUE(realFs->contentId(testDir + "/b.log", &b));
+    ASSERT_TRUE(realFs->contentId(testDir + "/c.log", &c));
+    EXPECT_EQ(a, b);
+    EXPECT_NE(a, c);
+
+    // A rewritten file is hashed again rather than served from the cache.
+    realFs->writeToFile(testDir + "/a.log", "more", true);
+    std::string changed;
+    ASSERT_TRUE(realFs->contentId(testDir + "/a.log", &changed));
+    EXPECT_NE(a, changed);
+    EXPECT_FALSE(realFs->contentId(testDir + "/missing.log", &changed));
+
+    std::vector<std::string> names;
+    ASSERT_TRUE(realFs->listDirectory(testDir, &names));
+    std::sort(names.begin(), names.end());
+    EXPECT_EQ((std::vector<std::string>{"a.log", "b.log", "c.log"}), names);
+}
+
+TEST_F(RealFileSystemTest, PooledHandlesReopenPastTheLimit) {
+    realFs->createDirectory(testDir);
+    PooledFileSystem pool(realFs, 2);
+    std::vector<std::unique_ptr<FileHandle>> handles;
+    for (int i = 0; i < 5; ++i) {
+        handles.push_back(pool.openForAppend(testDir + "/f" + std::to_string(i) + ".log"));
+        ASSERT_TRUE(handles.back());
+    }
+    EXPECT_EQ(2u, pool.openCount());
+    for (int round = 0; round < 3; ++round) {
+        for (auto& handle : handles) {
+            std::string line = "round " + std::to_string(round) + "\n";
+            EXPECT_TRUE(handle->write(line.data(), line.size()));
+            EXPECT_TRUE(handle->sync());
+        }
+    }
+    EXPECT_EQ(2u, pool.openCount());
+    EXPECT_GE(pool.reopens(), 15u);
+    handles.clear();
+    EXPECT_EQ(0u, pool.openCount());
+
+    for (int i = 0; i < 5; ++i) {
+        std::string content;
+        ASSERT_TRUE(realFs->readFile(testDir + "/f" + std::to_string(i) + ".log", &content));
+        EXPECT_EQ("round 0\nround 1\nround 2\n", content);
+    }
+}
+
+// Integration tests
+TEST_F(IntegrationTest, FullWorkflow) {
+    logger->init("test", testDir, 1, 3, testDir + "/backup", 10);
+    
+    // Test logging
+    logger->logMsg("Message 1");
+    logger->logMsg("Message 2");
+    logger->disableTerminal();
+    logger->logMsg("Message 3");
+    logger->logFact("Force message");
+    
     // Test backup
     logger->backup();
 }
 
+TEST_F(IntegrationTest, AsyncWorkflowKeepsOrder) {
+    LoggerOptions options;
+    options.async = true;
+    logger->init("async", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    for (int i = 0; i < 1000; ++i) {
+        logger->logMsg("line " + std::to_string(i));
+    }
+    logger->flush();
+
+    std::ifstream in(testDir + "/async/async.log");
+    std::string line;
+    int expected = 0;
+    while (std::getline(in, line)) {
+        EXPECT_EQ("line " + std::to_string(expected), line);
+        ++expected;
+    }
+    EXPECT_EQ(1000, expected);
+}
+
+TEST_F(IntegrationTest, FlushPolicySyncCadence) {
+    auto fs = std::make_shared<SyncCountingFileSystem>();
+    logger = std::make_unique<Logger>(fs);
+    LoggerOptions options;
+    options.flush.syncEveryFlushes = 3;
+    logger->init("sync", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    for (int i = 0; i < 9; ++i) {
+        logger->logMsg("line " + std::to_string(i));
+    }
+    EXPECT_EQ(9, fs->writes);
+    EXPECT_EQ(3, fs->syncs);
+}
+
+TEST_F(IntegrationTest, MetricsDumpAppendsJsonLines) {
+    LoggerOptions options;
+    options.async = true;
+    options.metrics.dumpPath = testDir + "/metrics.jsonl";
+    options.metrics.dumpIntervalMs = 20;
+    logger->init("metrics", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([this] {
+            for (int i = 0; i < 500; ++i) {
+                logger->logMsg(std::string(100, 'x'));
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    logger->flush();
+    MetricsSnapshot metrics = logger->snapshot();
+    EXPECT_EQ(2000u, metrics.messages);
+    EXPECT_EQ(2000u * 101, metrics.bytesWritten);
+    EXPECT_EQ(0u, metrics.queueDepth);
+    EXPECT_GE(metrics.queueDepthMax, 1u);
+    EXPECT_GE(metrics.writeLatency.percentile(0.99), metrics.writeLatency.percentile(0.5));
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    logger.reset();
+
+    std::ifstream dump(testDir + "/metrics.jsonl");
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(dump, line);) {
+        lines.push_back(line);
+    }
+    ASSERT_GE(lines.size(), 2u);
+    for (const std::string& line : lines) {
+        EXPECT_EQ(0u, line.find("{\"messages\":"));
+        EXPECT_EQ('}', line.back());
+    }
+    EXPECT_NE(std::string::npos, lines.back().find("\"bytes_written\":202000,"));
+    EXPECT_NE(std::string::npos, lines.back().find("\"write_latency\":{\"count\":"));
+}
+
+TEST_F(IntegrationTest, TerminalOutputGoesThroughTheSink) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    for (bool async : {false, true}) {
+        LoggerOptions options;
+        options.async = async;
+        options.terminal.fd = fds[1];
+        logger->init("terminal", testDir, 1, 3, testDir + "/backup", 10, options);
+        logger->logMsg("first");
+        logger->logFact("fact");
+        logger->logMsg("second");
+        logger->disableTerminal();
+        logger->logMsg("file only");
+        logger->flush();
+        std::string printed = readAvailable(fds[0]);
+        // logFact() bypasses the async queue, so only its own order is fixed.
+        EXPECT_NE(std::string::npos, printed.find("first\n")) << async;
+        EXPECT_NE(std::string::npos, printed.find("fact\n")) << async;
+        EXPECT_LT(printed.find("first\n"), printed.find("second\n")) << async;
+        EXPECT_EQ(std::string::npos, printed.find("file only")) << async;
+        logger->enableTerminal();
+    }
+    logger.reset();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Logs "m0".."m<count-1>" while the writer is stuck in its first write,
+// then lets it go and returns the file's lines.
+static std::vector<std::string> logThroughStalledWriter(const std::string& dir,
+                                                        const LoggerOptions& options, int count,
+                                                        MetricsSnapshot* metrics) {
+    auto fs = std::make_shared<GatedFileSystem>();
+    {
+        Logger logger(fs);
+        logger.init("overload", dir, 1, 3, dir + "/backup", 10, options);
+        logger.disableTerminal();
+        logger.logMsg("first");
+        fs->waitForBlockedWrite();
+        for (int i = 0; i < count; ++i) {
+            logger.logMsg(i % 2 ? LogLevel::Debug : LogLevel::Error, "m" + std::to_string(i));
+        }
+        fs->open();
+        logger.flush();
+        *metrics = logger.snapshot();
+    }
+    std::ifstream in(dir + "/overload/overload.log");
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(in, line);) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+TEST_F(IntegrationTest, OverloadDropNewestKeepsTheBacklog) {
+    LoggerOptions options;
+    options.async = true;
+    options.queueCapacity = 16;
+    options.overload.policy = OverloadPolicy::DropNewest;
+    MetricsSnapshot metrics;
+    std::vector<std::string> lines = logThroughStalledWriter(testDir, options, 100, &metrics);
+
+    ASSERT_GE(lines.size(), 3u);
+    EXPECT_EQ("first", lines.front());
+    size_t kept = lines.size() - 2;
+    EXPECT_EQ(16u, kept);
+    for (size_t i = 0; i < kept; ++i) {
+        EXPECT_EQ("m" + std::to_string(i), lines[i + 1]);
+    }
+    EXPECT_EQ(std::to_string(100 - kept) + " messages dropped", lines.back());
+    EXPECT_EQ(100 - kept, metrics.dropped);
+}
+
+TEST_F(IntegrationTest, OverloadDropOldestKeepsTheNewest) {
+    LoggerOptions options;
+    options.async = true;
+    options.queueCapacity = 16;
+    options.overload.policy = OverloadPolicy::DropOldest;
+    MetricsSnapshot metrics;
+    std::vector<std::string> lines = logThroughStalledWriter(testDir, options, 100, &metrics);
+
+    ASSERT_EQ(1u + 16u + 1u, lines.size());
+    for (size_t i = 0; i < 16; ++i) {
+        EXPECT_EQ("m" + std::to_string(84 + i), lines[i + 1]);
+    }
+    EXPECT_EQ("84 messages dropped", lines.back());
+    EXPECT_EQ(84u, metrics.dropped);
+}
+
+TEST_F(IntegrationTest, OverloadBlockGivesUpAfterTimeout) {
+    LoggerOptions options;
+    options.async = true;
+    options.queueCapacity = 16;
+    options.overload.blockTimeoutMs = 5;
+    MetricsSnapshot metrics;
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::string> lines = logThroughStalledWriter(testDir, options, 20, &metrics);
+    EXPECT_LT(std::chrono::steady_clock::now() - started, std::chrono::seconds(5));
+
+    EXPECT_EQ(4u, metrics.dropped);
+    ASSERT_EQ(1u + 16u + 1u, lines.size());
+    EXPECT_EQ("m15", lines[16]);
+    EXPECT_EQ("4 messages dropped", lines.back());
+}
+
+TEST_F(IntegrationTest, OverloadSamplingPrefersHigherLevels) {
+    LoggerOptions options;
+    options.async = true;
+    options.queueCapacity = 16;
+    options.overload.policy = OverloadPolicy::Sample;
+    options.overload.sampleRates[static_cast<int>(LogLevel::Debug)] = 0.0;
+    MetricsSnapshot metrics;
+    std::vector<std::string> lines = logThroughStalledWriter(testDir, options, 100, &metrics);
+
+    // Until the queue is half full everything goes in; after that only the
+    // Error (even) messages, until it is full.
+    ASSERT_EQ(1u + 16u + 1u, lines.size());
+    int debug = 0;
+    for (size_t i = 1; i <= 16; ++i) {
+        int n = std::stoi(lines[i].substr(1));
+        debug += n % 2;
+        if (i > 8) {
+            EXPECT_EQ(0, n % 2) << lines[i];
+        }
+    }
+    EXPECT_EQ(4, debug);
+    EXPECT_EQ(84u, metrics.dropped);
+    EXPECT_EQ("84 messages dropped", lines.back());
+}
+
+TEST_F(IntegrationTest, OverloadDropNewestInSynchronousMode) {
+    auto fs = std::make_shared<GatedFileSystem>();
+    LoggerOptions options;
+    options.overload.policy = OverloadPolicy::DropNewest;
+    {
+        Logger logger(fs);
+        logger.init("overload", testDir, 8, 3, testDir + "/backup", 10, options);
+        logger.disableTerminal();
+        // This thread wins the appender and gets stuck writing.
+        std::thread stuck([&] { logger.logMsg("first"); });
+        fs->waitForBlockedWrite();
+        std::string message(1000, 's');
+        for (int i = 0; i < 2000; ++i) {
+            logger.logMsg(message);
+        }
+        fs->open();
+        stuck.join();
+        logger.flush();
+        MetricsSnapshot metrics = logger.snapshot();
+        EXPECT_GT(metrics.dropped, 0u);
+        EXPECT_LT(metrics.dropped, 2000u);
+    }
+    std::ifstream in(testDir + "/overload/overload.log");
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(in, line);) {
+        lines.push_back(line);
+    }
+    ASSERT_FALSE(lines.empty());
+    EXPECT_NE(std::string::npos, lines.back().find(" messages dropped"));
+    size_t dropped = std::stoul(lines.back());
+    EXPECT_EQ(2000u + 2u, lines.size() + dropped);
+}
+
+static std::vector<std::string> fileLines(const std::string& path) {
+    std::vector<std::string> lines;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+TEST_F(IntegrationTest, AsyncFlushPolicyHonoursDelay) {
+    auto fs = std::make_shared<SyncCountingFileSystem>();
+    logger = std::make_unique<Logger>(fs);
+    LoggerOptions options;
+    options.async = true;
+    options.flush.maxBufferedBytes = 1 << 20;
+    options.flush.maxDelayMs = 20;
+    logger->init("delay", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    for (int i = 0; i < 100; ++i) {
+        logger->logMsg("line " + std::to_string(i));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_EQ(1, fs->writes);
+
+    std::ifstream in(testDir + "/delay/delay.log");
+    int lines = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        ++lines;
+    }
+    EXPECT_EQ(100, lines);
+}
+
+TEST_F(IntegrationTest, SyncFlushPolicyHonoursDelayWhenIdle) {
+    LoggerOptions options;
+    options.flush.maxBufferedBytes = 1 << 20;
+    options.flush.maxDelayMs = 20;
+    logger->init("idle", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    logger->logMsg("only line");
+    EXPECT_TRUE(fileLines(testDir + "/idle/idle.log").empty());
+    // Nothing else is logged; the batch still has to reach the file.
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_EQ(std::vector<std::string>{"only line"}, fileLines(testDir + "/idle/idle.log"));
+}
+
+static std::string decodeFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream out;
+    EXPECT_TRUE(binary_log::decode(in, out)) << path;
+    return out.str();
+}
+
+TEST_F(IntegrationTest, BinaryModeRoundTrip) {
+    LoggerOptions options;
+    options.binary = true;
+    logger->init("bin", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    for (int i = 0; i < 3; ++i) {
+        LITTLE_LOG_BINARY(*logger, "request %d from %s took %.1f ms", i, std::string("host"), 1.5 * i);
+    }
+    logger->logMsg("plain message");
+    LITTLE_LOG_BINARY(*logger, "no arguments");
+    logger->flush();
+
+    EXPECT_EQ("request 0 from host took 0.0 ms\n"
+              "request 1 from host took 1.5 ms\n"
+              "request 2 from host took 3.0 ms\n"
+              "plain message\n"
+              "no arguments\n",
+              decodeFile(testDir + "/bin/bin.log"));
+}
+
+TEST_F(IntegrationTest, LinePrefixInTextAndBinaryMode) {
+    LoggerOptions options;
+    options.prefix = line_prefix::kAll;
+    logger->init("prefix", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    logger->logMsg(LogLevel::Warn, "text line");
+    LITTLE_LOG_BINARY(*logger, "deferred %d", 7);
+    logger->flush();
+
+    const std::regex pattern(
+        "\\d{4}-\\d{2}-\\d{2} \\d{2}:\\d{2}:\\d{2}\\.\\d{6} (WARN |INFO ) \\[\\d+\\] (text line|deferred 7)");
+    std::ifstream in(testDir + "/prefix/prefix.log");
+    std::string line;
+    int lines = 0;
+    while (std::getline(in, line)) {
+        EXPECT_TRUE(std::regex_match(line, pattern)) << line;
+        ++lines;
+    }
+    EXPECT_EQ(2, lines);
+
+    options.binary = true;
+    options.async = true;
+    Logger binary;
+    binary.init("bprefix", testDir, 1, 3, testDir + "/backup", 10, options);
+    binary.disableTerminal();
+    binary.logMsg(LogLevel::Warn, "text line");
+    LITTLE_LOG_BINARY(binary, "deferred %d", 7);
+    binary.flush();
+    std::istringstream decoded(decodeFile(testDir + "/bprefix/bprefix.log"));
+    lines = 0;
+    while (std::getline(decoded, line)) {
+        EXPECT_TRUE(std::regex_match(line, pattern)) << line;
+        ++lines;
+    }
+    EXPECT_EQ(2, lines);
+}
+
+TEST_F(IntegrationTest, BinaryModeRotatesSelfDescribingSegments) {
+    LoggerOptions options;
+    options.binary = true;
+    logger->init("binrot", testDir, 1, 10, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    const int count = 100000;
+    for (int i = 0; i < count; ++i) {
+        LITTLE_LOG_BINARY(*logger, "event %d value %u", i, 7u);
+    }
+    logger->backup();
+
+    int lines = 0;
+    int segments = 0;
+    for (int index = 9; index >= 0; --index) {
+        std::string path = testDir + "/binrot/binrot" + (index == 0 ? ".log" : ".log" + std::to_string(index));
+        if (!RealFileSystem().fileExists(path)) {
+            continue;
+        }
+        ++segments;
+        std::istringstream decoded(decodeFile(path));
+        std::string line;
+        while (std::getline(decoded, line)) {
+            EXPECT_EQ("event " + std::to_string(lines) + " value 7", line);
+            ++lines;
+        }
+    }
+    EXPECT_GE(segments, 2);
+    EXPECT_EQ(count, lines);
+}
+
+TEST_F(IntegrationTest, BackupAsyncDoesNotBlockLogging) {
+    logger->init("snap", testDir, 1, 4, testDir + "/backup", 10);
+    logger->disableTerminal();
+    std::string payload(200, 'x');
+    for (int i = 0; i < 20000; ++i) {
+        logger->logMsg(payload);
+    }
+
+    std::future<BackupReport> pending = logger->backupAsync();
+    for (int i = 0; i < 1000; ++i) {
+        logger->logMsg("during backup " + std::to_string(i));
+    }
+    BackupReport report = pending.get();
+
+    ASSERT_EQ(4u, report.files.size());
+    EXPECT_EQ(0, report.failures);
+    for (const BackupReport::File& file : report.files) {
+        EXPECT_NE(CopyStrategy::None, file.strategy);
+        EXPECT_EQ(file.size, RealFileSystem().getFileSize(file.destination));
+    }
+    std::ifstream active(report.files[0].destination);
+    std::stringstream content;
+    content << active.rdbuf();
+    ASSERT_FALSE(content.str().empty());
+    EXPECT_EQ('\n', content.str().back());
+}
+
+TEST_F(IntegrationTest, InitRemovesCrashLeftovers) {
+    // What a process killed in the middle of backup() or of a compression
+    // job leaves behind.
+    RealFileSystem fs;
+    std::string dir = testDir + "/left/";
+    fs.createDirectory(testDir);
+    fs.createDirectory(testDir + "/left");
+    for (const char* name : {"left.log.snap3", "left.log2.snap12", "left.log2.idx.snap12",
+                             "left.log.z4", "left.log.z4.gz.tmp", "left.log2.gz.tmp",
+                             "left.log1.old", "left.log.snap", "left.log.zip", "left.snapshot",
+                             "notes.snap1"}) {
+        fs.writeToFile(dir + name, "x", false);
+    }
+    logger->init("left", testDir, 1, 3, testDir + "/backup", 10);
+    std::vector<std::string> names;
+    fs.listDirectory(testDir + "/left", &names);
+    std::sort(names.begin(), names.end());
+    EXPECT_EQ((std::vector<std::string>{"left.log.snap", "left.log.zip", "left.snapshot",
+                                        "notes.snap1"}),
+              names);
+}
+
+TEST_F(IntegrationTest, RotationContinuesWhileBackupCopies) {
+    auto fs = std::make_shared<StallingFileSystem>();
+    logger = std::make_unique<Logger>(fs);
+    logger->init("stall", testDir, 1, 4, testDir + "/backup", 10);
+    logger->disableTerminal();
+    for (int i = 0; i < 6000; ++i) {
+        logger->logMsg(std::string(200, 'x'));
+    }
+
+    std::future<BackupReport> pending = logger->backupAsync();
+    fs->waitForCopy();
+    uint64_t rotations = logger->snapshot().rotations;
+    for (int i = 0; i < 12000; ++i) {
+        logger->logMsg(std::string(200, 'y'));
+    }
+    logger->flush();
+    // The backup works on links to the segments, so rotation goes on.
+    EXPECT_GE(logger->snapshot().rotations, rotations + 2);
+    EXPECT_LE(fs->getFileSize(testDir + "/stall/stall.log"), 1024 * 1024);
+    fs->release();
+    BackupReport report = pending.get();
+
+    ASSERT_EQ(2u, report.files.size());
+    EXPECT_EQ(0, report.failures);
+    for (const BackupReport::File& file : report.files) {
+        EXPECT_EQ(file.size, fs->getFileSize(file.destination));
+        std::ifstream in(file.destination);
+        std::stringstream content;
+        content << in.rdbuf();
+        EXPECT_EQ(std::string::npos, content.str().find('y')) << file.destination;
+    }
+    std::vector<std::string> names;
+    fs->listDirectory(testDir + "/stall", &names);
+    for (const std::string& name : names) {
+        EXPECT_EQ(std::string::npos, name.find(".snap")) << name;
+    }
+}
+
+TEST_F(IntegrationTest, SequenceRotationKeepsManifest) {
+    LoggerOptions options;
+    options.rotation = RotationScheme::Sequence;
+    logger->init("seq", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    std::string payload(1000, 'x');
+    for (int i = 0; i < 5500; ++i) {
+        logger->logMsg(payload);
+    }
+    logger->flush();
+
+    RealFileSystem fs;
+    std::string dir = testDir + "/seq/";
+    std::string manifest;
+    ASSERT_TRUE(fs.readFile(dir + "seq.manifest", &manifest));
+    EXPECT_EQ("4 6\n", manifest);
+    EXPECT_FALSE(fs.fileExists(dir + "seq.0000000003.log"));
+    EXPECT_TRUE(fs.fileExists(dir + "seq.0000000004.log"));
+    EXPECT_TRUE(fs.fileExists(dir + "seq.0000000006.log"));
+    EXPECT_FALSE(fs.fileExists(dir + "seq.log1"));
+
+    BackupReport report = logger->backup();
+    ASSERT_EQ(3u, report.files.size());
+    EXPECT_EQ(report.directory + "/seq.0000000006.log", report.files[0].destination);
+    EXPECT_EQ(report.directory + "/seq.0000000004.log", report.files[2].destination);
+    ASSERT_TRUE(fs.readFile(report.directory + "/seq.manifest", &manifest));
+    EXPECT_EQ("4 6\n", manifest);
+
+    // The manifest follows the segments the backup holds, not how many.
+    fs.removeFile(dir + "seq.0000000005.log");
+    report = logger->backup();
+    ASSERT_EQ(2u, report.files.size());
+    ASSERT_TRUE(fs.readFile(report.directory + "/seq.manifest", &manifest));
+    EXPECT_EQ("4 6\n", manifest);
+    // A budget that stops before the oldest segment.
+    logger->init("seq", testDir, 1, 3, testDir + "/backup", 1, options);
+    logger->disableTerminal();
+    report = logger->backup();
+    ASSERT_EQ(1u, report.files.size());
+    ASSERT_TRUE(fs.readFile(report.directory + "/seq.manifest", &manifest));
+    EXPECT_EQ("6 6\n", manifest);
+
+    // A new logger picks the sequence up where the manifest left it.
+    long active = fs.getFileSize(dir + "seq.0000000006.log");
+    logger = std::make_unique<Logger>();
+    logger->init("seq", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    logger->logMsg("resumed");
+    logger->flush();
+    EXPECT_EQ(active + 8, fs.getFileSize(dir + "seq.0000000006.log"));
+}
+
+TEST_F(IntegrationTest, CompressionReplacesRotatedSegments) {
+    LoggerOptions options;
+    options.compression.workers = 2;
+    logger->init("gz", testDir, 1, 4, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    std::string payload(200, 'x');
+    for (int i = 0; i < 60000; ++i) {
+        logger->logMsg(payload + std::to_string(i));
+    }
+    logger->flush();
+    logger->waitForCompression();
+
+    RealFileSystem fs;
+    std::string dir = testDir + "/gz/gz";
+    EXPECT_TRUE(fs.fileExists(dir + ".log"));
+    for (int i = 1; i < 4; ++i) {
+        EXPECT_FALSE(fs.fileExists(dir + ".log" + std::to_string(i)));
+        EXPECT_TRUE(fs.fileExists(dir + ".log" + std::to_string(i) + ".gz"));
+    }
+    EXPECT_FALSE(fs.fileExists(dir + ".log4.gz"));
+
+    // The backup copies and budgets the compressed files.
+    BackupReport report = logger->backup();
+    ASSERT_EQ(4u, report.files.size());
+    EXPECT_EQ(report.directory + "/gz.log3.gz", report.files[3].destination);
+    EXPECT_LT(report.files[3].size, 100 * 1024);
+
+    std::string content;
+    ASSERT_TRUE(readSegment(dir + ".log1", &content));
+    std::string last = content.substr(content.rfind('\n', content.size() - 2) + 1);
+    std::ifstream active(dir + ".log");
+    std::string first;
+    std::getline(active, first);
+    EXPECT_EQ(std::stoi(last.substr(200)) + 1, std::stoi(first.substr(200)));
+}
+
+TEST_F(IntegrationTest, RotationContinuesWhileCompressing) {
+    auto fs = std::make_shared<StallingFileSystem>();
+    logger = std::make_unique<Logger>(fs);
+    LoggerOptions options;
+    options.compression.workers = 1;
+    logger->init("slowgz", testDir, 1, 4, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    std::string payload(200, 'x');
+    for (int i = 0; i < 6000; ++i) {
+        logger->logMsg(payload);
+    }
+    fs->waitForCopy();
+    // The job compresses a link to the segment, so the chain keeps moving.
+    uint64_t rotations = logger->snapshot().rotations;
+    for (int i = 0; i < 11000; ++i) {
+        logger->logMsg(payload);
+    }
+    logger->flush();
+    EXPECT_GE(logger->snapshot().rotations, rotations + 2);
+    EXPECT_LE(fs->getFileSize(testDir + "/slowgz/slowgz.log"), 1024 * 1024);
+    fs->release();
+    logger->waitForCompression();
+
+    std::vector<std::string> names;
+    fs->listDirectory(testDir + "/slowgz", &names);
+    std::sort(names.begin(), names.end());
+    EXPECT_EQ((std::vector<std::string>{"slowgz.log", "slowgz.log1.gz", "slowgz.log2.gz",
+                                        "slowgz.log3.gz"}),
+              names);
+    gzFile file = gzopen((testDir + "/slowgz/slowgz.log3.gz").c_str(), "rb");
+    ASSERT_NE(nullptr, file);
+    char line[256];
+    ASSERT_NE(nullptr, gzgets(file, line, sizeof(line)));
+    EXPECT_EQ(payload + "\n", line);
+    gzclose(file);
+}
+
+TEST_F(IntegrationTest, CompressionWithSequenceSegments) {
+    LoggerOptions options;
+    options.rotation = RotationScheme::Sequence;
+    options.compression.workers = 2;
+    logger->init("sgz", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    std::string payload(1000, 'y');
+    for (int i = 0; i < 6000; ++i) {
+        logger->logMsg(payload);
+    }
+    logger->flush();
+    logger->waitForCompression();
+
+    // A rotation that falls due while a job holds the chain is deferred, so
+    // only the shape of the result is fixed, not the exact sequence numbers.
+    RealFileSystem fs;
+    std::string manifest;
+    ASSERT_TRUE(fs.readFile(testDir + "/sgz/sgz.manifest", &manifest));
+    long firstSegment = 0;
+    long lastSegment = 0;
+    std::istringstream(manifest) >> firstSegment >> lastSegment;
+    EXPECT_EQ(3, lastSegment - firstSegment + 1);
+    auto segment = [&](long sequence) {
+        char name[32];
+        snprintf(name, sizeof(name), "/sgz/sgz.%010ld.log", sequence);
+        return testDir + name;
+    };
+    EXPECT_FALSE(fs.fileExists(segment(firstSegment - 1) + ".gz"));
+    for (long sequence = firstSegment; sequence < lastSegment; ++sequence) {
+        EXPECT_FALSE(fs.fileExists(segment(sequence)));
+        EXPECT_TRUE(fs.fileExists(segment(sequence) + ".gz"));
+    }
+    EXPECT_TRUE(fs.fileExists(segment(lastSegment)));
+}
+
+TEST_F(IntegrationTest, BinaryCallSitesFormatLazilyInTextMode) {
+    logger->init("lazy", testDir, 1, 3, testDir + "/backup", 10);
+    logger->disableTerminal();
+    LITTLE_LOG_BINARY(*logger, "%s=%d", "answer", 42);
+    logger->flush();
+
+    std::ifstream in(testDir + "/lazy/lazy.log");
+    std::string line;
+    ASSERT_TRUE(static_cast<bool>(std::getline(in, line)));
+    EXPECT_EQ("answer=42", line);
+}
+
+static std::vector<std::string> queryLines(LogReader& reader, int64_t from, int64_t to) {
+    std::vector<std::string> lines;
+    EXPECT_TRUE(reader.read(from, to, [&](const char* line, size_t length) {
+        lines.emplace_back(line, length);
+    }));
+    return lines;
+}
+
+TEST_F(IntegrationTest, IndexedSegmentsAnswerTimeRangeQueries) {
+    LoggerOptions options;
+    options.prefix = line_prefix::kTimestamp;
+    options.index.intervalBytes = 4096;
+    options.compression.workers = 1;
+    logger->init("idx", testDir, 1, 5, testDir + "/backup", 100, options);
+    logger->disableTerminal();
+    std::string payload(200, 'x');
+    for (int i = 0; i < 6000; ++i) {
+        logger->logMsg(payload);
+    }
+    logger->flush();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    int64_t from = LinePrefixFormatter::nowMicros();
+    for (int i = 0; i < 50; ++i) {
+        logger->logMsg("wanted " + std::to_string(i));
+    }
+    int64_t to = LinePrefixFormatter::nowMicros();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    for (int i = 0; i < 6000; ++i) {
+        logger->logMsg(payload);
+    }
+    logger->flush();
+    logger->waitForCompression();
+
+    // The wanted lines were rotated into idx.log1 and compressed since.
+    RealFileSystem fs;
+    std::string dir = testDir + "/idx";
+    EXPECT_TRUE(fs.fileExists(dir + "/idx.log1.gz"));
+    EXPECT_TRUE(fs.fileExists(dir + "/idx.log1.idx"));
+    EXPECT_TRUE(fs.fileExists(dir + "/idx.log2.idx"));
+
+    BackupReport report = logger->backup();
+    EXPECT_TRUE(fs.fileExists(report.directory + "/idx.log.idx"));
+    EXPECT_TRUE(fs.fileExists(report.directory + "/idx.log1.idx"));
+    logger.reset();
+    EXPECT_TRUE(fs.fileExists(dir + "/idx.log.idx"));
+
+    // The backup's copy of the active segment was indexed only up to its
+    // last complete block, the rest of it is read.
+    for (const std::string& path : {dir, report.directory}) {
+        LogReader reader({path});
+        ASSERT_EQ(3u, reader.segments().size()) << path;
+        std::vector<std::string> lines = queryLines(reader, from, to);
+        ASSERT_EQ(50u, lines.size()) << path;
+        for (int i = 0; i < 50; ++i) {
+            EXPECT_EQ(" wanted " + std::to_string(i), lines[i].substr(26));
+        }
+        EXPECT_EQ(path == dir ? 2 : 1, reader.stats().skipped);
+        EXPECT_LT(reader.stats().bytesRead, 3 * 4096 + 2 * 256);
+    }
+
+    // Backups and the live directory together, oldest first.
+    LogReader both({testDir + "/backup", dir});
+    EXPECT_EQ(6u, both.segments().size());
+    EXPECT_EQ(100u, queryLines(both, from, to).size());
+    EXPECT_TRUE(queryLines(both, to + 1000000, to + 2000000).empty());
+}
+
+// Sizes of the files a backup stores itself, by its backup.list.
+static long storedBytes(const std::string& root, const std::string& name,
+                        std::vector<std::string>* listed = nullptr) {
+    std::ifstream list(root + "/" + name + "/backup.list");
+    std::string id;
+    long size = 0;
+    std::string path;
+    long total = 0;
+    while (list >> id >> size >> path) {
+        if (path.compare(0, name.size() + 1, name + "/") == 0) {
+            total += size;
+        }
+        if (listed) {
+            listed->push_back(path);
+        }
+    }
+    return total;
+}
+
+TEST_F(IntegrationTest, IncrementalBackupReusesRotatedSegments) {
+    LoggerOptions options;
+    options.backup.incremental = true;
+    logger->init("inc", testDir, 1, 5, testDir + "/backup", 100, options);
+    logger->disableTerminal();
+    std::string payload(500, 'x');
+    for (int i = 0; i < 5000; ++i) {
+        logger->logMsg(payload + std::to_string(i));
+    }
+    logger->flush();
+    BackupReport first = logger->backup();
+    ASSERT_EQ(3u, first.files.size());
+    for (const BackupReport::File& file : first.files) {
+        EXPECT_FALSE(file.reused);
+    }
+
+    logger->logMsg("after the first backup");
+    logger->flush();
+    BackupReport second = logger->backup();
+    ASSERT_EQ(3u, second.files.size());
+    EXPECT_NE(first.directory, second.directory);
+    EXPECT_FALSE(second.files[0].reused);
+    EXPECT_TRUE(second.files[1].reused);
+    EXPECT_TRUE(second.files[2].reused);
+    EXPECT_EQ(first.files[2].destination, second.files[2].destination);
+    EXPECT_EQ(second.files[0].size, second.bytesMoved);
+
+    RealFileSystem fs;
+    std::vector<std::string> names;
+    ASSERT_TRUE(fs.listDirectory(second.directory, &names));
+    std::sort(names.begin(), names.end());
+    EXPECT_EQ((std::vector<std::string>{"backup.list", "inc.log"}), names);
+}
+
+// Slow to create directories, which widens any gap between checking for a
+// backup directory and creating it.
+class SlowDirectoryFileSystem : public RealFileSystem {
+public:
+    bool createDirectory(const std::string& path) override {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        return RealFileSystem::createDirectory(path);
+    }
+};
+
+TEST_F(IntegrationTest, ConcurrentIncrementalBackupsGetADirectoryEach) {
+    logger = std::make_unique<Logger>(std::make_shared<SlowDirectoryFileSystem>());
+    LoggerOptions options;
+    options.backup.incremental = true;
+    logger->init("concurrent", testDir, 1, 3, testDir + "/backup", 100, options);
+    logger->disableTerminal();
+    logger->logMsg("one line");
+    std::vector<std::future<BackupReport>> pending;
+    for (int i = 0; i < 4; ++i) {
+        pending.push_back(logger->backupAsync());
+    }
+    RealFileSystem fs;
+    std::set<std::string> directories;
+    for (std::future<BackupReport>& report : pending) {
+        std::string directory = report.get().directory;
+        directories.insert(directory);
+        EXPECT_TRUE(fs.fileExists(directory + "/backup.list")) << directory;
+    }
+    EXPECT_EQ(4u, directories.size());
+}
+
+TEST_F(IntegrationTest, BackupRetentionKeepsTotalUnderBudget) {
+    LoggerOptions options;
+    options.backup.incremental = true;
+    options.backup.totalMaxBytes = 3 * 1024 * 1024;
+    logger->init("keep", testDir, 1, 4, testDir + "/backup", 100, options);
+    logger->disableTerminal();
+    std::string payload(500, 'x');
+    int evicted = 0;
+    BackupReport report;
+    for (int round = 0; round < 5; ++round) {
+        for (int i = 0; i < 2500; ++i) {
+            logger->logMsg(payload + std::to_string(round));
+        }
+        logger->flush();
+        report = logger->backup();
+        evicted += report.evicted;
+    }
+    EXPECT_GT(evicted, 0);
+
+    RealFileSystem fs;
+    std::string root = testDir + "/backup/keep";
+    std::vector<std::string> names;
+    ASSERT_TRUE(fs.listDirectory(root, &names));
+    std::sort(names.begin(), names.end());
+    ASSERT_FALSE(names.empty());
+    long total = 0;
+    for (const std::string& name : names) {
+        total += storedBytes(root, name);
+    }
+    EXPECT_TRUE(names.size() == 1 || total <= options.backup.totalMaxBytes);
+
+    // Whatever the newest backup lists survived the eviction.
+    std::vector<std::string> listed;
+    storedBytes(root, names.back(), &listed);
+    EXPECT_EQ(report.files.size(), listed.size());
+    for (const std::string& path : listed) {
+        EXPECT_TRUE(fs.fileExists(root + "/" + path)) << path;
+    }
+}
+
+TEST_F(IntegrationTest, SteadyStateLoggingDoesNotAllocate) {
+    const std::string longLine(700, 'y');
+    for (bool async : {false, true}) {
+        LoggerOptions options;
+        options.async = async;
+        options.queueCapacity = 256;
+        options.prefix = line_prefix::kAll;
+        logger = std::make_unique<Logger>();
+        logger->init(async ? "async" : "sync", testDir, 10, 2, testDir + "/backup", 10,
+                     options);
+        logger->disableTerminal();
+        auto logAll = [&](int i) {
+            logger->logMsg("a literal longer than any small string buffer");
+            logger->logMsg(LogLevel::Warn, longLine.data(), longLine.size());
+            logger->logFormat("request %d took %.3f ms", i, i * 0.25);
+            logger->logFormat(LogLevel::Error, "%s %d", longLine.c_str(), i);
+            logger->logMsg(LogLevel::Debug, longLine.c_str());
+#if __cplusplus >= 201703L
+            logger->logMsg(std::string_view(longLine).substr(0, 100));
+#endif
+        };
+        for (int i = 0; i < 2000; ++i) {
+            logAll(i);
+        }
+        logger->flush();
+
+        countingAllocations = true;
+        allocationCount = 0;
+        for (int i = 0; i < 1000; ++i) {
+            logAll(i);
+        }
+        countingAllocations = false;
+        EXPECT_EQ(0, allocationCount) << (async ? "async" : "sync");
+
+        logger->flush();
+        std::ifstream in(testDir + (async ? "/async/async.log" : "/sync/sync.log"));
+        std::string line;
+        long lines = 0;
+        long formatted = 0;
+        while (std::getline(in, line)) {
+            ++lines;
+            formatted += line.find("request 999 took 249.750 ms") != std::string::npos;
+        }
+#if __cplusplus >= 201703L
+        EXPECT_EQ(3000 * 6, lines);
+#else
+        EXPECT_EQ(3000 * 5, lines);
+#endif
+        EXPECT_EQ(2, formatted);
+    }
+}
+
+static int threadCount() {
+    int threads = 0;
+    if (DIR* dir = opendir("/proc/self/task")) {
+        while (dirent* entry = readdir(dir)) {
+            threads += entry->d_name[0] != '.';
+        }
+        closedir(dir);
+    }
+    return threads;
+}
+
+TEST_F(IntegrationTest, RegistryChannelsShareOneWriter) {
+    int before = threadCount();
+    RegistryOptions options;
+    options.filePath = testDir;
+    options.fileSize = 1;
+    options.fileNum = 3;
+    options.backupPath = testDir + "/backup";
+    options.maxOpenFiles = 4;
+    auto registry = std::make_unique<LogRegistry>(options);
+    const int kChannels = 40;
+    for (int c = 0; c < kChannels; ++c) {
+        registry->channel("ch" + std::to_string(c)).disableTerminal();
+    }
+    EXPECT_EQ(static_cast<size_t>(kChannels), registry->names().size());
+
+    // Every 13th channel gets enough to rotate twice, the rest a little.
+    std::string payload(1000, 'x');
+    auto messages = [](int c) { return c % 13 == 0 ? 2500 : 50; };
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 4; ++t) {
+        producers.emplace_back([&, t] {
+            for (int i = 0; i < 2500; ++i) {
+                for (int c = t; c < kChannels; c += 4) {
+                    if (i < messages(c)) {
+                        registry->channel("ch" + std::to_string(c))
+                            .logMsg(payload + " " + std::to_string(i));
+                    }
+                }
+            }
+        });
+    }
+    if (threadCount() - before > 4 + 2) {
+        ADD_FAILURE() << "registry started " << threadCount() - before - 4 << " threads";
+    }
+    for (std::thread& producer : producers) {
+        producer.join();
+    }
+    registry->flush();
+    EXPECT_LE(registry->fileSystem().openCount(), options.maxOpenFiles);
+
+    // Rotation and backup() behave as for a standalone logger.
+    RealFileSystem fs;
+    for (int c = 0; c < kChannels; c += 13) {
+        std::string name = "ch" + std::to_string(c);
+        std::string dir = testDir + "/" + name + "/" + name;
+        EXPECT_TRUE(fs.fileExists(dir + ".log1"));
+        EXPECT_FALSE(fs.fileExists(dir + ".log3"));
+        EXPECT_LE(fs.getFileSize(dir + ".log1"), 1024 * 1024 + 2048);
+        std::ifstream active(dir + ".log");
+        std::string line;
+        std::string last;
+        while (std::getline(active, line)) {
+            last = line;
+        }
+        EXPECT_EQ(payload + " 2499", last);
+        BackupReport report = registry->channel(name).backup();
+        EXPECT_EQ(3u, report.files.size());
+    }
+    registry.reset();
+    EXPECT_LE(threadCount(), before);
+}
+
+TEST_F(IntegrationTest, DisabledTerminalStartsNoThread) {
+    int before = threadCount();
+    logger = std::make_unique<Logger>();
+    EXPECT_EQ(before, threadCount());
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    LoggerOptions options;
+    options.terminal.enabled = false;
+    options.terminal.fd = fds[1];
+    logger->init("quiet", testDir, 1, 3, testDir + "/backup", 10, options);
+    EXPECT_EQ(before, threadCount());
+
+    // Messages only reach the file; facts are still printed, unbuffered.
+    logger->enableTerminal();
+    logger->logMsg("to the file only");
+    logger->logFact("still printed");
+    logger->flush();
+    EXPECT_EQ(0u, logger->snapshot().terminalDropped);
+    EXPECT_EQ(std::vector<std::string>{"to the file only"},
+              fileLines(testDir + "/quiet/quiet.log"));
+    EXPECT_EQ("still printed\n", readAvailable(fds[0]));
+    close(fds[0]);
+    close(fds[1]);
+
+    options.terminal.enabled = true;
+    logger->init("quiet", testDir, 1, 3, testDir + "/backup", 10, options);
+    EXPECT_EQ(before + 1, threadCount());
+    logger.reset();
+    EXPECT_EQ(before, threadCount());
+}
+
+TEST_F(IntegrationTest, ProducerProcessesShareOneCollector) {
+    std::string name = "little-log-collector-" + std::to_string(getpid());
+    LoggerOptions options;
+    options.async = true;
+    options.shared.role = SharedRole::Collector;
+    options.shared.name = name;
+    options.shared.slots = 1024;
+    logger->init("shared", testDir, 1, 5, testDir + "/backup", 100, options);
+    logger->disableTerminal();
+
+    // Each child logs long lines through its own producer and exits without
+    // waiting for the collector; the ring is small enough to fill up.
+    const int kChildren = 3;
+    const int kLines = 1000;
+    std::vector<pid_t> children;
+    for (int c = 0; c < kChildren; ++c) {
+        pid_t child = fork();
+        ASSERT_GE(child, 0);
+        if (child == 0) {
+            LoggerOptions producerOptions;
+            producerOptions.shared.role = SharedRole::Producer;
+            producerOptions.shared.name = name;
+            Logger producer;
+            producer.init("shared", testDir, 1, 5, testDir + "/backup", 100, producerOptions);
+            producer.disableTerminal();
+            std::string payload(500, static_cast<char>('a' + c));
+            for (int i = 0; i < kLines; ++i) {
+                producer.logMsg(payload + " " + std::to_string(c) + " " + std::to_string(i));
+            }
+            bool ok = producer.backup().files.empty();
+            _exit(ok ? 0 : 2);
+        }
+        children.push_back(child);
+    }
+    for (pid_t child : children) {
+        int status = 0;
+        ASSERT_EQ(child, waitpid(child, &status, 0));
+        EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    logger->flush();
+
+    // Every line arrives whole, and each child's lines stay in order.
+    RealFileSystem fs;
+    std::vector<int> next(kChildren, 0);
+    for (int i = 5; i >= 0; --i) {
+        std::string path = testDir + "/shared/shared.log" + (i == 0 ? "" : std::to_string(i));
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            ASSERT_GT(line.size(), 503u);
+            int c = line[0] - 'a';
+            ASSERT_TRUE(c >= 0 && c < kChildren) << line;
+            EXPECT_EQ(std::string(500, line[0]) + " " + std::to_string(c) + " " +
+                          std::to_string(next[c]),
+                      line);
+            ++next[c];
+        }
+    }
+    for (int c = 0; c < kChildren; ++c) {
+        EXPECT_EQ(kLines, next[c]);
+    }
+    EXPECT_TRUE(fs.fileExists(testDir + "/shared/shared.log1"));
+    logger.reset();
+    EXPECT_TRUE(ShmRing::remove(name));
+}
+
+TEST_F(IntegrationTest, PendingLinesSurviveACrash) {
+    LoggerOptions options;
+    options.flush.maxBufferedBytes = 1 << 20;
+    options.pending.mapped = true;
+    std::string log = testDir + "/app/app.log";
+
+    // The child gets one batch written, then dies with the next one still
+    // buffered and without running a destructor.
+    pid_t child = fork();
+    ASSERT_GE(child, 0);
+    if (child == 0) {
+        Logger crashing;
+        crashing.init("app", testDir, 1, 3, testDir + "/backup", 10, options);
+        crashing.disableTerminal();
+        for (int i = 0; i < 100; ++i) {
+            crashing.logMsg("line " + std::to_string(i));
+            if (i == 39) {
+                crashing.flush();
+            }
+        }
+        kill(getpid(), SIGKILL);
+    }
+    int status = 0;
+    ASSERT_EQ(child, waitpid(child, &status, 0));
+    ASSERT_TRUE(WIFSIGNALED(status));
+    EXPECT_EQ(40u, fileLines(log).size());
+
+    logger->init("app", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    logger->logMsg("after");
+    logger->flush();
+    std::vector<std::string> lines = fileLines(log);
+    ASSERT_EQ(101u, lines.size());
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ("line " + std::to_string(i), lines[i]);
+    }
+    EXPECT_EQ("after", lines[100]);
+
+    // Recovered once: a clean shutdown and another init() add nothing.
+    logger.reset(new Logger());
+    logger->init("app", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger.reset();
+    EXPECT_EQ(101u, fileLines(log).size());
+}
+
+TEST_F(IntegrationTest, FatalSignalDrainsPendingLines) {
+    LoggerOptions options;
+    options.flush.maxBufferedBytes = 1 << 20;
+    options.pending.mapped = true;
+    options.pending.drainOnFatalSignal = true;
+    std::string log = testDir + "/app/app.log";
+
+    pid_t child = fork();
+    ASSERT_GE(child, 0);
+    if (child == 0) {
+        struct rlimit noCore = {0, 0};
+        setrlimit(RLIMIT_CORE, &noCore);
+        Logger crashing;
+        crashing.init("app", testDir, 1, 3, testDir + "/backup", 10, options);
+        crashing.disableTerminal();
+        for (int i = 0; i < 50; ++i) {
+            crashing.logMsg("line " + std::to_string(i));
+        }
+        abort();
+    }
+    int status = 0;
+    ASSERT_EQ(child, waitpid(child, &status, 0));
+    ASSERT_TRUE(WIFSIGNALED(status));
+    EXPECT_EQ(SIGABRT, WTERMSIG(status));
+
+    // On disk before anything restarts, and not repeated by the recovery.
+    EXPECT_EQ(50u, fileLines(log).size());
+    logger->init("app", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->flush();
+    std::vector<std::string> lines = fileLines(log);
+    ASSERT_EQ(50u, lines.size());
+    EXPECT_EQ("line 49", lines[49]);
+}
+
+TEST_F(IntegrationTest, FloodsAreCoalescedAndRateLimited) {
+    std::string log = testDir + "/app/app.log";
+    for (bool async : {false, true}) {
+        system(("rm -rf " + testDir).c_str());
+        LoggerOptions options;
+        options.async = async;
+        options.suppression.coalesceRepeats = true;
+        logger.reset(new Logger());
+        logger->init("app", testDir, 1, 3, testDir + "/backup", 10, options);
+        logger->disableTerminal();
+        for (int i = 0; i < 1000; ++i) {
+            logger->logMsg("dependency down");
+        }
+        logger->logMsg("recovered");
+        logger->logMsg(LogLevel::Warn, "x");
+        logger->logMsg(LogLevel::Error, "x");
+        logger->logMsg(LogLevel::Error, "x");
+        logger->flush();
+        std::vector<std::string> expected = {"dependency down", "last message repeated 999 times",
+                                             "recovered",       "x",
+                                             "x",               "last message repeated 1 times"};
+        EXPECT_EQ(expected, fileLines(log)) << (async ? "async" : "sync");
+        EXPECT_EQ(1000u, logger->snapshot().repeatsCoalesced);
+    }
+
+    // Messages are limited by their text, formatted ones by call site.
+    system(("rm -rf " + testDir).c_str());
+    LoggerOptions options;
+    options.suppression.perSecond = 1;
+    options.suppression.burst = 5;
+    logger.reset(new Logger());
+    logger->init("app", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    for (int i = 0; i < 100; ++i) {
+        logger->logMsg("same");
+        logger->logFormat("request %d failed", i);
+    }
+    logger->logMsg("other");
+    logger->flush();
+    std::vector<std::string> lines = fileLines(log);
+    ASSERT_EQ(11u, lines.size());
+    EXPECT_EQ(5, std::count(lines.begin(), lines.end(), "same"));
+    EXPECT_EQ("request 4 failed", lines[9]);
+    EXPECT_EQ("other", lines[10]);
+    MetricsSnapshot snapshot = logger->snapshot();
+    EXPECT_EQ(190u, snapshot.rateLimited);
+    EXPECT_EQ(11u, snapshot.messages);
+    EXPECT_NE(std::string::npos, snapshot.toJson().find("\"rate_limited\":190"));
+}
+
+TEST_F(IntegrationTest, StructuredRecordsBecomeJsonLines) {
+    const std::string expected =
+        "\"event\":\"login\",\"user\":\"ann \\\"a\\\"\\n\",\"attempt\":-3,\"bytes\":42,"
+        "\"ms\":1.25,\"ok\":true,\"ratio\":0.1,\"empty\":\"\"}";
+    auto logLogin = [](Logger& target) {
+        target.log(LogLevel::Info, "login", kv("user", std::string("ann \"a\"\n")), kv("attempt", -3),
+                   kv("bytes", 42u), kv("ms", 1.25), kv("ok", true), kv("ratio", 0.1), kv("empty", ""));
+    };
+
+    LoggerOptions options;
+    logger->init("kv", testDir, 1, 3, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    logLogin(*logger);
+    logger->log(LogLevel::Debug, "shutdown");
+    logger->flush();
+    EXPECT_EQ((std::vector<std::string>{"{" + expected, "{\"event\":\"shutdown\"}"}),
+              fileLines(testDir + "/kv/kv.log"));
+
+    // Values are copied into a per-thread buffer and rendered into the
+    // appender's, so neither allocates once they have grown.
+    for (int i = 0; i < 100; ++i) {
+        logLogin(*logger);
+    }
+    logger->flush();
+    countingAllocations = true;
+    allocationCount = 0;
+    for (int i = 0; i < 100; ++i) {
+        logLogin(*logger);
+    }
+    countingAllocations = false;
+    EXPECT_EQ(0, allocationCount);
+
+    // The prefix fields lead the object, in text and in binary segments.
+    const std::regex pattern(
+        "\\{\"ts\":\"\\d{4}-\\d{2}-\\d{2} \\d{2}:\\d{2}:\\d{2}\\.\\d{6}\",\"level\":\"INFO\","
+        "\"tid\":\\d+,");
+    options.prefix = line_prefix::kAll;
+    for (bool binary : {false, true}) {
+        options.binary = binary;
+        options.async = binary;
+        std::string name = binary ? "bkv" : "pkv";
+        Logger prefixed;
+        prefixed.init(name, testDir, 1, 3, testDir + "/backup", 10, options);
+        prefixed.disableTerminal();
+        logLogin(prefixed);
+        prefixed.logMsg("plain");
+        prefixed.flush();
+        std::string path = testDir + "/" + name + "/" + name + ".log";
+        std::vector<std::string> lines;
+        if (binary) {
+            std::istringstream decoded(decodeFile(path));
+            for (std::string line; std::getline(decoded, line);) {
+                lines.push_back(line);
+            }
+        } else {
+            lines = fileLines(path);
+        }
+        ASSERT_EQ(2u, lines.size()) << name;
+        std::smatch match;
+        ASSERT_TRUE(std::regex_search(lines[0], match, pattern)) << lines[0];
+        EXPECT_EQ(0, match.position());
+        EXPECT_EQ(expected, match.suffix().str());
+        EXPECT_NE(std::string::npos, lines[1].find("INFO "));
+    }
+}
+
+TEST_F(IntegrationTest, MappedBinarySegmentsKeepStructuredRecords) {
+    LoggerOptions options;
+    options.binary = true;
+    options.prefix = line_prefix::kLevel;
+    for (int run = 0; run < 2; ++run) {
+        // The second run reopens the segment, which cuts it back to its
+        // last complete entry.
+        Logger mapped(std::make_shared<MappedFileSystem>(64 * 1024));
+        mapped.init("mkv", testDir, 1, 3, testDir + "/backup", 10, options);
+        mapped.disableTerminal();
+        mapped.log(LogLevel::Info, "opened", kv("run", run));
+        mapped.logMsg("text " + std::to_string(run));
+        mapped.log(LogLevel::Warn, "closed", kv("run", run));
+    }
+    std::istringstream decoded(decodeFile(testDir + "/mkv/mkv.log"));
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(decoded, line);) {
+        lines.push_back(line);
+    }
+    EXPECT_EQ((std::vector<std::string>{
+                  "{\"level\":\"INFO\",\"event\":\"opened\",\"run\":0}",
+                  "INFO  text 0",
+                  "{\"level\":\"WARN\",\"event\":\"closed\",\"run\":0}",
+                  "{\"level\":\"INFO\",\"event\":\"opened\",\"run\":1}",
+                  "INFO  text 1",
+                  "{\"level\":\"WARN\",\"event\":\"closed\",\"run\":1}",
+              }),
+              lines);
+}
+
+TEST_F(IntegrationTest, GrepFindsLinesAcrossSegmentsAndBackups) {
+    LoggerOptions options;
+    options.compression.workers = 1;
+    logger->init("grep", testDir, 1, 5, testDir + "/backup", 100, options);
+    logger->disableTerminal();
+    std::string payload(200, 'x');
+    for (int i = 0; i < 12000; ++i) {
+        logger->logMsg(i % 1000 == 7 ? "Needle " + std::to_string(i) + " " + payload
+                                     : payload + " needle? no " + std::to_string(i));
+    }
+    logger->flush();
+    logger->waitForCompression();
+    BackupReport report = logger->backup();
+    logger.reset();
+
+    std::string dir = testDir + "/grep";
+    GrepOptions grepOptions;
+    grepOptions.threads = 4;
+    LogGrep grep({dir}, "^Needle ", grepOptions);
+    EXPECT_EQ(3u, grep.segments().size());
+    std::vector<GrepMatch> matches;
+    ASSERT_TRUE(grep.search(&matches));
+    ASSERT_EQ(12u, matches.size());
+    for (size_t i = 0; i < matches.size(); ++i) {
+        EXPECT_EQ("Needle " + std::to_string(i * 1000 + 7) + " " + payload, matches[i].line);
+        // Line numbers and offsets point at the line in its segment.
+        std::string content;
+        ASSERT_TRUE(readSegment(matches[i].segment.substr(0, matches[i].segment.find(".gz")),
+                                &content));
+        EXPECT_EQ(matches[i].line, content.substr(matches[i].offset, matches[i].line.size()));
+        EXPECT_EQ(matches[i].lineNumber,
+                  1 + std::count(content.begin(), content.begin() + matches[i].offset, '\n'));
+    }
+    EXPECT_GT(grep.bytesScanned(), 2 * 1024 * 1024);
+
+    // Unanchored and case-insensitive; backups come before the live files.
+    grepOptions.ignoreCase = true;
+    LogGrep both({testDir + "/backup", dir}, "NEEDLE 11", grepOptions);
+    matches.clear();
+    ASSERT_TRUE(both.search(&matches));
+    ASSERT_EQ(2u, matches.size());
+    EXPECT_EQ(0u, matches[0].segment.find(report.directory));
+    EXPECT_EQ(matches[0].line, matches[1].line);
+    EXPECT_EQ(0u, matches[1].segment.find(dir));
+}
+
+static const int kStressThreads = 16;
+static const int kStressPerThread = 4000;
+static const std::string kStressPadding(80, 'x');
+
+static void logConcurrently(Logger& logger) {
+    const int threads = kStressThreads;
+    const int perThread = kStressPerThread;
+    const std::string& padding = kStressPadding;
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&logger, &padding, t] {
+            for (int i = 0; i < perThread; ++i) {
+                logger.logMsg("t" + std::to_string(t) + " n" + std::to_string(i) + " " + padding);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    logger.flush();
+}
+
+static void verifyConcurrentLog(const std::string& dir, const std::string& name, int fileNum,
+                                int minRotated) {
+    const int threads = kStressThreads;
+    const int perThread = kStressPerThread;
+    const std::string& padding = kStressPadding;
+
+    std::vector<int> next(threads, 0);
+    int rotated = 0;
+    for (int index = fileNum - 1; index >= 0; --index) {
+        std::string path = dir + "/" + name + "/" + name +
+                           (index == 0 ? ".log" : ".log" + std::to_string(index));
+        std::string content;
+        if (!readSegment(path, &content)) {
+            continue;
+        }
+        std::istringstream in(content);
+        if (index > 0) {
+            ++rotated;
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            int t = -1;
+            int i = -1;
+            char rest[128] = {0};
+            ASSERT_EQ(3, sscanf(line.c_str(), "t%d n%d %127s", &t, &i, rest)) << line;
+            ASSERT_EQ(padding, std::string(rest)) << line;
+            ASSERT_TRUE(t >= 0 && t < threads) << line;
+            ASSERT_EQ(next[t], i) << line;
+            ++next[t];
+        }
+    }
+    EXPECT_GE(rotated, minRotated);
+    for (int t = 0; t < threads; ++t) {
+        EXPECT_EQ(perThread, next[t]) << "thread " << t;
+    }
+}
+
+static void runConcurrentStress(Logger& logger, const std::string& dir,
+                                const std::string& name, int fileNum, int minRotated = 3) {
+    logConcurrently(logger);
+    verifyConcurrentLog(dir, name, fileNum, minRotated);
+}
+
+TEST_F(IntegrationTest, ConcurrentLoggingAcrossRotations) {
+    logger->init("stress", testDir, 1, 16, testDir + "/backup", 10);
+    logger->disableTerminal();
+    runConcurrentStress(*logger, testDir, "stress", 16);
+}
+
+TEST_F(IntegrationTest, ShortLivedThreadsLoseNoLines) {
+    logger->init("churn", testDir, 1, 3, testDir + "/backup", 10);
+    logger->disableTerminal();
+    // Each round's threads are gone before the next round logs, so their
+    // staging buffers are released while the others keep appending.
+    for (int round = 0; round < 20; ++round) {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; ++t) {
+            threads.emplace_back([&, t] {
+                for (int i = 0; i < 10; ++i) {
+                    logger->logMsg("r" + std::to_string(round) + " t" + std::to_string(t));
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+    logger->flush();
+    EXPECT_EQ(20u * 8 * 10, fileLines(testDir + "/churn/churn.log").size());
+}
+
+TEST_F(IntegrationTest, ConcurrentLoggingWithCompression) {
+    LoggerOptions options;
+    options.compression.workers = 3;
+    logger->init("zstress", testDir, 1, 16, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    // Compression jobs hold off rotation while they run, so fewer, larger
+    // segments are fine here; what matters is that no line is lost.
+    runConcurrentStress(*logger, testDir, "zstress", 16, 1);
+}
+
+TEST_F(IntegrationTest, ConcurrentLoggingThroughMappedSegments) {
+    logger = std::make_unique<Logger>(std::make_shared<MappedFileSystem>(1024 * 1024, 5));
+    logger->init("mstress", testDir, 1, 16, testDir + "/backup", 10);
+    logger->disableTerminal();
+    logConcurrently(*logger);
+    // The active segment is preallocated until its handle is closed.
+    logger.reset();
+    verifyConcurrentLog(testDir, "mstress", 16, 3);
+    EXPECT_LE(RealFileSystem().getFileSize(testDir + "/mstress/mstress.log1"), 1024 * 1024);
+}
+
+TEST_F(IntegrationTest, ConcurrentLoggingThroughIoUring) {
+    logger = std::make_unique<Logger>(std::make_shared<IoUringFileSystem>());
+    logger->init("ustress", testDir, 1, 16, testDir + "/backup", 10);
+    logger->disableTerminal();
+    logConcurrently(*logger);
+    logger.reset();
+    verifyConcurrentLog(testDir, "ustress", 16, 3);
+}
+
+TEST_F(IntegrationTest, ConcurrentAsyncLoggingAcrossRotations) {
+    LoggerOptions options;
+    options.async = true;
+    options.flush.maxBufferedBytes = 64 * 1024;
+    logger->init("astress", testDir, 1, 16, testDir + "/backup", 10, options);
+    logger->disableTerminal();
+    runConcurrentStress(*logger, testDir, "astress", 16);
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();